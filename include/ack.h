@@ -0,0 +1,84 @@
+#ifndef __FLUENT_ACK_H__
+#define __FLUENT_ACK_H__
+
+#include <deque>
+#include <string>
+
+#include <sys/uio.h>
+
+#include <msgpack.hpp>
+
+#include "chunk_list.h"
+
+namespace fluent {
+
+    /* The forward protocol's at-least-once delivery: a message sent with
+     * a {"chunk": id} option is acknowledged by the server with
+     * {"ack": id}.  AckWindow keeps a copy of every message that has been
+     * written but not acknowledged yet, so up to `window` of them can be
+     * in flight at once and all of them can be sent again on a new
+     * connection.
+     *
+     * Not thread safe; the Sender serializes access. */
+    class AckWindow {
+    public:
+        /* base64 of 16 bytes */
+        static const size_t id_length = 24;
+
+    private:
+        struct Chunk {
+            std::string id;
+            std::string data;
+            double sent_at;
+            Chunk() : id(), data(), sent_at(0) { }
+        };
+
+        size_t window;
+        double timeout;
+        std::deque<Chunk> chunks;
+        /* an incomplete response, waiting for the rest of its bytes */
+        std::string input;
+
+    public:
+        AckWindow(size_t w, double t) : window(w ? w : 1), timeout(t), chunks(), input() { }
+
+        /* A chunk id no other message of this process carries. */
+        static std::string make_id();
+
+        /* Finds the id in a message whose options end with the chunk
+         * entry, as Batcher writes them.  False for anything else. */
+        static bool find_id(const char * data, size_t length, std::string& id);
+
+        bool full() const {
+            return chunks.size() >= window;
+        }
+        bool empty() const {
+            return chunks.empty();
+        }
+        size_t size() const {
+            return chunks.size();
+        }
+
+        /* Starts waiting for the ack of a message that has just been
+         * written completely.  Messages without a chunk id are ignored. */
+        void sent(const struct iovec * iov, size_t count, double now);
+        void sent(const char * data, size_t length, double now);
+
+        /* Feeds bytes read from the server and forgets the messages they
+         * acknowledge.  Throws if the server sends anything but acks. */
+        void received(const char * data, size_t length);
+
+        /* When the oldest unacknowledged message times out; 0 if there
+         * is none. */
+        double deadline() const {
+            return chunks.empty() ? 0 : chunks.front().sent_at + timeout;
+        }
+
+        /* Appends every unacknowledged message, oldest first, to out,
+         * pushing the offset each one ends at onto ends, and forgets
+         * them: the connection they were sent on is gone. */
+        void requeue(ChunkList& out, std::deque<size_t>& ends);
+    };
+}
+
+#endif /* __FLUENT_ACK_H__ */
@@ -0,0 +1,154 @@
+#ifndef __FLUENT_BATCH_H__
+#define __FLUENT_BATCH_H__
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include <msgpack.hpp>
+
+struct z_stream_s;
+
+namespace fluent {
+
+    /* Collects Message-mode records ([tag, time, record]) and regroups
+     * them by tag into fluentd's Forward ([tag, [[time, record], ...]])
+     * or PackedForward ([tag, bin(entries)]) modes, so each tag goes out
+     * once per batch instead of once per event.  CompressedPackedForward
+     * additionally gzips the entries and sends them with the
+     * {"compressed": "gzip"} option; that work happens in gather().
+     * With chunk ids on, every message also carries a {"chunk": id}
+     * option asking the server for an ack (see AckWindow).
+     *
+     * Not thread safe; the Sender serializes access. */
+    class Batcher {
+    public:
+        enum mode_t {
+            FORWARD,
+            PACKED_FORWARD,
+            COMPRESSED_PACKED_FORWARD,
+        };
+
+    private:
+        struct Group {
+            std::string tag;            /* msgpack-encoded tag */
+            ::msgpack::sbuffer entries; /* concatenated [time, record] */
+            size_t count;
+            ::msgpack::sbuffer head;    /* array, tag and entries headers */
+            std::string zbuf;           /* gzipped entries */
+            std::string option;         /* options map */
+            Group() : tag(), entries(), count(0), head(64), zbuf(), option() { }
+        };
+
+        mode_t mode;
+        size_t max_bytes;
+        double max_age;
+        /* 0: no limit on the record count */
+        size_t max_events;
+        /* > 0: the byte limit follows the incoming rate, see set_linger() */
+        double linger;
+        bool chunk_ids;
+
+        /* every live group, by tag; a group that stays empty through a
+         * whole flush is freed, so tags that come and go do not pile up */
+        std::unordered_map<std::string, Group *> index;
+        /* the groups holding entries, in the order they got their first */
+        std::vector<Group *> active;
+        /* the groups the last clear() emptied */
+        std::vector<Group *> resting;
+        std::string key;
+        /* records we could not parse a tag out of; sent as-is */
+        ::msgpack::sbuffer raw;
+        size_t bytes;
+        size_t count;
+        double oldest;
+        static constexpr double RATE_WINDOW = 0.1;
+        /* incoming bytes per second, averaged over windows of
+         * RATE_WINDOW seconds; what arrived in the current window so far */
+        double rate;
+        double window_start;
+        size_t window_bytes;
+
+        /* gzip state, kept between flushes so each chunk only pays for
+         * a deflateReset() */
+        z_stream_s * zstream;
+
+    public:
+        Batcher(mode_t m, size_t b, double age);
+        ~Batcher();
+
+        Batcher(const Batcher&) = delete;
+        Batcher& operator=(const Batcher&) = delete;
+
+        /* Files one packed Message-mode record.  now is a monotonic time
+         * in seconds, used for the age limit. */
+        void add(const char * data, size_t length, double now);
+
+        /* A batch also goes out once it holds n records; 0 for no limit. */
+        void set_max_events(size_t n) {
+            max_events = n;
+        }
+
+        /* Adapts the byte limit to the traffic: a batch goes out once it
+         * holds what arrives in `seconds` at the recent rate, between one
+         * record and max_bytes.  A record on a quiet stream then leaves at
+         * once, while a busy one is sent in batches that cost it about
+         * `seconds` of latency.  0 (the default) keeps max_bytes fixed. */
+        void set_linger(double seconds) {
+            linger = seconds;
+        }
+
+        /* True once the pending data reached the byte or record limit or
+         * the oldest pending event is max_age old. */
+        bool ready(double now) const {
+            return bytes && (bytes >= byte_limit() ||
+                    (max_events && count >= max_events) ||
+                    now - oldest >= max_age);
+        }
+
+        size_t byte_limit() const {
+            if( linger <= 0 ) {
+                return max_bytes;
+            }
+            /* this window so far is a floor on the rate, so a burst is
+             * batched before its window closes */
+            double recent = window_bytes / RATE_WINDOW;
+            double expected = (recent > rate ? recent : rate) * linger;
+            return expected < max_bytes ? static_cast<size_t>(expected) : max_bytes;
+        }
+
+        /* Seconds until ready() turns true on age alone; negative when
+         * nothing is pending. */
+        double time_left(double now) const {
+            return bytes ? max_age - (now - oldest) : -1.0;
+        }
+
+        size_t size() const {
+            return bytes;
+        }
+
+        void set_chunk_ids(bool on) {
+            chunk_ids = on;
+        }
+
+        /* Appends the buffers that make up every pending group to iov,
+         * without copying the entries.  They stay valid until clear().
+         * If ends is given, the index in iov one past each message is
+         * pushed onto it. */
+        void gather(std::vector<struct iovec>& iov, std::vector<size_t> * ends = nullptr);
+
+        /* Empties the batch once gathered buffers have been sent. */
+        void clear();
+
+        /* Length of the msgpack str header + body at data, or 0 if data
+         * does not start with a str. */
+        static size_t str_length(const char * data, size_t length);
+
+    private:
+        void compress(const char * data, size_t length, std::string& out);
+    };
+}
+
+#endif /* __FLUENT_BATCH_H__ */
@@ -0,0 +1,116 @@
+#ifndef __FLUENT_CHUNK_LIST_H__
+#define __FLUENT_CHUNK_LIST_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <sys/uio.h>
+
+namespace fluent {
+
+    /* Byte queue made of fixed-size chunks, for a Sender's backlog.
+     *
+     * Appending fills the last chunk and starts a new one when it is
+     * full, so earlier data is never moved or copied again, however long
+     * the queue grows.  Bytes are sent straight out of the chunks with
+     * gather() and a vectored write, and consume() hands the chunks it
+     * empties back to a process-wide pool instead of the heap, so a
+     * backlog that fills and drains over and over settles on the same
+     * few chunks.  Chunks a MSG_ZEROCOPY send may still be reading are
+     * pinned instead, until release() says the send is done.
+     *
+     * Not thread safe; the Sender serializes access.  The pool is. */
+    class ChunkList {
+    private:
+        struct Chunk {
+            char * data;
+            /* the bytes in use are [begin, end) */
+            size_t begin;
+            size_t end;
+        };
+
+        /* An emptied chunk, and the zerocopy send count it waits for. */
+        struct Pin {
+            char * data;
+            uint32_t seq;
+        };
+
+        std::deque<Chunk> chunks;
+        size_t bytes;
+        std::deque<Pin> pinned;
+
+    public:
+        static const size_t chunk_size = 16 * 1024;
+        /* Free chunks the pool keeps for reuse; more go back to the heap. */
+        static const size_t pool_max = 256;
+
+        ChunkList() : chunks(), bytes(0), pinned() { }
+        ~ChunkList();
+
+        ChunkList(const ChunkList&) = delete;
+        ChunkList& operator=(const ChunkList&) = delete;
+
+        size_t size() const {
+            return bytes;
+        }
+
+        bool empty() const {
+            return !bytes;
+        }
+
+        /* Appends a copy of length bytes (the name msgpack's buffers use). */
+        void write(const char * data, size_t length);
+
+        void write(const struct iovec * iov, size_t count) {
+            for( size_t i = 0; i < count; ++i ) {
+                write(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+            }
+        }
+
+        /* Appends buffers covering bytes [from, to) to iov, without
+         * copying.  They stay valid until the bytes are consumed. */
+        void gather(std::vector<struct iovec>& iov, size_t from, size_t to) const;
+
+        void gather(std::vector<struct iovec>& iov) const {
+            gather(iov, 0, bytes);
+        }
+
+        /* Drops the first n bytes. */
+        void consume(size_t n) {
+            drop(n, false, 0);
+        }
+
+        /* Drops the first n bytes, keeping the chunks emptied until
+         * release() reaches seq, as Socket::zerocopy_issued() counts. */
+        void consume(size_t n, uint32_t seq) {
+            drop(n, true, seq);
+        }
+
+        /* Returns the pinned chunks whose sends are done; done is
+         * Socket::reap_zerocopy()'s count. */
+        void release(uint32_t done);
+
+        /* Returns every pinned chunk, once nothing can read them. */
+        void release();
+
+        bool has_pinned() const {
+            return !pinned.empty();
+        }
+
+        void clear() {
+            consume(bytes);
+        }
+
+        /* Moves every chunk of other to the end of this list. */
+        void splice(ChunkList& other);
+
+    private:
+        void drop(size_t n, bool pin, uint32_t seq);
+        static char * take_chunk();
+        static void give_chunk(char * chunk);
+    };
+}
+
+#endif /* __FLUENT_CHUNK_LIST_H__ */
@@ -0,0 +1,113 @@
+#ifndef __FLUENT_DEDUP_H__
+#define __FLUENT_DEDUP_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef FLUENT_MT
+#include <pthread.h>
+#endif
+
+namespace fluent {
+
+    /* Collapses bursts of identical records, for Logger.
+     *
+     * Each thread has a small direct-mapped table of the records it logged
+     * last, keyed by a hash of the packed tag and record (the time left
+     * out).  The first of a run of identical records goes out as usual;
+     * repeats within the window after it are only counted.  Once the
+     * window is over (noticed by check() or expire(), when the slot is
+     * needed for another record, or when flush() is called) the last
+     * repeat goes out once more, with a "repeat_count" field added
+     * holding how many were held back.
+     *
+     * Off until set_window() is called; while off it costs one relaxed
+     * load per record. */
+    class Dedup {
+    private:
+        struct Slot {
+            uint64_t hash;
+            /* Dedup::clock() time the window opened */
+            int64_t first;
+            uint64_t repeats;
+            /* the packed tag and record map, and where the map starts */
+            std::string record;
+            size_t map_start;
+            /* the packed time of the last repeat */
+            std::string time;
+
+            Slot() : hash(0), first(0), repeats(0), record(), map_start(0), time() { }
+        };
+
+        struct Table {
+            std::vector<Slot> slots;
+            /* the next slot check() looks at for an expired window */
+            size_t cursor;
+#ifdef FLUENT_MT
+            pthread_mutex_t mutex;
+#endif
+
+            explicit Table(size_t size);
+            ~Table();
+
+            Table(const Table&) = delete;
+            Table& operator=(const Table&) = delete;
+        };
+
+        std::atomic<int64_t> window;
+        size_t table_size;
+        /* this object's PerThread id */
+        uint64_t id;
+        std::vector<Table *> tables;
+#ifdef FLUENT_MT
+        pthread_mutex_t tables_mutex;
+#endif
+
+    public:
+        Dedup();
+        ~Dedup();
+
+        Dedup(const Dedup&) = delete;
+        Dedup& operator=(const Dedup&) = delete;
+
+        /* Collapses repeats within seconds of each other; 0 turns it off.
+         * slots is the size of each thread's table, for the threads that
+         * log after the call. */
+        void set_window(double seconds, size_t slots = 64);
+
+        bool enabled() const {
+            return window.load(std::memory_order_relaxed) > 0;
+        }
+
+        /* Looks at one packed [tag, time, record] event; returns whether
+         * to send it.  Summaries of runs that are over, packed and ready
+         * to send, are appended to summaries.  tag_end and map_start are
+         * the offsets at which the time and the record map start. */
+        bool check(const char * data, size_t size, size_t tag_end, size_t map_start,
+                std::vector<std::string>& summaries);
+
+        /* Ends every run now, appending the summaries of those that had
+         * repeats. */
+        void flush(std::vector<std::string>& summaries);
+
+        /* Ends the runs whose window is over, appending the summaries of
+         * those that had repeats, for a timer to call.  Returns the
+         * clock() time to call it again: when the first window still
+         * open is over, or a window from now if none is. */
+        int64_t expire(std::vector<std::string>& summaries);
+
+    private:
+        Table * local();
+        /* Ends the runs opened by clock() time opened_by, or all of them
+         * for 0.  Returns when the first run left open was opened, 0 if
+         * none is. */
+        int64_t sweep(std::vector<std::string>& summaries, int64_t opened_by);
+        static void summarize(Slot& slot, std::vector<std::string>& summaries);
+        static int64_t clock();
+    };
+}
+
+#endif /* __FLUENT_DEDUP_H__ */
@@ -0,0 +1,484 @@
+#ifndef __FLUENT_DEFERRED_H__
+#define __FLUENT_DEFERRED_H__
+
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef FLUENT_MT
+#include <pthread.h>
+#endif
+
+#include <msgpack.hpp>
+
+#include "clock.h"
+#include "level.h"
+#include "tag.h"
+
+namespace fluent {
+
+    class Sender;
+
+    namespace deferred {
+
+        typedef ::msgpack::packer< ::msgpack::sbuffer> Packer;
+
+        /* How one argument is captured raw on the logging thread and
+         * packed later on the flusher.  Numbers and bools are copied as
+         * they are; strings as a 32-bit length and their bytes. */
+        template<typename V, typename Enable = void>
+        struct Arg {
+            static_assert(sizeof(V) == 0,
+                    "DeferredLogger takes numbers, bools and strings; log other values through Logger");
+        };
+
+        template<typename V>
+        struct Arg<V, typename std::enable_if<std::is_arithmetic<V>::value>::type> {
+            static size_t size(const V&) {
+                return sizeof(V);
+            }
+            static char * store(char * p, const V& value) {
+                memcpy(p, &value, sizeof(V));
+                return p + sizeof(V);
+            }
+            static const char * replay(const char * p, Packer& packer) {
+                V value;
+                memcpy(&value, p, sizeof(V));
+                packer.pack(value);
+                return p + sizeof(V);
+            }
+        };
+
+        struct StringArg {
+            static size_t size(const char * value) {
+                return sizeof(uint32_t) + ::strlen(value);
+            }
+            static size_t size(const std::string& value) {
+                return sizeof(uint32_t) + value.size();
+            }
+            static char * store(char * p, const char * value) {
+                return store(p, value, ::strlen(value));
+            }
+            static char * store(char * p, const std::string& value) {
+                return store(p, value.data(), value.size());
+            }
+            static char * store(char * p, const char * value, size_t length) {
+                uint32_t n = length;
+                memcpy(p, &n, sizeof(n));
+                memcpy(p + sizeof(n), value, length);
+                return p + sizeof(n) + length;
+            }
+            static const char * replay(const char * p, Packer& packer) {
+                uint32_t n;
+                memcpy(&n, p, sizeof(n));
+                packer.pack_str(n);
+                packer.pack_str_body(p + sizeof(n), n);
+                return p + sizeof(n) + n;
+            }
+        };
+
+        template<> struct Arg<char *> : StringArg { };
+        template<> struct Arg<const char *> : StringArg { };
+        template<> struct Arg<std::string> : StringArg { };
+
+        /* The arguments of one log() signature, in order. */
+        template<typename... Params>
+        struct Layout;
+
+        template<>
+        struct Layout<> {
+            static size_t size() {
+                return 0;
+            }
+            static char * store(char * p) {
+                return p;
+            }
+            static const char * replay(const char * p, Packer&) {
+                return p;
+            }
+        };
+
+        template<typename V, typename... Rest>
+        struct Layout<V, Rest...> {
+            template<typename A, typename... R>
+            static size_t size(const A& value, const R&... rest) {
+                return Arg<V>::size(value) + Layout<Rest...>::size(rest...);
+            }
+            template<typename A, typename... R>
+            static char * store(char * p, const A& value, const R&... rest) {
+                return Layout<Rest...>::store(Arg<V>::store(p, value), rest...);
+            }
+            static const char * replay(const char * p, Packer& packer) {
+                return Layout<Rest...>::replay(Arg<V>::replay(p, packer), packer);
+            }
+        };
+
+        inline std::string packed_key(const char * key, size_t length)
+        {
+            ::msgpack::sbuffer sbuf;
+            Packer packer(sbuf);
+            packer.pack_str(length);
+            packer.pack_str_body(key, length);
+            return std::string(sbuf.data(), sbuf.size());
+        }
+
+        inline std::string packed_key(const char * key)
+        {
+            return packed_key(key, ::strlen(key));
+        }
+
+        inline std::string packed_key(const std::string& key)
+        {
+            return packed_key(key.data(), key.size());
+        }
+
+        /* The values of key, value, ... pairs, in order; the keys are
+         * left to the call site's descriptor. */
+        template<typename... Params>
+        struct Pairs;
+
+        template<>
+        struct Pairs<> {
+            static size_t size() {
+                return 0;
+            }
+            static char * store(char * p) {
+                return p;
+            }
+            static void pack_keys(std::vector<std::string>&) { }
+            static const char * replay(const char * p, const std::string *, ::msgpack::sbuffer&, Packer&) {
+                return p;
+            }
+        };
+
+        template<typename K, typename V, typename... Rest>
+        struct Pairs<K, V, Rest...> {
+            template<typename A, typename B, typename... R>
+            static size_t size(const A&, const B& value, const R&... rest) {
+                return Arg<V>::size(value) + Pairs<Rest...>::size(rest...);
+            }
+            template<typename A, typename B, typename... R>
+            static char * store(char * p, const A&, const B& value, const R&... rest) {
+                return Pairs<Rest...>::store(Arg<V>::store(p, value), rest...);
+            }
+            template<typename A, typename B, typename... R>
+            static void pack_keys(std::vector<std::string>& keys, const A& key, const B&, const R&... rest) {
+                keys.push_back(packed_key(key));
+                Pairs<Rest...>::pack_keys(keys, rest...);
+            }
+            static const char * replay(const char * p, const std::string * key,
+                    ::msgpack::sbuffer& sbuf, Packer& packer) {
+                sbuf.write(key->data(), key->size());
+                return Pairs<Rest...>::replay(Arg<V>::replay(p, packer), key + 1, sbuf, packer);
+            }
+        };
+
+        struct Site;
+
+        typedef void (*replay_t)(const Site& site, const char * args, ::msgpack::sbuffer& sbuf);
+
+        /* Packs a record's map from its arguments, keys included. */
+        template<typename... Params>
+        void replay_record(const Site&, const char * args, ::msgpack::sbuffer& sbuf)
+        {
+            Packer packer(sbuf);
+            packer.pack_map(sizeof...(Params) / 2);
+            Layout<Params...>::replay(args, packer);
+        }
+
+        /* Packs a record's map from its values and the site's keys. */
+        template<typename... Params>
+        void replay_pairs(const Site& site, const char * args, ::msgpack::sbuffer& sbuf);
+
+        /* The descriptor a record carries, which packs its map.  log()
+         * has one per signature, and its records carry their keys.
+         * FLUENT_DEFER has one per call site, made on the first pass,
+         * holding the keys packed already: its records carry only the
+         * values. */
+        struct Site {
+            enum state_t {
+                EMPTY,
+                PREPARING,
+                READY,
+            };
+
+            std::atomic<int> state;
+            replay_t replay;
+            /* each key, packed */
+            std::vector<std::string> keys;
+
+            Site() : state(EMPTY), replay(nullptr), keys() { }
+            explicit Site(replay_t r) : state(READY), replay(r), keys() { }
+
+            Site(const Site&) = delete;
+            Site& operator=(const Site&) = delete;
+
+            bool ready() const {
+                return state.load(std::memory_order_acquire) == READY;
+            }
+
+            /* Packs the keys of the first pass; other threads passing
+             * meanwhile wait for it. */
+            template<typename... Params>
+            void prepare(const Params&... parameters) {
+                static_assert(sizeof...(Params) % 2 == 0, "FLUENT_DEFER takes keys and values in pairs");
+                int expected = EMPTY;
+                if( !state.compare_exchange_strong(expected, PREPARING) ) {
+                    while( !ready() ) {
+                        sched_yield();
+                    }
+                    return;
+                }
+                try {
+                    Pairs<typename std::decay<Params>::type...>::pack_keys(keys, parameters...);
+                }
+                catch(...) {
+                    keys.clear();
+                    state.store(EMPTY);
+                    throw;
+                }
+                replay = &replay_pairs<typename std::decay<Params>::type...>;
+                state.store(READY, std::memory_order_release);
+            }
+        };
+
+        template<typename... Params>
+        void replay_pairs(const Site& site, const char * args, ::msgpack::sbuffer& sbuf)
+        {
+            Packer packer(sbuf);
+            packer.pack_map(sizeof...(Params) / 2);
+            Pairs<Params...>::replay(args, site.keys.data(), sbuf, packer);
+        }
+
+        /* One logging thread's records, on their way to the flusher.
+         * Single producer, single consumer. */
+        struct Ring {
+            struct Header {
+                /* bytes to the next record; PADDING runs to the end */
+                uint32_t length;
+                uint32_t flags;
+                const Site * site;
+                const TagEntry * tag;
+                EventTime time;
+            };
+            static const uint32_t PADDING = 1;
+
+            char * data;
+            size_t mask;
+            char pad0[64];
+            std::atomic<size_t> head;
+            /* what the record being written takes, padding included */
+            size_t reserved;
+            char pad1[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+            std::atomic<size_t> tail;
+
+            explicit Ring(size_t capacity);
+            ~Ring();
+
+            Ring(const Ring&) = delete;
+            Ring& operator=(const Ring&) = delete;
+
+            /* Room for a header and length bytes of arguments, or nullptr
+             * if the ring is full.  Producer only. */
+            Header * reserve(size_t length);
+            void commit(Header * record);
+        };
+    }
+
+    /* Logger that leaves the msgpack encoding to a flusher thread.
+     *
+     * log() copies its arguments raw (numbers as they are, strings as
+     * their bytes) into a ring of the calling thread's own, along with
+     * the tag, the time and a descriptor made for that log() signature at
+     * compile time.  FLUENT_DEFER does better: its descriptor is made
+     * for the call site and holds the keys packed, so only the values
+     * are copied.  The flusher packs each record into [tag, time,
+     * record] from those and emits it through the Sender, which batches
+     * and sends it as usual; a logging thread pays for a few copies and
+     * one release store.
+     *
+     * Values must be numbers, bools or strings.  Records a full ring has
+     * no room for are dropped and counted.  Rings are kept until the
+     * DeferredLogger goes away, one per thread that ever logged through
+     * it. */
+    class DeferredLogger {
+    private:
+        std::string prefix;
+        TagCache tags;
+        Clock clock;
+        bool event_time;
+        Threshold threshold;
+        Sender& sender;
+        size_t ring_size;
+        /* this logger's PerThread id */
+        uint64_t id;
+        std::vector<deferred::Ring *> rings;
+        std::vector<deferred::Ring *> draining;
+        std::atomic<size_t> dropped;
+#ifdef FLUENT_MT
+        pthread_mutex_t rings_mutex;
+        pthread_t thread;
+        std::atomic<bool> running;
+#endif
+
+    public:
+        /* How long the flusher sleeps when every ring is empty. */
+        static const long idle_usec = 1000;
+
+        /* Records go to s, which must outlive this logger.  ring_size is
+         * each thread's ring, in bytes. */
+        DeferredLogger(const std::string& t, Sender& s, size_t ring_size = 256*1024);
+        ~DeferredLogger();
+
+        DeferredLogger(const DeferredLogger&) = delete;
+        DeferredLogger& operator=(const DeferredLogger&) = delete;
+
+        Tag tag(const std::string& label)
+        {
+            const TagEntry * entry = tags.lookup(label);
+            if( !entry ) {
+                entry = tags.insert(new TagEntry(label, full_tag(label)));
+            }
+            return Tag(entry);
+        }
+
+        void use_event_time(Clock::source_t source = Clock::COARSE)
+        {
+            clock.set_source(source);
+            event_time = true;
+        }
+
+        /* As for Logger: FLUENT_LOG skips records below l. */
+        void set_level(level_t l) {
+            threshold.set(l);
+        }
+
+        level_t get_level() const {
+            return threshold.get();
+        }
+
+        bool enabled(level_t l) const {
+            return threshold.enabled(l);
+        }
+
+        template<typename... Params>
+        bool log(const Tag& tag, const Params&... parameters)
+        {
+            typedef deferred::Layout<typename std::decay<Params>::type...> Args;
+            static const deferred::Site site(&deferred::replay_record<typename std::decay<Params>::type...>);
+            return push<Args>(site, tag, parameters...);
+        }
+
+        /* Unlike Logger, every label is kept in the tag cache: the
+         * flusher needs the tag after log() returns. */
+        template<typename... Params>
+        bool log(const std::string& label, const Params&... parameters)
+        {
+            return log(tag(label), parameters...);
+        }
+
+        template<typename... Params>
+        bool log(const char * label, const Params&... parameters)
+        {
+            return log(tag(label), parameters...);
+        }
+
+        /* What FLUENT_DEFER calls, with its call site's descriptor. */
+        template<typename... Params>
+        bool log(deferred::Site& site, const Tag& tag, const Params&... parameters)
+        {
+            typedef deferred::Pairs<typename std::decay<Params>::type...> Args;
+            if( !site.ready() ) {
+                site.prepare(parameters...);
+            }
+            return push<Args>(site, tag, parameters...);
+        }
+
+        template<typename... Params>
+        bool log(deferred::Site& site, const std::string& label, const Params&... parameters)
+        {
+            return log(site, tag(label), parameters...);
+        }
+
+        template<typename... Params>
+        bool log(deferred::Site& site, const char * label, const Params&... parameters)
+        {
+            return log(site, tag(label), parameters...);
+        }
+
+        /* Packs and emits what is in the rings now; returns the record
+         * count.  Call it by hand, from one thread at a time, or start()
+         * the flusher; while the flusher runs, this throws
+         * std::logic_error, since each ring has room for one reader. */
+        size_t drain();
+
+        size_t get_dropped() const {
+            return dropped.load(std::memory_order_relaxed);
+        }
+
+#ifdef FLUENT_MT
+        void start();
+        /* Stops the flusher after a last drain(). */
+        void stop();
+#endif
+
+    private:
+        template<typename Args, typename... Params>
+        bool push(const deferred::Site& site, const Tag& tag, const Params&... parameters)
+        {
+            deferred::Ring * ring = local();
+            deferred::Ring::Header * record = ring->reserve(Args::size(parameters...));
+            if( !record ) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            record->site = &site;
+            record->tag = tag.get();
+            record->time = event_time ? clock.now() : EventTime(::time(NULL));
+            Args::store(reinterpret_cast<char *>(record + 1), parameters...);
+            ring->commit(record);
+            return true;
+        }
+
+        deferred::Ring * local();
+        size_t drain_rings();
+        size_t drain(deferred::Ring& ring, ::msgpack::sbuffer& sbuf);
+
+        std::string full_tag(const std::string& label) const
+        {
+            if( prefix.size() ) {
+                if( label.size() ) {
+                    return prefix + "." + label;
+                }
+                return prefix;
+            }
+            return label;
+        }
+
+#ifdef FLUENT_MT
+        static void * flusher_main(void * self);
+#endif
+    };
+}
+
+/* Logs through a DeferredLogger with a descriptor made for this call
+ * site, so only the values go through the ring:
+ *
+ *     FLUENT_DEFER(deferred, "", "from", user, "bytes", size);
+ *
+ * The keys are packed on the first pass and used from then on; they
+ * must not change between passes, which string literals see to. */
+#define FLUENT_DEFER(logger, label, ...) \
+    do { \
+        static ::fluent::deferred::Site fluent_deferred_site_; \
+        (logger).log(fluent_deferred_site_, label, __VA_ARGS__); \
+    } while( 0 )
+
+#endif /* __FLUENT_DEFERRED_H__ */
@@ -0,0 +1,141 @@
+#ifndef __FLUENT_ENDPOINT_H__
+#define __FLUENT_ENDPOINT_H__
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "socket.h"
+
+namespace fluent {
+
+    /* One aggregator a Sender may send to, with its own connection.
+     * A host of "unix:///some/path" means a UNIX domain socket at
+     * /some/path, say a forwarder on the same machine; port is ignored. */
+    struct Endpoint {
+        bool local;
+        /* the path, for a UNIX domain socket */
+        std::string host;
+        int port;
+        int weight;
+        Socket * sock;
+        /* not picked before this (monotonic) time after a failure */
+        double down_until;
+        /* failures since data last went through */
+        unsigned failures;
+        /* when a connect in the background is given up on */
+        double connect_deadline;
+        /* smooth weighted round-robin state */
+        int current_weight;
+
+        Endpoint(const std::string& h, int p, int w)
+            : local(is_local(h)), host(local ? h.substr(7) : h), port(p), weight(w > 0 ? w : 1),
+                sock(new Socket(local ? Socket::LOCAL : Socket::INET, Socket::STREAM)),
+                down_until(0), failures(0), connect_deadline(0), current_weight(0) { }
+        ~Endpoint() {
+            delete sock;
+        }
+
+        Endpoint(const Endpoint&) = delete;
+        Endpoint& operator=(const Endpoint&) = delete;
+
+        static bool is_local(const std::string& h) {
+            return h.compare(0, 7, "unix://") == 0;
+        }
+
+        /* for messages */
+        std::string name() const {
+            return local ? "unix://" + host : host + ":" + std::to_string(port);
+        }
+    };
+
+    /* The aggregators behind a Sender and the choice of which one gets
+     * the next send.
+     *
+     * ROUND_ROBIN spreads sends in proportion to the weights, interleaved
+     * rather than in runs (nginx's smooth weighted round-robin).
+     * LEAST_OUTSTANDING picks the connection with the fewest bytes still
+     * waiting in the kernel for the aggregator's TCP ack, per unit of
+     * weight, so a slow aggregator gets less; where the platform cannot
+     * tell, it behaves like ROUND_ROBIN.  One not connected yet counts as
+     * busy as the busiest connected one: it only wins a tie, so it does
+     * not take every send for having nothing outstanding, and an idle
+     * set still takes turns.
+     *
+     * An endpoint that fails is left alone for a while, so its share goes
+     * to the others at once and nobody waits on its connect.  The wait
+     * starts at backoff_initial seconds and doubles with every failure in
+     * a row, up to backoff_max; each one is drawn at random from its upper
+     * half, so processes that lost the same aggregator do not all come
+     * back to it at the same moment.
+     *
+     * Not thread safe; the Sender serializes access. */
+    class EndpointSet {
+    public:
+        enum policy_t {
+            ROUND_ROBIN,
+            LEAST_OUTSTANDING,
+        };
+
+    private:
+        std::vector<Endpoint *> endpoints;
+        policy_t policy;
+        double backoff_initial;
+        double backoff_max;
+        std::minstd_rand jitter;
+        /* scratch for candidates(): each healthy endpoint's outstanding
+         * bytes and the weight they are divided by */
+        std::vector<std::pair<long, long> > load;
+
+    public:
+        EndpointSet();
+        ~EndpointSet();
+
+        EndpointSet(const EndpointSet&) = delete;
+        EndpointSet& operator=(const EndpointSet&) = delete;
+
+        size_t add(const std::string& host, int port, int weight = 1);
+
+        void set_policy(policy_t p) {
+            policy = p;
+        }
+
+        void set_backoff(double initial, double max) {
+            backoff_initial = initial;
+            backoff_max = max < initial ? initial : max;
+        }
+
+        size_t size() const {
+            return endpoints.size();
+        }
+        Endpoint& operator[](size_t i) {
+            return *endpoints[i];
+        }
+
+        /* Fills out with endpoint indices in the order to try them: the
+         * healthy ones, the policy's pick first, then the ones backing
+         * off, soonest back first.  Returns how many are healthy.  Picking
+         * advances the round-robin, so call it once per send. */
+        size_t candidates(double now, std::vector<size_t>& out);
+
+        /* Closes the endpoint's connection and backs off from it. */
+        void failed(size_t i, double now);
+
+        /* Data went through, so the next failure backs off from scratch. */
+        void succeeded(size_t i) {
+            endpoints[i]->failures = 0;
+        }
+
+        /* Ends every backoff now, for a last attempt. */
+        void retry_now();
+
+        /* True if some endpoint is not backing off. */
+        bool available(double now) const;
+
+        /* When the first endpoint backing off may be tried again. */
+        double next_retry() const;
+    };
+}
+
+#endif /* __FLUENT_ENDPOINT_H__ */
@@ -0,0 +1,105 @@
+#ifndef __FLUENT_EVENT_LOOP_H__
+#define __FLUENT_EVENT_LOOP_H__
+
+#include <atomic>
+#include <vector>
+
+#include <pthread.h>
+
+namespace fluent {
+
+    /* One I/O thread multiplexing any number of non-blocking connections
+     * (epoll on Linux, poll() elsewhere).
+     *
+     * Handlers are driven entirely from the loop thread: on_io() for
+     * readiness on the descriptors they watch, then on_tick() once per
+     * iteration for everything else (draining queues, deadlines).  The
+     * loop sleeps until a watched descriptor is ready, the earliest
+     * handler deadline passes, or notify() is called. */
+    class EventLoop {
+    public:
+        enum {
+            READABLE = 1,
+            WRITABLE = 2,
+            ERROR = 4,
+        };
+
+        class Handler {
+            friend class EventLoop;
+        private:
+            double deadline;
+
+        public:
+            Handler() : deadline(0) { }
+            virtual ~Handler() { }
+
+            virtual void on_io(int fd, unsigned events, double now) = 0;
+            virtual void on_tick(double now) = 0;
+
+            /* True when on_tick() has work to do right away, so the loop
+             * must not go to sleep.  Called from the loop thread. */
+            virtual bool busy() const = 0;
+        };
+
+    private:
+        struct Watch {
+            int fd;
+            Handler * handler;
+            unsigned events;
+        };
+
+        int pollfd;
+        int wake_read;
+        int wake_write;
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        std::atomic<bool> running;
+        std::atomic<bool> sleeping;
+        std::vector<Handler *> handlers;
+        std::vector<Watch> watches;
+        std::vector<Watch> ready;
+
+    public:
+        EventLoop();
+        ~EventLoop();
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        /* Spawns the loop thread / stops and joins it. */
+        void start();
+        void stop();
+
+        /* Safe from any thread.  remove() waits for the loop to finish the
+         * current iteration, so the handler is never called afterwards. */
+        void add(Handler * handler);
+        void remove(Handler * handler);
+
+        /* Loop thread only (i.e. from inside a handler callback). */
+        void watch(Handler * handler, int fd, unsigned events);
+        void unwatch(int fd);
+        void set_deadline(Handler * handler, double when) {
+            handler->deadline = when;
+        }
+
+        /* Wakes the loop if it is asleep.  Cheap enough to call after
+         * every enqueue: it only makes a syscall when the loop sleeps. */
+        void notify()
+        {
+            if( sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false) ) {
+                wake();
+            }
+        }
+
+        /* Monotonic time in seconds, the clock all deadlines use. */
+        static double now();
+
+    private:
+        void wake();
+        void run();
+        void wait(int timeout_ms);
+        static void * loop_main(void * self);
+    };
+}
+
+#endif /* __FLUENT_EVENT_LOOP_H__ */
@@ -1,36 +1,166 @@
 #ifndef __FLUENT_CPP_H__
 #define __FLUENT_CPP_H__
 
+#include <string.h>
 #include <time.h>
+#include <deque>
 #include <exception>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <msgpack.hpp>
 
 #ifdef FLUENT_MT
+#include <atomic>
 #include <pthread.h>
+#include "ack.h"
+#include "event_loop.h"
+#include "queue.h"
 #endif
 
+#include "batch.h"
+#include "chunk_list.h"
+#include "dedup.h"
+#include "clock.h"
+#include "deferred.h"
+#include "endpoint.h"
+#include "level.h"
+#include "limit.h"
+#include "metrics.h"
+#include "schema.h"
+#include "shm_ring.h"
 #include "socket.h"
+#include "spool.h"
+#include "tag.h"
 
 namespace fluent {
     
-    class Sender {
+    class Sender
+#ifdef FLUENT_MT
+        : protected EventLoop::Handler
+#endif
+    {
+    public:
+        /* What becomes of records that would take the backlog past bufmax
+         * (or past the memory ceiling) while no endpoint takes them. */
+        enum overflow_t {
+            /* the backlog is thrown away to make room */
+            DROP_BACKLOG,
+            /* the backlog is kept and the new records are dropped */
+            DROP_NEWEST,
+            /* whole units (one send's records) are dropped, oldest first,
+             * until the new ones fit */
+            DROP_OLDEST,
+            /* the logging thread waits for an endpoint, up to a timeout,
+             * then drops the new records; other threads' sends queue up
+             * behind it, each for its own timeout at most */
+            BLOCK,
+            /* past half of bufmax only one send in n is kept, so a long
+             * outage leaves a thinned out record of it; when full, the
+             * new records are dropped */
+            SAMPLE,
+        };
+
+        /* Called with each batch of records given up on, on the thread
+         * that gave up on it; the buffers are only valid for the call. */
+        typedef void (*drop_callback_t)(const struct iovec * iov, size_t count, void * arg);
+
+        /* Called with every failed send or connect, with the endpoint's
+         * name and what went wrong, on the thread that saw it. */
+        typedef void (*error_callback_t)(const char * endpoint, const char * what, void * arg);
+
     protected:
-        std::string host;
-        int port;
         size_t bufmax;
         float timeout;
+        /* < 0: connects are bounded by timeout */
+        float connect_timeout;
         bool verbose;
 
-        msgpack::sbuffer * buf;
-        Socket sock;
+        /* the backlog; in async mode, the output queue */
+        ChunkList buf;
+        /* byte lengths of the units in the blocking backlog, oldest first */
+        std::deque<size_t> backlog_units;
+        /* what this Sender counts against the memory ceiling */
+        size_t charged;
+        overflow_t overflow;
+        float block_timeout;
+        size_t sample_every;
+        size_t sampled;
+        drop_callback_t on_drop;
+        void * on_drop_arg;
+        error_callback_t on_error;
+        void * on_error_arg;
+        /* failed sends and connects, over every endpoint */
+#ifdef FLUENT_MT
+        std::atomic<size_t> failures;
+#else
+        size_t failures;
+#endif
+        EndpointSet endpoints;
+        /* the endpoint sent to last, and its connection */
+        size_t current;
+        Socket * sock;
+        /* scratch for EndpointSet::candidates() */
+        std::vector<size_t> order;
+        /* nullptr means a backlog past bufmax is dropped */
+        Spool * spool;
+
+        /* nullptr means Message mode: every record is sent on its own */
+        Batcher * batcher;
+        /* set_flush_policy()'s, for every batcher made */
+        size_t flush_events;
+        float flush_linger;
+        /* scatter-gather lists for one send: what the caller handed over,
+         * and that plus the backlog as the socket consumes it */
+        std::vector<struct iovec> chunks;
+        std::vector<struct iovec> sending;
 #ifdef FLUENT_MT
         // TODO RAII on the mutex and the locks
         pthread_mutex_t mutex;
+        /* Set while a send waits out BLOCK with mutex let go; other
+         * sends wait on unblocked until it is back. */
+        bool blocked;
+        pthread_cond_t unblocked;
+
+        /* Async mode: callers only push onto queue; an EventLoop drains
+         * it and drives sock non-blocking.  From then on only the loop
+         * thread touches sock, batcher and buf. */
+        MPSCQueue<std::string> * queue;
+        EventLoop * loop;
+        /* set when start_async() made a private loop for this Sender */
+        EventLoop * own_loop;
+        std::atomic<size_t> dropped;
+        std::atomic<bool> flush_requested;
+
+        enum conn_state_t {
+            DISCONNECTED,
+            CONNECTING,
+            CONNECTED,
+        };
+        conn_state_t state;
+        int watched_fd;
+        double retry_at;
+        double connect_deadline;
+        /* In async mode buf is the output queue.  out_offset bytes of it
+         * are written; unit_start is where the unit being written begins
+         * and unit_ends holds where the later units end.  A unit (one
+         * forward message or one drained run of records) is resent whole
+         * on a new connection if the old one died part way through it. */
+        size_t out_offset;
+        size_t unit_start;
+        std::deque<size_t> unit_ends;
+        /* buf holds a copy of the spool's oldest units, which are
+         * consumed from the spool as they are written */
+        bool replaying;
+        /* nullptr unless require_ack() was called */
+        AckWindow * acks;
+        /* one message of a gathered batch, when they are staged apart */
+        std::vector<struct iovec> message;
+        std::vector<size_t> message_ends;
 #endif
         
     public:
@@ -38,100 +168,879 @@ namespace fluent {
                 size_t b = 1024*1024, float _timeout = 3.0, bool v = false);
         ~Sender();
 
+        Sender(const Sender&) = delete;
+        Sender& operator=(const Sender&) = delete;
+
         bool emit(const ::msgpack::sbuffer& sbuf)
         {
-            send(sbuf);
+            return emit(sbuf.data(), sbuf.size());
+        }
+
+        /* One record already packed as [tag, time, record]. */
+        bool emit(const char * data, size_t length)
+        {
+#ifdef FLUENT_MT
+            if( queue ) {
+                return enqueue(data, length);
+            }
+#endif
+            send(data, length);
             return true;
             /* TODO this might throw exceptions when I write socket / connect / etc. */
         }
 
+        /* Groups records by tag and sends them in Forward / PackedForward
+         * mode once max_bytes are pending or the oldest pending record is
+         * max_age seconds old.  Call this before anyone logs through the
+         * Sender.  Without an async flusher, the age limit is only checked
+         * when the next record is emitted or flush() is called, and the
+         * emitting thread pays for COMPRESSED_PACKED_FORWARD's gzip; with
+         * start_async() all of that happens on the flusher. */
+        void set_batching(Batcher::mode_t mode, size_t max_bytes = 64*1024, float max_age = 1.0);
+
+        /* More ways for a batch to go out, on top of set_batching()'s
+         * size and age: once it holds max_events records (0 for no
+         * limit), and, with linger > 0, once it holds what arrives in
+         * linger seconds at the recent rate (see Batcher::set_linger).
+         * Quiet streams then send each record straight away and busy ones
+         * batch up to max_bytes, without tuning per service.  Turns on
+         * FORWARD batching unless another mode was chosen. */
+        void set_flush_policy(size_t max_events, float linger = 0.0);
+
+        /* TCP options on every endpoint's connection; see
+         * Socket::set_nodelay, set_cork and set_send_buffer.  send_buffer
+         * 0 leaves the kernel default.  False if some endpoint refused
+         * one of them (UNIX sockets have neither Nagle nor cork). */
+        bool set_socket_options(bool nodelay, bool cork = false, int send_buffer = 0);
+
+        /* How to shed load once the backlog is full; see overflow_t.
+         * Without a spool, the blocking backlog follows the policy.  In
+         * async mode the queue is bounded instead: BLOCK makes emit()
+         * wait for room in it, and the other policies refuse the newest
+         * records.  The default is DROP_BACKLOG. */
+        void set_overflow(overflow_t policy, float block_timeout = 1.0, size_t sample_every = 10);
+
+        void set_drop_callback(drop_callback_t callback, void * arg = nullptr) {
+            on_drop = callback;
+            on_drop_arg = arg;
+        }
+
+        /* Without an error callback, a failure is written to std::cerr
+         * only when its endpoint was working until then (every one, if
+         * the Sender is verbose), so an aggregator that stays down does
+         * not flood the log. */
+        void set_error_callback(error_callback_t callback, void * arg = nullptr) {
+            on_error = callback;
+            on_error_arg = arg;
+        }
+
+        size_t get_failures() const {
+            return failures;
+        }
+
+        /* Caps the bytes held in backlogs by every Sender in the process
+         * together; 0 (the default) for no cap.  A blocking backlog never
+         * goes past it; async output may by up to one drained batch per
+         * Sender. */
+        static void set_memory_ceiling(size_t bytes);
+
+        /* Sends whatever the batcher holds right now.  In async mode this
+         * only asks the loop to do so and returns without waiting. */
+        void flush();
+
+        /* Lets the backlog overflow to disk instead of being dropped once
+         * it passes bufmax: see Spool.  Everything spooled is sent, in
+         * order, ahead of new records when the connection comes back; what
+         * is still spooled when the Sender goes away is sent by the next
+         * one using dir.  Call this before anyone logs through the Sender. */
+        void set_spool(const std::string& dir, size_t segment_size = 16*1024*1024,
+                size_t max_segments = 64);
+
+        /* Sends to another aggregator as well as the one the Sender was
+         * made with; weight is its share relative to the others.  Each
+         * send goes to one endpoint, chosen by the balancing policy among
+         * those that have not failed lately, and a send that fails is
+         * retried on the next endpoint straight away.  In async mode the
+         * Sender keeps one connection at a time and only moves to the
+         * next endpoint when that one fails.  Call this before any other
+         * setting, and before anyone logs through the Sender. */
+        void add_endpoint(const std::string& h, int p, int weight = 1);
+
+        void set_balancing(EndpointSet::policy_t policy) {
+            endpoints.set_policy(policy);
+        }
+
+        /* Gives up on connecting to an endpoint after t seconds rather
+         * than the send timeout, so failing over to the next one is quick. */
+        void set_connect_timeout(float t);
+
+        /* How long an endpoint that failed is left alone: initial seconds,
+         * doubling with each failure in a row up to max, with jitter.
+         * After the first connect, which blocks in the constructor,
+         * reconnecting goes on in the background: while no endpoint is
+         * connected, records go to the backlog (or the spool) without a
+         * wait on the network or an exception.  The destructor makes one
+         * last, blocking attempt to send the backlog regardless. */
+        void set_reconnect_backoff(float initial = 0.5, float max = 30.0) {
+            endpoints.set_backoff(initial, max);
+        }
+
+        /* In async mode, backlog writes of at least threshold bytes go
+         * out with MSG_ZEROCOPY where the platform has it (see
+         * Socket::set_zerocopy); their chunks are pinned until the loop
+         * sees the kernel is done with them.  Blocking sends copy as
+         * before: they go out of the caller's buffers. */
+        bool set_zerocopy(size_t threshold);
+
+#ifdef FLUENT_MT
+        /* Switches to async mode on a loop of this Sender's own: emit()
+         * copies the record into a bounded lock-free queue of `capacity`
+         * slots and returns; the loop thread batches the queue and does
+         * all the socket work, without ever blocking on the network.
+         * Call this before anyone logs through the Sender. */
+        void start_async(size_t capacity = 8192);
+
+        /* Async mode on a shared loop, so one I/O thread can drive many
+         * Senders.  The loop must outlive the Sender. */
+        void attach(EventLoop& l, size_t capacity = 8192);
+
+        /* At-least-once delivery: every forward message carries a chunk
+         * id and the server acknowledges it.  Up to `window` messages may
+         * be waiting for their ack at once, so batches keep streaming.  A
+         * connection whose oldest ack is ack_timeout seconds late is
+         * dropped, and everything unacknowledged is sent again on the next
+         * one.  The loop reads the acks, so this only works in async
+         * mode: call it before start_async() or attach() (it throws
+         * std::logic_error after), and emitting before either of those
+         * throws std::logic_error too.  It turns on FORWARD batching
+         * unless another mode was chosen; records are only acknowledged
+         * in batches. */
+        void require_ack(size_t window = 8, float ack_timeout = 60.0);
+
+        /* Records refused because the async queue was full (the loop is
+         * also throttled this way while more than bufmax bytes wait for
+         * the connection), and units the spool refused. */
+        size_t get_dropped() const {
+            return dropped.load(std::memory_order_relaxed);
+        }
+#endif
+
     protected:
-        void send(const ::msgpack::sbuffer& sbuf);
-        void send_internal(const ::msgpack::sbuffer& sbuf);
-        void reconnect();
+        void send(const char * data, size_t length);
+        void send_internal(const char * data, size_t length, double deadline = 0);
+        void send_internal(const std::vector<struct iovec>& iov, double deadline = 0);
+        void keep_backlog(const std::vector<struct iovec>& iov);
+        bool fits(size_t length) const;
+        bool admit(size_t length);
+        void account();
+        void drop(const std::vector<struct iovec>& iov);
+        void drop_backlog(size_t length);
+        void endpoint_failed(size_t i, const std::exception& e, double now);
+        void spool_unit(const struct iovec * iov, size_t count);
+        bool wait_for_endpoint(double& deadline);
+#ifdef FLUENT_MT
+        bool wait_unblocked(double deadline);
+#endif
+        void replay_spool();
+        void flush_batch(double deadline = 0);
+        void apply_flush_policy();
+        bool reconnect(bool wait);
         void close();
+
+#ifdef FLUENT_MT
+        bool enqueue(const char * data, size_t length);
+        void stop_async();
+
+        /* EventLoop::Handler; loop thread only */
+        void on_io(int fd, unsigned events, double now);
+        void on_tick(double now);
+        bool busy() const;
+
+        void start_connect(double now);
+        void connection_failed(const ::std::exception& e, double now);
+        void drain_queue(double now);
+        void stage(const std::vector<struct iovec>& iov, double now);
+        void stage_messages(double now);
+        void write_pending(double now);
+        bool window_full() const {
+            return acks && acks->full() && out_offset == unit_start;
+        }
+        void requeue_unacked();
+        void wait_for_acks(double until);
+        size_t pending() const {
+            return buf.size() - out_offset;
+        }
+        void compact(size_t from);
+        void discard(size_t length);
+        void reap();
+        void backlog_iov(std::vector<struct iovec>& iov) const;
+        void update_interest(double now);
+#endif
+    };
+
+    /* Per-thread scratch buffer that Logger packs records into.
+     *
+     * The buffer keeps its capacity from one record to the next, so a
+     * thread that logs steadily stops touching the allocator after its
+     * first few records.  A buffer that grew past max_retained for an
+     * unusually large record is given back by trim(). */
+    class PackBuffer {
+    private:
+        msgpack::sbuffer * buf;
+
+    public:
+        static const size_t initial_size = 1024;
+        static const size_t max_retained = 64 * 1024;
+
+        PackBuffer() : buf(new msgpack::sbuffer(initial_size)) { }
+        ~PackBuffer() {
+            delete buf;
+        }
+
+        PackBuffer(const PackBuffer&) = delete;
+        PackBuffer& operator=(const PackBuffer&) = delete;
+
+        /* The calling thread's buffer. */
+        static PackBuffer& local()
+        {
+            static thread_local PackBuffer buffer;
+            return buffer;
+        }
+
+        /* Empties the buffer and hands it out for packing. */
+        msgpack::sbuffer& get()
+        {
+            buf->clear();
+            return *buf;
+        }
+
+        /* Call once the packed record has been handed off. */
+        void trim()
+        {
+            if( buf->size() > max_retained ) {
+                /* allocated first, so a throw leaves buf as it was */
+                msgpack::sbuffer * fresh = new msgpack::sbuffer(initial_size);
+                delete buf;
+                buf = fresh;
+            }
+        }
+    };
+
+    /* N Senders, each with its own connection, buffers and mutex, so
+     * threads logging at once do not all queue on one Sender's lock:
+     *
+     *     BasicLogger<SenderPool> logger("app", 8, "localhost", 24224);
+     *
+     * Each thread sticks to one shard, so its records stay in order.
+     * Records from different threads may reach the server in any order.
+     * Set the shards up one by one through shard(i) before anyone logs. */
+    class SenderPool {
+    public:
+        enum sharding_t {
+            /* threads are dealt out to the shards as they first log */
+            BY_THREAD,
+            /* the shard of the CPU the thread is running on: fewer lock
+             * handoffs between cores, but a thread that migrates may
+             * reorder its own records */
+            BY_CPU,
+        };
+
+    private:
+        std::vector<Sender *> shards;
+        sharding_t sharding;
+        /* this pool's PerThread id */
+        uint64_t id;
+        /* BY_THREAD deals shards out in turn from here */
+#ifdef FLUENT_MT
+        std::atomic<size_t> next_ticket;
+#else
+        size_t next_ticket;
+#endif
+
+    public:
+        /* n shards (one per online CPU if 0); the rest is as for Sender,
+         * and each shard gets the whole of b for its own backlog. */
+        SenderPool(size_t n = 0,
+                const std::string& h = std::string("localhost"), int p = 24224,
+                size_t b = 1024*1024, float _timeout = 3.0, bool v = false);
+        ~SenderPool();
+
+        SenderPool(const SenderPool&) = delete;
+        SenderPool& operator=(const SenderPool&) = delete;
+
+        size_t size() const {
+            return shards.size();
+        }
+
+        Sender& shard(size_t i) {
+            return *shards[i];
+        }
+
+        void set_sharding(sharding_t s) {
+            sharding = s;
+        }
+
+        /* The calling thread's shard. */
+        Sender& local();
+
+        bool emit(const ::msgpack::sbuffer& sbuf) {
+            return local().emit(sbuf.data(), sbuf.size());
+        }
+
+        bool emit(const char * data, size_t length) {
+            return local().emit(data, length);
+        }
+
+        /* Sender::flush() on every shard. */
+        void flush();
+
+#ifdef FLUENT_MT
+        size_t get_dropped() const;
+#endif
     };
 
-    class Logger {
+    /* Packs records and hands them to a Sink, anything with
+     * bool emit(const msgpack::sbuffer&): a Sender, or a RingWriter to
+     * log through another process's Sender.  Use Logger for the former. */
+    template<typename Sink>
+    class BasicLogger {
     private:
         std::string prefix;
-        Sender sender;
+        TagCache tags;
+        Clock clock;
+        bool event_time;
+        Threshold threshold;
+        /* every limiter ever set, newest first */
+        std::atomic<Limiter *> limiters;
+        /* Limiter::clock() time of the next suppressed-count report */
+        std::atomic<int64_t> next_report;
+        int64_t report_interval;
+        std::string report_label;
+        Dedup dedup;
+#ifdef FLUENT_MT
+        /* does the timed work, once something asks for it; it sleeps on
+         * housekeeping_wake until the next piece of work is due */
+        pthread_t housekeeper;
+        std::atomic<bool> housekeeping;
+        pthread_mutex_t housekeeping_mutex;
+        pthread_cond_t housekeeping_wake;
+#endif
+        Sink sender;
         
     public:
         /* TODO figure out tag / prefix nonsense */
-        Logger(const std::string& t,
-                const std::string& h = std::string("localhost"), int p = 24224,
-                size_t b = 1024*1024, float _timeout = 3.0, bool v = false)
-        : prefix(t), sender(h, p, b, _timeout, v) { }
+        /* Everything after the tag goes to the Sink's constructor. */
+        template<typename... Args>
+        explicit BasicLogger(const std::string& t, Args&&... args)
+        : prefix(t), tags(), clock(), event_time(false), threshold(), limiters(nullptr),
+            next_report(0), report_interval(10 * 1000000000LL), report_label("suppressed"),
+            dedup(),
+#ifdef FLUENT_MT
+            housekeeper(), housekeeping(false), housekeeping_mutex(), housekeeping_wake(),
+#endif
+            sender(std::forward<Args>(args)...) { }
+
+        ~BasicLogger()
+        {
+#ifdef FLUENT_MT
+            if( housekeeping.load() ) {
+                pthread_mutex_lock(&housekeeping_mutex);
+                housekeeping.store(false);
+                pthread_cond_signal(&housekeeping_wake);
+                pthread_mutex_unlock(&housekeeping_mutex);
+                pthread_join(housekeeper, NULL);
+                pthread_cond_destroy(&housekeeping_wake);
+                pthread_mutex_destroy(&housekeeping_mutex);
+            }
+#endif
+            try {
+                report_suppressed();
+                flush_repeats();
+            }
+            catch(::std::runtime_error&) {
+                /* nobody left to report this to */
+            }
+            Limiter * limiter = limiters.load(std::memory_order_relaxed);
+            while( limiter ) {
+                Limiter * next = limiter->next;
+                delete limiter;
+                limiter = next;
+            }
+        }
+
+        Sink& get_sender() {
+            return sender;
+        }
+
+        /* Records below l are no longer logged by FLUENT_LOG or
+         * log_at().  log() itself always logs. */
+        void set_level(level_t l) {
+            threshold.set(l);
+        }
+
+        level_t get_level() const {
+            return threshold.get();
+        }
+
+        bool enabled(level_t l) const {
+            return threshold.enabled(l);
+        }
+
+        /* Resolves label to its full tag and pre-encodes it, once.
+         * Logging through the returned handle just copies those bytes. */
+        Tag tag(const std::string& label)
+        {
+            const TagEntry * entry = tags.lookup(label);
+            if( !entry ) {
+                entry = tags.insert(new TagEntry(label, full_tag(label)));
+            }
+            return Tag(entry);
+        }
         
     private:
-        void add_args(msgpack::packer<msgpack::sbuffer>& packer, const std::string& key, const char* value)
+        /* Strings are packed straight from their bytes, so neither a
+         * literal nor a const char* turns into a temporary std::string. */
+        static void pack_value(msgpack::packer<msgpack::sbuffer>& packer, const char * value, size_t length)
         {
-            packer.pack(key);
-            packer.pack(::std::string(value));
+            packer.pack_str(length);
+            packer.pack_str_body(value, length);
         }
-        
+
+        static void pack_value(msgpack::packer<msgpack::sbuffer>& packer, const char * value)
+        {
+            pack_value(packer, value, ::strlen(value));
+        }
+
+        static void pack_value(msgpack::packer<msgpack::sbuffer>& packer, char * value)
+        {
+            pack_value(packer, value, ::strlen(value));
+        }
+
+        static void pack_value(msgpack::packer<msgpack::sbuffer>& packer, const std::string& value)
+        {
+            pack_value(packer, value.data(), value.size());
+        }
+
         template<typename V>
-        void add_args(msgpack::packer<msgpack::sbuffer>& packer, const std::string& key, const V& value)
+        static void pack_value(msgpack::packer<msgpack::sbuffer>& packer, const V& value)
         {
-            packer.pack(key);
             packer.pack(value);
         }
-        
-        template<typename V, typename... Params>
-        void add_args(msgpack::packer<msgpack::sbuffer>& packer, const std::string& key, const V& value, Params... parameters)
+
+        void add_args(msgpack::packer<msgpack::sbuffer>&)
+        { }
+
+        template<typename K, typename V, typename... Params>
+        void add_args(msgpack::packer<msgpack::sbuffer>& packer, const K& key, const V& value, const Params&... parameters)
         {
-            packer.pack(key);
-            packer.pack(value);
+            pack_value(packer, key);
+            pack_value(packer, value);
             add_args(packer, parameters...);
         }
         
-        template<typename... Params>
-        void add_args(msgpack::packer<msgpack::sbuffer>& packer, const std::string& key, const char * value, Params... parameters)
+        static void pack_time(msgpack::packer<msgpack::sbuffer>& packer, time_t timestamp)
+        {
+            packer.pack(timestamp);
+        }
+
+        static void pack_time(msgpack::packer<msgpack::sbuffer>& packer, const EventTime& timestamp)
+        {
+            timestamp.pack(packer);
+        }
+
+        /* The tag's limiter, if it has one, decides; one atomic load
+         * otherwise. */
+        bool admit(const Tag& tag)
+        {
+            Limiter * limiter = tag.get()->limiter.load(std::memory_order_acquire);
+            if( !limiter ) {
+                return true;
+            }
+            int64_t now = Limiter::clock();
+            bool admitted = limiter->admit(now);
+            report_if_due(now);
+            return admitted;
+        }
+
+        void emit_summaries(const std::vector<std::string>& summaries)
+        {
+            if( summaries.empty() ) {
+                return;
+            }
+            PackBuffer& scratch = PackBuffer::local();
+            msgpack::sbuffer& sbuf = scratch.get();
+            for( size_t i = 0; i < summaries.size(); ++i ) {
+                sbuf.clear();
+                sbuf.write(summaries[i].data(), summaries[i].size());
+                sender.emit(sbuf);
+            }
+            scratch.trim();
+        }
+
+        /* One caller wins each report. */
+        void report_if_due(int64_t now)
+        {
+            int64_t due = next_report.load(std::memory_order_relaxed);
+            if( now >= due && next_report.compare_exchange_strong(due, now + report_interval,
+                        std::memory_order_relaxed) ) {
+                report_suppressed();
+            }
+        }
+
+#ifdef FLUENT_MT
+        /* Starts the housekeeper, or has it look again at when its next
+         * work is due. */
+        void start_housekeeping()
+        {
+            if( housekeeping.exchange(true) ) {
+                wake_housekeeper();
+                return;
+            }
+            int retval = pthread_mutex_init(&housekeeping_mutex, NULL);
+            if( retval == 0 ) {
+                pthread_condattr_t attr;
+                pthread_condattr_init(&attr);
+                /* deadlines are Limiter::clock() times */
+                pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+                retval = pthread_cond_init(&housekeeping_wake, &attr);
+                pthread_condattr_destroy(&attr);
+                if( retval == 0 ) {
+                    retval = pthread_create(&housekeeper, NULL, &BasicLogger::housekeeper_main, this);
+                    if( retval != 0 ) {
+                        pthread_cond_destroy(&housekeeping_wake);
+                    }
+                }
+                if( retval != 0 ) {
+                    pthread_mutex_destroy(&housekeeping_mutex);
+                }
+            }
+            if( retval != 0 ) {
+                housekeeping.store(false);
+                throw NoResources(retval);
+            }
+        }
+
+        /* Reports suppressed counts and ends repeat runs even when the
+         * tags involved have gone quiet.  Returns when the repeat runs
+         * need another look. */
+        int64_t housekeep(int64_t now)
         {
-            packer.pack(key);
-            packer.pack(::std::string(value));
+            int64_t sweep_at = 0;
+            try {
+                if( limiters.load(std::memory_order_relaxed) ) {
+                    report_if_due(now);
+                }
+                if( dedup.enabled() ) {
+                    std::vector<std::string> summaries;
+                    sweep_at = dedup.expire(summaries);
+                    emit_summaries(summaries);
+                }
+            }
+            catch(::std::runtime_error&) {
+                /* the Sender kept it in its backlog */
+            }
+            return sweep_at;
+        }
+
+        /* Has the housekeeper look again at when its next work is due. */
+        void wake_housekeeper()
+        {
+            if( housekeeping.load() ) {
+                pthread_mutex_lock(&housekeeping_mutex);
+                pthread_cond_signal(&housekeeping_wake);
+                pthread_mutex_unlock(&housekeeping_mutex);
+            }
+        }
+
+        /* When housekeep() next has something to do, given when it
+         * should next look at the repeat runs; INT64_MAX while nothing
+         * is waiting for it. */
+        int64_t housekeeping_due(int64_t sweep_at) const
+        {
+            int64_t due = INT64_MAX;
+            if( limiters.load(std::memory_order_relaxed) ) {
+                due = next_report.load(std::memory_order_relaxed);
+            }
+            if( dedup.enabled() && sweep_at < due ) {
+                due = sweep_at;
+            }
+            return due;
+        }
+
+        static void * housekeeper_main(void * self)
+        {
+            BasicLogger * logger = static_cast<BasicLogger *>(self);
+            int64_t sweep_at = 0;
+            pthread_mutex_lock(&logger->housekeeping_mutex);
+            while( logger->housekeeping.load(std::memory_order_relaxed) ) {
+                int64_t now = Limiter::clock();
+                int64_t due = logger->housekeeping_due(sweep_at);
+                if( due <= now ) {
+                    pthread_mutex_unlock(&logger->housekeeping_mutex);
+                    sweep_at = logger->housekeep(now);
+                    pthread_mutex_lock(&logger->housekeeping_mutex);
+                    continue;
+                }
+                if( due == INT64_MAX ) {
+                    pthread_cond_wait(&logger->housekeeping_wake, &logger->housekeeping_mutex);
+                    continue;
+                }
+                struct timespec until;
+                until.tv_sec = static_cast<time_t>(due / 1000000000);
+                until.tv_nsec = static_cast<long>(due % 1000000000);
+                pthread_cond_timedwait(&logger->housekeeping_wake, &logger->housekeeping_mutex, &until);
+            }
+            pthread_mutex_unlock(&logger->housekeeping_mutex);
+            return NULL;
+        }
+#endif
+
+        /* Hands a packed event to the Sink, through dedup when it is
+         * on.  A repeat it holds back counts as sent. */
+        bool send(msgpack::sbuffer& sbuf, size_t tag_end, size_t map_start)
+        {
+            if( !dedup.enabled() ) {
+                return sender.emit(sbuf);
+            }
+            static thread_local std::vector<std::string> summaries;
+            summaries.clear();
+            bool emitted = true;
+            if( dedup.check(sbuf.data(), sbuf.size(), tag_end, map_start, summaries) ) {
+                emitted = sender.emit(sbuf);
+            }
+            for( size_t i = 0; i < summaries.size(); ++i ) {
+                sbuf.clear();
+                sbuf.write(summaries[i].data(), summaries[i].size());
+                sender.emit(sbuf);
+            }
+            return emitted;
+        }
+
+        template<typename T, typename... Params>
+        bool write_event(const Tag& tag, const T& timestamp, const Params&... parameters)
+        {
+            if( !admit(tag) ) {
+                return false;
+            }
+            PackBuffer& scratch = PackBuffer::local();
+            msgpack::sbuffer& sbuf = scratch.get();
+            msgpack::packer<msgpack::sbuffer> packer(sbuf);
+            packer.pack_array(3);
+            sbuf.write(tag.packed().data(), tag.packed().size());
+            size_t tag_end = sbuf.size();
+            pack_time(packer, timestamp);
+            size_t map_start = sbuf.size();
+            packer.pack_map(sizeof...(Params) / 2);
             add_args(packer, parameters...);
+            bool emitted = send(sbuf, tag_end, map_start);
+            scratch.trim();
+            return emitted;
         }
-        
+
+        template<typename S, typename T, typename... Values>
+        bool write_record(const Tag& tag, const T& timestamp, const Values&... values)
+        {
+            if( !admit(tag) ) {
+                return false;
+            }
+            PackBuffer& scratch = PackBuffer::local();
+            msgpack::sbuffer& sbuf = scratch.get();
+            msgpack::packer<msgpack::sbuffer> packer(sbuf);
+            packer.pack_array(3);
+            sbuf.write(tag.packed().data(), tag.packed().size());
+            size_t tag_end = sbuf.size();
+            pack_time(packer, timestamp);
+            size_t map_start = sbuf.size();
+            S::pack(sbuf, values...);
+            bool emitted = send(sbuf, tag_end, map_start);
+            scratch.trim();
+            return emitted;
+        }
+
     public:
+        /* Events logged without an explicit timestamp get a sub-second
+         * EventTime read from source instead of time(NULL)'s seconds. */
+        void use_event_time(Clock::source_t source = Clock::COARSE)
+        {
+            clock.set_source(source);
+            event_time = true;
+        }
+
         template<typename... Params>
-        bool log(const std::string& label, Params... parameters)
+        bool log(const Tag& tag, const Params&... parameters)
         {
-            return log(label, ::time(NULL), parameters...);
+            if( event_time ) {
+                return write_event(tag, clock.now(), parameters...);
+            }
+            return write_event(tag, ::time(NULL), parameters...);
         }
-        
+
         template<typename... Params>
-        bool log(const std::string& label, time_t timestamp, Params... parameters)
+        bool log(const Tag& tag, time_t timestamp, const Params&... parameters)
         {
-            msgpack::sbuffer sbuf;
-            msgpack::packer<msgpack::sbuffer> packer(sbuf);
-            packer.pack_array(3);
-            if( prefix.size() ) {
-                if( label.size() ) {
-                    packer.pack(prefix + "." + label);
-                }
-                else {
-                    packer.pack(prefix);
+            return write_event(tag, timestamp, parameters...);
+        }
+
+        template<typename... Params>
+        bool log(const Tag& tag, const EventTime& timestamp, const Params&... parameters)
+        {
+            return write_event(tag, timestamp, parameters...);
+        }
+
+        /* Labels are looked up in the tag cache; once it is full, unseen
+         * labels are resolved on every call rather than cached. */
+        template<typename... Params>
+        bool log(const std::string& label, const Params&... parameters)
+        {
+            const TagEntry * entry = tags.lookup(label);
+            if( !entry ) {
+                entry = tags.insert(new TagEntry(label, full_tag(label)), false);
+            }
+            if( entry ) {
+                return log(Tag(entry), parameters...);
+            }
+            TagEntry uncached(label, full_tag(label));
+            return log(Tag(&uncached), parameters...);
+        }
+
+        /* Limits how much label logs from now on (see limit.h),
+         * replacing any earlier limit.  Events turned away are dropped
+         * before anything is packed; log() returns false for them.
+         * Any thread may call this while others log. */
+        void limit(const std::string& label, const Limit& l)
+        {
+            const TagEntry * entry = tag(label).get();
+            Limiter * limiter = new Limiter(l, entry);
+            Limiter * head = limiters.load(std::memory_order_relaxed);
+            do {
+                limiter->next = head;
+            } while( !limiters.compare_exchange_weak(head, limiter,
+                        std::memory_order_release, std::memory_order_relaxed) );
+            entry->limiter.store(limiter, std::memory_order_release);
+            /* the first report is an interval after the first limit */
+            int64_t unset = 0;
+            next_report.compare_exchange_strong(unset, Limiter::clock() + report_interval);
+#ifdef FLUENT_MT
+            start_housekeeping();
+#endif
+        }
+
+        void unlimit(const std::string& label)
+        {
+            tag(label).get()->limiter.store(nullptr, std::memory_order_release);
+        }
+
+        /* Every interval seconds, {"tag": <full tag>, "suppressed":
+         * <count>} is logged to label for each tag that suppressed any
+         * since, and once more on destruction.  With FLUENT_MT a thread
+         * started by the first limit() sees to it; otherwise the first
+         * limited event after the interval does.  Set it before logging. */
+        void set_limit_report(const std::string& label, double interval)
+        {
+            report_label = label;
+            report_interval = static_cast<int64_t>(interval * 1e9);
+            next_report.store(Limiter::clock() + report_interval);
+#ifdef FLUENT_MT
+            wake_housekeeper();
+#endif
+        }
+
+        /* Logs the suppressed counts now, say before shutting down. */
+        void report_suppressed()
+        {
+            Tag report = tag(report_label);
+            Limiter * limiter = limiters.load(std::memory_order_acquire);
+            for( ; limiter; limiter = limiter->next ) {
+                uint64_t count = limiter->take_suppressed();
+                if( count ) {
+                    log(report, "tag", limiter->entry->name, "suppressed", count);
                 }
             }
-            else {
+        }
+
+        /* Collapses runs of identical records (the time aside) logged
+         * by a thread within seconds of each other into the first one
+         * and a copy of the last with a "repeat_count" field; see
+         * dedup.h.  0 turns it off, which is the default.  The copy goes
+         * out once the window is over: with FLUENT_MT a thread started
+         * here sees to it (at most a window late, for a run that opens
+         * while no other is open), otherwise the thread's later records
+         * do.  The
+         * destructor sends whatever is left. */
+        void set_dedup(double seconds, size_t slots = 64)
+        {
+            dedup.set_window(seconds, slots);
+#ifdef FLUENT_MT
+            if( seconds > 0 ) {
+                start_housekeeping();
+            }
+#endif
+        }
+
+        /* Sends the summaries of the runs held back so far, say before
+         * shutting down; returns their count. */
+        size_t flush_repeats()
+        {
+            std::vector<std::string> summaries;
+            dedup.flush(summaries);
+            emit_summaries(summaries);
+            return summaries.size();
+        }
+
+        /* log() if level L is enabled.  Unlike FLUENT_LOG, the
+         * arguments are evaluated either way. */
+        template<level_t L, typename... Params>
+        bool log_at(const Params&... parameters)
+        {
+            if( !enabled(L) ) {
+                return false;
+            }
+            return log(parameters...);
+        }
+
+        /* Logs a record laid out by schema S (see schema.h): one value
+         * per key, in key order. */
+        template<typename S, typename... Values>
+        typename std::enable_if<sizeof...(Values) == S::size, bool>::type
+        log_record(const Tag& tag, const Values&... values)
+        {
+            if( event_time ) {
+                return write_record<S>(tag, clock.now(), values...);
+            }
+            return write_record<S>(tag, ::time(NULL), values...);
+        }
+
+        template<typename S, typename... Values>
+        typename std::enable_if<sizeof...(Values) == S::size, bool>::type
+        log_record(const Tag& tag, time_t timestamp, const Values&... values)
+        {
+            return write_record<S>(tag, timestamp, values...);
+        }
+
+        template<typename S, typename... Values>
+        typename std::enable_if<sizeof...(Values) == S::size, bool>::type
+        log_record(const Tag& tag, const EventTime& timestamp, const Values&... values)
+        {
+            return write_record<S>(tag, timestamp, values...);
+        }
+
+    private:
+        std::string full_tag(const std::string& label) const
+        {
+            if( prefix.size() ) {
                 if( label.size() ) {
-                    packer.pack(label);
-                }
-                else {
-                    /* TODO is this an error */
-                    packer.pack(::std::string());
+                    return prefix + "." + label;
                 }
+                return prefix;
             }
-            packer.pack(timestamp);
-            packer.pack_map(sizeof...(Params) / 2);
-            add_args(packer, parameters...);
-            return sender.emit(sbuf);
+            /* TODO is an empty tag an error */
+            return label;
         }
         
     };
 
+    typedef BasicLogger<Sender> Logger;
+
 #ifdef FLUENT_MT
     /* Errors using the mutex */
     class InvalidAttributes : public std::runtime_error {
@@ -0,0 +1,121 @@
+#ifndef __FLUENT_LEVEL_H__
+#define __FLUENT_LEVEL_H__
+
+#include <atomic>
+
+/* Severities as plain numbers, so the preprocessor can compare them
+ * (see FLUENT_MIN_LEVEL below); level_t names the same values. */
+#define FLUENT_LEVEL_TRACE 0
+#define FLUENT_LEVEL_DEBUG 1
+#define FLUENT_LEVEL_INFO 2
+#define FLUENT_LEVEL_WARN 3
+#define FLUENT_LEVEL_ERROR 4
+#define FLUENT_LEVEL_FATAL 5
+#define FLUENT_LEVEL_OFF 6
+
+namespace fluent {
+
+    /* Severities, least to most severe.  Prefixed so they cannot clash
+     * with the DEBUG and ERROR macros builds tend to define. */
+    enum level_t {
+        LEVEL_TRACE = FLUENT_LEVEL_TRACE,
+        LEVEL_DEBUG = FLUENT_LEVEL_DEBUG,
+        LEVEL_INFO = FLUENT_LEVEL_INFO,
+        LEVEL_WARN = FLUENT_LEVEL_WARN,
+        LEVEL_ERROR = FLUENT_LEVEL_ERROR,
+        LEVEL_FATAL = FLUENT_LEVEL_FATAL,
+        LEVEL_OFF = FLUENT_LEVEL_OFF
+    };
+}
+
+/* The least severe level compiled in: build with
+ * -DFLUENT_MIN_LEVEL=FLUENT_LEVEL_INFO (or its number, 2) and every
+ * FLUENT_TRACE and FLUENT_DEBUG below turns into an empty statement,
+ * whatever the optimizer does. */
+#ifndef FLUENT_MIN_LEVEL
+#define FLUENT_MIN_LEVEL FLUENT_LEVEL_TRACE
+#endif
+
+namespace fluent {
+
+    static constexpr level_t compiled_level = static_cast<level_t>(FLUENT_MIN_LEVEL);
+
+    /* A logger's runtime level: what is below it is not logged.  Any
+     * thread may change it while others log; checking it is one relaxed
+     * load. */
+    class Threshold {
+    private:
+        std::atomic<int> level;
+
+    public:
+        Threshold() : level(LEVEL_TRACE) { }
+
+        Threshold(const Threshold&) = delete;
+        Threshold& operator=(const Threshold&) = delete;
+
+        void set(level_t l) {
+            level.store(l, std::memory_order_relaxed);
+        }
+
+        level_t get() const {
+            return static_cast<level_t>(level.load(std::memory_order_relaxed));
+        }
+
+        /* Both checks; the first is a constant, so call sites below
+         * compiled_level fold away. */
+        bool enabled(level_t l) const {
+            return l >= compiled_level && l >= level.load(std::memory_order_relaxed);
+        }
+    };
+}
+
+/* Logs through logger (a Logger or DeferredLogger) at level, a
+ * level_t, if that level is enabled:
+ *
+ *     FLUENT_LOG(logger, ::fluent::LEVEL_DEBUG, "", "state", dump_state());
+ *
+ * The rest of the arguments go to logger.log() and are not evaluated
+ * when the level is off, which costs a load and a branch. */
+#define FLUENT_LOG(logger, level, ...) \
+    do { \
+        if( (logger).enabled(level) ) { \
+            (logger).log(__VA_ARGS__); \
+        } \
+    } while( 0 )
+
+/* FLUENT_LOG at a fixed level.  Below FLUENT_MIN_LEVEL they are empty
+ * statements: their arguments are not even compiled. */
+#define FLUENT_DISABLED_(logger, ...) do { } while( 0 )
+
+#if FLUENT_MIN_LEVEL <= FLUENT_LEVEL_TRACE
+#define FLUENT_TRACE(logger, ...) FLUENT_LOG(logger, ::fluent::LEVEL_TRACE, __VA_ARGS__)
+#else
+#define FLUENT_TRACE FLUENT_DISABLED_
+#endif
+#if FLUENT_MIN_LEVEL <= FLUENT_LEVEL_DEBUG
+#define FLUENT_DEBUG(logger, ...) FLUENT_LOG(logger, ::fluent::LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define FLUENT_DEBUG FLUENT_DISABLED_
+#endif
+#if FLUENT_MIN_LEVEL <= FLUENT_LEVEL_INFO
+#define FLUENT_INFO(logger, ...) FLUENT_LOG(logger, ::fluent::LEVEL_INFO, __VA_ARGS__)
+#else
+#define FLUENT_INFO FLUENT_DISABLED_
+#endif
+#if FLUENT_MIN_LEVEL <= FLUENT_LEVEL_WARN
+#define FLUENT_WARN(logger, ...) FLUENT_LOG(logger, ::fluent::LEVEL_WARN, __VA_ARGS__)
+#else
+#define FLUENT_WARN FLUENT_DISABLED_
+#endif
+#if FLUENT_MIN_LEVEL <= FLUENT_LEVEL_ERROR
+#define FLUENT_ERROR(logger, ...) FLUENT_LOG(logger, ::fluent::LEVEL_ERROR, __VA_ARGS__)
+#else
+#define FLUENT_ERROR FLUENT_DISABLED_
+#endif
+#if FLUENT_MIN_LEVEL <= FLUENT_LEVEL_FATAL
+#define FLUENT_FATAL(logger, ...) FLUENT_LOG(logger, ::fluent::LEVEL_FATAL, __VA_ARGS__)
+#else
+#define FLUENT_FATAL FLUENT_DISABLED_
+#endif
+
+#endif /* __FLUENT_LEVEL_H__ */
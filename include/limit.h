@@ -0,0 +1,71 @@
+#ifndef __FLUENT_LIMIT_H__
+#define __FLUENT_LIMIT_H__
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace fluent {
+
+    struct TagEntry;
+
+    /* How much of one tag gets logged.  The checks apply in this order,
+     * and the defaults let everything through. */
+    struct Limit {
+        /* Keep one event in every sample_every. */
+        uint32_t sample_every;
+        /* Then keep each one with this probability. */
+        double probability;
+        /* Then a token bucket: rate events a second on average, up to
+         * burst at once.  0 means no rate limit. */
+        double rate;
+        double burst;
+
+        Limit() : sample_every(1), probability(1.0), rate(0.0), burst(1.0) { }
+    };
+
+    /* One tag's Limit and its running state.
+     *
+     * Lock free: sampling is a fetch_add, the token bucket is kept as a
+     * single "theoretical arrival time" (GCRA) moved forward by CAS, and
+     * suppressed events are counted with a fetch_add.  The state sits on
+     * a cache line of its own, so a busy tag's limiter does not contend
+     * with its neighbours'. */
+    class Limiter {
+    private:
+        char pad0[64];
+        std::atomic<uint64_t> seen;
+        /* when the bucket will be full again, in clock() nanoseconds */
+        std::atomic<int64_t> tat;
+        std::atomic<uint64_t> suppressed;
+        char pad1[64];
+
+    public:
+        const Limit limit;
+        const TagEntry * const entry;
+        /* the next of the Logger's limiters, newest first */
+        Limiter * next;
+
+        Limiter(const Limit& l, const TagEntry * e);
+
+        Limiter(const Limiter&) = delete;
+        Limiter& operator=(const Limiter&) = delete;
+
+        /* Whether to log an event at time now; counts it if not. */
+        bool admit(int64_t now);
+
+        /* The count of suppressed events since the last call. */
+        uint64_t take_suppressed() {
+            return suppressed.exchange(0, std::memory_order_relaxed);
+        }
+
+        /* Monotonic nanoseconds. */
+        static int64_t clock();
+
+    private:
+        bool sample();
+        bool take_token(int64_t now);
+    };
+}
+
+#endif /* __FLUENT_LIMIT_H__ */
@@ -0,0 +1,185 @@
+#ifndef __FLUENT_METRICS_H__
+#define __FLUENT_METRICS_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef FLUENT_MT
+#include <pthread.h>
+#endif
+
+#include <msgpack.hpp>
+
+namespace fluent {
+
+    class Sender;
+
+    namespace metrics {
+
+        /* Log-linear histogram: 16 buckets per power of two, so a
+         * quantile read back from it is within about 3% of the true one.
+         * Sparse, and merged by adding bucket counts. */
+        class Histogram {
+        private:
+            /* counts by bucket; values <= 0 share the lowest bucket */
+            std::map<int, uint64_t> buckets;
+
+        public:
+            static const int sub_buckets = 16;
+
+            Histogram() : buckets() { }
+
+            void add(double value);
+            void merge(const Histogram& other);
+            /* Zeroes the counts, keeping the buckets for the next interval. */
+            void reset();
+
+            /* The value q (0 to 1) of the way through count samples. */
+            double quantile(double q, uint64_t count) const;
+
+        private:
+            static int bucket(double value);
+            static double midpoint(int bucket);
+        };
+
+        enum kind_t {
+            COUNTER,
+            GAUGE,
+            HISTOGRAM,
+        };
+
+        /* One metric's interval so far. */
+        struct Cell {
+            kind_t kind;
+            /* recorded since the last flush */
+            bool touched;
+            std::string label;
+            std::string dimension;
+            /* counter total, or sample count */
+            int64_t count;
+            double sum;
+            double min;
+            double max;
+            /* the gauge, and when it was set */
+            double last;
+            int64_t set_at;
+            Histogram histogram;
+
+            Cell(kind_t k, const std::string& l, const std::string& d);
+
+            void merge(const Cell& other);
+            /* Back to an empty interval, keeping what was allocated. */
+            void reset();
+        };
+
+        typedef std::unordered_map<std::string, Cell> Cells;
+
+        /* One thread's cells.  The lock is only ever contended by a
+         * flush reading and resetting them. */
+        struct Shard {
+            Cells cells;
+#ifdef FLUENT_MT
+            pthread_mutex_t mutex;
+#endif
+
+            Shard();
+            ~Shard();
+
+            Shard(const Shard&) = delete;
+            Shard& operator=(const Shard&) = delete;
+        };
+    }
+
+    /* Counters, gauges and histograms aggregated in the process and sent
+     * as one record per metric per interval, instead of one per event.
+     *
+     * A metric is a label, which becomes its tag the way Logger's labels
+     * do, plus an optional dimension string that tells apart series
+     * sharing the tag.  Each thread updates shards of its own, so
+     * recording is a map lookup under an uncontended lock; flush() (by
+     * hand, or every interval on start()'s thread) merges every shard's
+     * cells, resets them in place and emits through the Sender.  Cells
+     * are kept once made, so past a metric's first interval neither
+     * recording nor flushing it allocates.  Each metric sends:
+     *
+     *     counter:   {"dimension": d, "count": n}
+     *     gauge:     {"dimension": d, "gauge": last value set}
+     *     histogram: {"dimension": d, "count", "sum", "min", "max",
+     *                 "p50", "p90", "p99"}
+     *
+     * "dimension" is left out when empty.  Metrics not touched during an
+     * interval are not sent for it. */
+    class Metrics {
+    private:
+        std::string prefix;
+        Sender& sender;
+        /* this object's PerThread id */
+        uint64_t id;
+        std::vector<metrics::Shard *> shards;
+        /* every shard's cells merged, reset by each flush */
+        metrics::Cells merged;
+#ifdef FLUENT_MT
+        pthread_mutex_t shards_mutex;
+        double interval;
+        pthread_t thread;
+        std::atomic<bool> running;
+        /* held by flush(), for merged; the flusher sleeps on wake until
+         * the next interval or stop() */
+        pthread_mutex_t flusher_mutex;
+        pthread_cond_t wake;
+#endif
+
+    public:
+        /* Records go to s, which must outlive this object. */
+        Metrics(const std::string& t, Sender& s);
+        ~Metrics();
+
+        Metrics(const Metrics&) = delete;
+        Metrics& operator=(const Metrics&) = delete;
+
+        void count(const std::string& label, int64_t n = 1) {
+            count(label, std::string(), n);
+        }
+        void count(const std::string& label, const std::string& dimension, int64_t n = 1);
+
+        void gauge(const std::string& label, double value) {
+            gauge(label, std::string(), value);
+        }
+        void gauge(const std::string& label, const std::string& dimension, double value);
+
+        /* Adds a sample, such as a latency, to a histogram. */
+        void observe(const std::string& label, double value) {
+            observe(label, std::string(), value);
+        }
+        void observe(const std::string& label, const std::string& dimension, double value);
+
+        /* Emits and resets everything recorded so far; returns the
+         * record count. */
+        size_t flush();
+
+#ifdef FLUENT_MT
+        /* Flushes every interval seconds on a thread of its own. */
+        void start(double interval = 10.0);
+        /* Stops the thread after a last flush(). */
+        void stop();
+#endif
+
+    private:
+        metrics::Shard * local();
+        metrics::Cell& cell(metrics::Shard& shard, metrics::kind_t kind,
+                const std::string& label, const std::string& dimension);
+        void emit(const metrics::Cell& cell, time_t now, ::msgpack::sbuffer& sbuf);
+        std::string full_tag(const std::string& label) const;
+
+#ifdef FLUENT_MT
+        static void * flusher_main(void * self);
+#endif
+    };
+}
+
+#endif /* __FLUENT_METRICS_H__ */
@@ -0,0 +1,59 @@
+#ifndef __FLUENT_PER_THREAD_H__
+#define __FLUENT_PER_THREAD_H__
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace fluent {
+
+    /* Finds the calling thread's T for an owner, for objects that give
+     * each thread a part of their own (DeferredLogger's rings, Metrics'
+     * shards, Dedup's tables, SenderPool's shards).
+     *
+     * Each thread keeps a short list of (owner id, object) pairs, so the
+     * lookup is a scan without a lock.  Owners take their id from
+     * next_id(), which never hands out one twice, so a thread's list
+     * cannot mistake a new owner at an old one's address for it.  The
+     * owner creates and frees the objects; a pair left behind by an owner
+     * that is gone just never matches again. */
+    template<typename T>
+    class PerThread {
+    private:
+        struct Entry {
+            uint64_t owner;
+            T * object;
+        };
+
+        static std::vector<Entry>& mine() {
+            static thread_local std::vector<Entry> entries;
+            return entries;
+        }
+
+    public:
+        static uint64_t next_id() {
+            static std::atomic<uint64_t> next(1);
+            return next.fetch_add(1);
+        }
+
+        /* The object this thread added for owner, or nullptr. */
+        static T * find(uint64_t owner) {
+            std::vector<Entry>& entries = mine();
+            for( size_t i = 0; i < entries.size(); ++i ) {
+                if( entries[i].owner == owner ) {
+                    return entries[i].object;
+                }
+            }
+            return nullptr;
+        }
+
+        static void add(uint64_t owner, T * object) {
+            Entry entry;
+            entry.owner = owner;
+            entry.object = object;
+            mine().push_back(entry);
+        }
+    };
+}
+
+#endif /* __FLUENT_PER_THREAD_H__ */
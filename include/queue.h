@@ -0,0 +1,126 @@
+#ifndef __FLUENT_QUEUE_H__
+#define __FLUENT_QUEUE_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace fluent {
+
+    /* Bounded multi-producer / single-consumer ring.
+     *
+     * Each slot carries a sequence number that tells producers and the
+     * consumer whose turn it is (Vyukov's bounded queue), so a push is one
+     * CAS on the head plus a release store; nobody ever takes a lock.
+     *
+     * Slots are filled and drained in place through functors, so a slot's
+     * payload (e.g. a std::string) keeps its capacity between uses and
+     * steady-state pushes do not touch the allocator. */
+    template<typename T>
+    class MPSCQueue {
+    private:
+        struct Slot {
+            std::atomic<size_t> seq;
+            T value;
+            Slot() : seq(0), value() { }
+        };
+
+        /* head is hammered by producers, tail by the consumer: keep them
+         * on separate cache lines. */
+        const size_t mask;
+        Slot * slots;
+        char pad0[64];
+        std::atomic<size_t> head;
+        char pad1[64 - sizeof(std::atomic<size_t>)];
+        size_t tail;
+
+    public:
+        explicit MPSCQueue(size_t capacity)
+        : mask(round_up(capacity) - 1), slots(new Slot[mask + 1]),
+            pad0(), head(0), pad1(), tail(0)
+        {
+            for( size_t i = 0; i <= mask; ++i ) {
+                slots[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        ~MPSCQueue()
+        {
+            delete [] slots;
+        }
+
+        MPSCQueue(const MPSCQueue&) = delete;
+        MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+        size_t capacity() const {
+            return mask + 1;
+        }
+
+        /* Claims a slot and calls fill(T&) on it.  Returns false without
+         * calling fill if the queue is full.  Safe from any thread. */
+        template<typename F>
+        bool try_push(F fill)
+        {
+            size_t pos = head.load(std::memory_order_relaxed);
+            Slot * slot;
+            for(;;) {
+                slot = &slots[pos & mask];
+                size_t seq = slot->seq.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if( diff == 0 ) {
+                    if( head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ) {
+                        break;
+                    }
+                }
+                else if( diff < 0 ) {
+                    return false;
+                }
+                else {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+            fill(slot->value);
+            slot->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        /* Calls consume(T&) on the oldest element and frees its slot.
+         * Returns false if the queue is empty.  Consumer thread only. */
+        template<typename F>
+        bool try_pop(F consume)
+        {
+            Slot * slot = &slots[tail & mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            if( seq != tail + 1 ) {
+                return false;
+            }
+            consume(slot->value);
+            slot->seq.store(tail + mask + 1, std::memory_order_release);
+            ++tail;
+            return true;
+        }
+
+        /* Only exact from the consumer thread; a hint anywhere else. */
+        bool empty() const
+        {
+            const Slot& slot = slots[tail & mask];
+            return slot.seq.load(std::memory_order_acquire) != tail + 1;
+        }
+
+    private:
+        static size_t round_up(size_t n)
+        {
+            if( n < 2 ) {
+                throw std::invalid_argument("MPSCQueue capacity must be at least 2");
+            }
+            size_t r = 1;
+            while( r < n ) {
+                r <<= 1;
+            }
+            return r;
+        }
+    };
+}
+
+#endif /* __FLUENT_QUEUE_H__ */
@@ -0,0 +1,52 @@
+#ifndef __FLUENT_RESOLVER_H__
+#define __FLUENT_RESOLVER_H__
+
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace fluent {
+
+    /* getaddrinfo() results, cached for the whole process by host, port,
+     * family and socket type, so reconnecting does not mean another trip
+     * to the resolver.
+     *
+     * An entry is good for ttl seconds.  With FLUENT_MT every lookup
+     * happens on one resolver thread, started on first use: after ttl,
+     * the next caller still gets the old addresses at once while that
+     * thread asks again.  Without it, that caller resolves there and
+     * then.  Either way a resolver that fails or finds nothing leaves the
+     * last addresses that worked in place, and is asked again a few
+     * seconds later.  Only a host that has never resolved throws.
+     *
+     * Thread safe. */
+    class Resolver {
+    public:
+        struct Address {
+            struct sockaddr_storage addr;
+            socklen_t length;
+        };
+        typedef std::vector<Address> AddressList;
+
+        /* Seconds an entry is used without asking the resolver again;
+         * 30 unless changed.  0 asks on every lookup, falling back to the
+         * last addresses that worked if the resolver fails. */
+        static void set_ttl(double seconds);
+
+        /* Fills out with every address host:port resolves to, in the
+         * resolver's order.  Throws Socket::AddressResolutionError if
+         * there is none to give. */
+        static void resolve(const std::string& host, int port, int family, int socktype,
+                AddressList& out);
+
+        /* resolve() for an event loop, which must not wait on the
+         * resolver: false, with out untouched, while the resolver thread
+         * looks up a host with nothing cached yet.  Without FLUENT_MT it
+         * is resolve(). */
+        static bool try_resolve(const std::string& host, int port, int family, int socktype,
+                AddressList& out);
+    };
+}
+
+#endif /* __FLUENT_RESOLVER_H__ */
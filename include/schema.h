@@ -0,0 +1,361 @@
+#ifndef __FLUENT_SCHEMA_H__
+#define __FLUENT_SCHEMA_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+
+#include <msgpack.hpp>
+
+namespace fluent {
+
+    /* A record key whose msgpack encoding (fixstr header + bytes) is
+     * built at compile time.  Spell it with FLUENT_KEY("name"). */
+    template<size_t N, char... Cs>
+    struct Key {
+        static_assert(N < 32, "schema keys are limited to 31 bytes");
+        static const size_t packed_size = N + 1;
+        static constexpr char packed[sizeof...(Cs) + 1] = { static_cast<char>(0xa0 | N), Cs... };
+    };
+
+    template<size_t N, char... Cs>
+    constexpr char Key<N, Cs...>::packed[];
+
+#define FLUENT_KEY_CHAR_(s, i) ((i) < sizeof(s) - 1 ? (s)[(i) < sizeof(s) ? (i) : 0] : '\0')
+#define FLUENT_KEY(s) ::fluent::Key<sizeof(s) - 1, \
+    FLUENT_KEY_CHAR_(s, 0), FLUENT_KEY_CHAR_(s, 1), FLUENT_KEY_CHAR_(s, 2), FLUENT_KEY_CHAR_(s, 3), \
+    FLUENT_KEY_CHAR_(s, 4), FLUENT_KEY_CHAR_(s, 5), FLUENT_KEY_CHAR_(s, 6), FLUENT_KEY_CHAR_(s, 7), \
+    FLUENT_KEY_CHAR_(s, 8), FLUENT_KEY_CHAR_(s, 9), FLUENT_KEY_CHAR_(s, 10), FLUENT_KEY_CHAR_(s, 11), \
+    FLUENT_KEY_CHAR_(s, 12), FLUENT_KEY_CHAR_(s, 13), FLUENT_KEY_CHAR_(s, 14), FLUENT_KEY_CHAR_(s, 15), \
+    FLUENT_KEY_CHAR_(s, 16), FLUENT_KEY_CHAR_(s, 17), FLUENT_KEY_CHAR_(s, 18), FLUENT_KEY_CHAR_(s, 19), \
+    FLUENT_KEY_CHAR_(s, 20), FLUENT_KEY_CHAR_(s, 21), FLUENT_KEY_CHAR_(s, 22), FLUENT_KEY_CHAR_(s, 23), \
+    FLUENT_KEY_CHAR_(s, 24), FLUENT_KEY_CHAR_(s, 25), FLUENT_KEY_CHAR_(s, 26), FLUENT_KEY_CHAR_(s, 27), \
+    FLUENT_KEY_CHAR_(s, 28), FLUENT_KEY_CHAR_(s, 29), FLUENT_KEY_CHAR_(s, 30)>
+
+    namespace schema_detail {
+        typedef ::msgpack::packer< ::msgpack::sbuffer> packer_t;
+
+        inline char * put_be(char * p, uint64_t v, int bytes)
+        {
+            for( int i = bytes - 1; i >= 0; --i ) {
+                p[i] = static_cast<char>(v & 0xff);
+                v >>= 8;
+            }
+            return p + bytes;
+        }
+
+        inline char * put_byte(char * p, unsigned char b)
+        {
+            *p = static_cast<char>(b);
+            return p + 1;
+        }
+
+        inline char * put_uint(char * p, uint64_t v)
+        {
+            if( v < 128 ) {
+                return put_byte(p, v);
+            }
+            if( v < 256 ) {
+                return put_be(put_byte(p, 0xcc), v, 1);
+            }
+            if( v < 65536 ) {
+                return put_be(put_byte(p, 0xcd), v, 2);
+            }
+            if( v < 4294967296ULL ) {
+                return put_be(put_byte(p, 0xce), v, 4);
+            }
+            return put_be(put_byte(p, 0xcf), v, 8);
+        }
+
+        inline char * put_int(char * p, int64_t v)
+        {
+            if( v >= 0 ) {
+                return put_uint(p, v);
+            }
+            if( v >= -32 ) {
+                return put_byte(p, static_cast<unsigned char>(v));
+            }
+            if( v >= -128 ) {
+                return put_be(put_byte(p, 0xd0), v, 1);
+            }
+            if( v >= -32768 ) {
+                return put_be(put_byte(p, 0xd1), v, 2);
+            }
+            if( v >= -2147483648LL ) {
+                return put_be(put_byte(p, 0xd2), v, 4);
+            }
+            return put_be(put_byte(p, 0xd3), v, 8);
+        }
+
+        inline size_t uint_size(uint64_t v)
+        {
+            return v < 128 ? 1 : v < 256 ? 2 : v < 65536 ? 3 : v < 4294967296ULL ? 5 : 9;
+        }
+
+        inline size_t int_size(int64_t v)
+        {
+            if( v >= 0 ) {
+                return uint_size(v);
+            }
+            return v >= -32 ? 1 : v >= -128 ? 2 : v >= -32768 ? 3 : v >= -2147483648LL ? 5 : 9;
+        }
+
+        inline size_t str_header_size(size_t n)
+        {
+            return n < 32 ? 1 : n < 256 ? 2 : n < 65536 ? 3 : 5;
+        }
+
+        inline char * put_str_header(char * p, size_t n)
+        {
+            if( n < 32 ) {
+                return put_byte(p, 0xa0 | n);
+            }
+            if( n < 256 ) {
+                return put_be(put_byte(p, 0xd9), n, 1);
+            }
+            if( n < 65536 ) {
+                return put_be(put_byte(p, 0xda), n, 2);
+            }
+            return put_be(put_byte(p, 0xdb), n, 4);
+        }
+
+        /* How one value is encoded after its key.  Scalars and strings
+         * are sized and written by hand; length carries a string's
+         * measured length from size() to write().  Anything else goes
+         * through msgpack's own packer, a field at a time. */
+        template<typename V, typename Enable = void>
+        struct field {
+            static const bool sized = false;
+            static void append(::msgpack::sbuffer& out, packer_t& packer,
+                    const char * key, size_t key_size, const V& v) {
+                out.write(key, key_size);
+                packer.pack(v);
+            }
+        };
+
+        template<>
+        struct field<bool> {
+            static const bool sized = true;
+            static size_t size(bool, size_t&) {
+                return 1;
+            }
+            static char * write(char * p, bool v, size_t) {
+                return put_byte(p, v ? 0xc3 : 0xc2);
+            }
+        };
+
+        template<typename V>
+        struct field<V, typename std::enable_if<std::is_integral<V>::value &&
+                !std::is_same<V, bool>::value>::type> {
+            static const bool sized = true;
+            static size_t size(V v, size_t&) {
+                return std::is_signed<V>::value ? int_size(static_cast<int64_t>(v))
+                    : uint_size(static_cast<uint64_t>(v));
+            }
+            static char * write(char * p, V v, size_t) {
+                return std::is_signed<V>::value ? put_int(p, static_cast<int64_t>(v))
+                    : put_uint(p, static_cast<uint64_t>(v));
+            }
+        };
+
+        template<>
+        struct field<float> {
+            static const bool sized = true;
+            static size_t size(float, size_t&) {
+                return 5;
+            }
+            static char * write(char * p, float v, size_t) {
+                uint32_t bits;
+                memcpy(&bits, &v, sizeof(bits));
+                return put_be(put_byte(p, 0xca), bits, 4);
+            }
+        };
+
+        template<>
+        struct field<double> {
+            static const bool sized = true;
+            static size_t size(double, size_t&) {
+                return 9;
+            }
+            static char * write(char * p, double v, size_t) {
+                uint64_t bits;
+                memcpy(&bits, &v, sizeof(bits));
+                return put_be(put_byte(p, 0xcb), bits, 8);
+            }
+        };
+
+        template<>
+        struct field<std::string> {
+            static const bool sized = true;
+            static size_t size(const std::string& v, size_t& length) {
+                length = v.size();
+                return str_header_size(length) + length;
+            }
+            static char * write(char * p, const std::string& v, size_t length) {
+                p = put_str_header(p, length);
+                memcpy(p, v.data(), length);
+                return p + length;
+            }
+        };
+
+        template<>
+        struct field<const char *> {
+            static const bool sized = true;
+            static size_t size(const char * v, size_t& length) {
+                length = strlen(v);
+                return str_header_size(length) + length;
+            }
+            static char * write(char * p, const char * v, size_t length) {
+                p = put_str_header(p, length);
+                memcpy(p, v, length);
+                return p + length;
+            }
+        };
+
+        template<>
+        struct field<char *> : field<const char *> { };
+
+        template<size_t N>
+        struct field<char[N]> : field<const char *> { };
+
+        /* A key and a value of a sized field, with one write, in a
+         * record that also has values for the packer. */
+        template<typename V>
+        typename std::enable_if<field<V>::sized>::type
+        append(::msgpack::sbuffer& out, packer_t&, const char * key, size_t key_size, const V& v)
+        {
+            char stack[64];
+            size_t length = 0;
+            size_t total = key_size + field<V>::size(v, length);
+            char * p = stack;
+            if( total > sizeof(stack) ) {
+                static thread_local std::string large;
+                if( large.size() < total ) {
+                    large.resize(total);
+                }
+                p = &large[0];
+            }
+            memcpy(p, key, key_size);
+            field<V>::write(p + key_size, v, length);
+            out.write(p, total);
+        }
+
+        template<typename V>
+        typename std::enable_if<!field<V>::sized>::type
+        append(::msgpack::sbuffer& out, packer_t& packer, const char * key, size_t key_size, const V& v)
+        {
+            field<V>::append(out, packer, key, key_size, v);
+        }
+
+        template<typename... Keys>
+        struct fields;
+
+        template<>
+        struct fields<> {
+            template<typename... Vs>
+            struct sized : std::true_type { };
+
+            static size_t size(size_t *) {
+                return 0;
+            }
+            static char * write(char * p, const size_t *) {
+                return p;
+            }
+            static void append(::msgpack::sbuffer&, packer_t&) { }
+        };
+
+        template<typename K, typename... Ks>
+        struct fields<K, Ks...> {
+            /* whether every value's encoded size is known up front */
+            template<typename V, typename... Vs>
+            struct sized : std::integral_constant<bool, field<V>::sized &&
+                fields<Ks...>::template sized<Vs...>::value> { };
+
+            template<typename V, typename... Vs>
+            static size_t size(size_t * lengths, const V& v, const Vs&... vs) {
+                return K::packed_size + field<V>::size(v, *lengths) + fields<Ks...>::size(lengths + 1, vs...);
+            }
+
+            template<typename V, typename... Vs>
+            static char * write(char * p, const size_t * lengths, const V& v, const Vs&... vs) {
+                memcpy(p, K::packed, K::packed_size);
+                p = field<V>::write(p + K::packed_size, v, *lengths);
+                return fields<Ks...>::write(p, lengths + 1, vs...);
+            }
+
+            template<typename V, typename... Vs>
+            static void append(::msgpack::sbuffer& out, packer_t& packer, const V& v, const Vs&... vs) {
+                schema_detail::append(out, packer, K::packed, K::packed_size, v);
+                fields<Ks...>::append(out, packer, vs...);
+            }
+        };
+    }
+
+    /* A fixed record layout, declared once:
+     *
+     *   typedef fluent::Schema<FLUENT_KEY("method"), FLUENT_KEY("status")> Access;
+     *   logger.log_record<Access>(tag, "GET", 200);
+     *
+     * The map header and every key are encoded at compile time.  A
+     * record of scalars and strings is sized exactly first (strings are
+     * measured once), encoded by hand into a buffer of that size and
+     * appended with one write: on the stack for a record of up to
+     * stack_size bytes, in a buffer of the thread's own past that.  A
+     * value msgpack's packer has to encode makes it one write per
+     * field instead. */
+    template<typename... Keys>
+    class Schema {
+    private:
+        typedef schema_detail::fields<Keys...> fields;
+
+    public:
+        static const size_t size = sizeof...(Keys);
+        static const size_t header_size = size < 16 ? 1 : 3;
+        static constexpr char header[3] = {
+            static_cast<char>(size < 16 ? 0x80 | size : 0xde),
+            static_cast<char>(size >> 8),
+            static_cast<char>(size & 0xff),
+        };
+
+        static const size_t stack_size = 512;
+
+        template<typename... Values>
+        static typename std::enable_if<fields::template sized<Values...>::value>::type
+        pack(::msgpack::sbuffer& out, const Values&... values)
+        {
+            static_assert(sizeof...(Values) == size,
+                    "a record needs exactly one value per schema key");
+            size_t lengths[size ? size : 1];
+            size_t total = header_size + fields::size(lengths, values...);
+            char stack[stack_size];
+            char * p = stack;
+            if( total > stack_size ) {
+                static thread_local std::string large;
+                if( large.size() < total ) {
+                    large.resize(total);
+                }
+                p = &large[0];
+            }
+            memcpy(p, header, header_size);
+            fields::write(p + header_size, lengths, values...);
+            out.write(p, total);
+        }
+
+        template<typename... Values>
+        static typename std::enable_if<!fields::template sized<Values...>::value>::type
+        pack(::msgpack::sbuffer& out, const Values&... values)
+        {
+            static_assert(sizeof...(Values) == size,
+                    "a record needs exactly one value per schema key");
+            schema_detail::packer_t packer(out);
+            out.write(header, header_size);
+            fields::append(out, packer, values...);
+        }
+    };
+
+    template<typename... Keys>
+    constexpr char Schema<Keys...>::header[3];
+}
+
+#endif /* __FLUENT_SCHEMA_H__ */
@@ -0,0 +1,193 @@
+#ifndef __FLUENT_SHM_RING_H__
+#define __FLUENT_SHM_RING_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef FLUENT_MT
+#include <pthread.h>
+#endif
+
+#include <msgpack.hpp>
+
+namespace fluent {
+
+    class Sender;
+
+    /* Multi-producer / single-consumer ring of packed records in shared
+     * memory, so many processes can log through one Sender.
+     *
+     * A push reserves space with one CAS on the shared head, copies the
+     * record in and publishes it with a release store: no lock and no
+     * system call.  Records are kept whole; one that would run past the
+     * end of the ring is preceded by padding and starts over at the front.
+     * The consumer frees what it has read by zeroing it, so a record that
+     * has been reserved but not yet published always reads as not ready.
+     *
+     * A producer killed in the middle of a push leaves a record that is
+     * never published, and the ring stops there; it is a window of a few
+     * instructions and a memcpy. */
+    class ShmRing {
+    private:
+        struct Header {
+            char magic[8];
+            uint64_t capacity;
+            char pad0[48];
+            std::atomic<uint64_t> head;
+            char pad1[56];
+            std::atomic<uint64_t> tail;
+            char pad2[56];
+            std::atomic<uint64_t> dropped;
+        };
+
+        size_t map_size;
+        Header * header;
+        char * data;
+        uint64_t mask;
+
+    public:
+        /* the header's share of the mapping */
+        static const size_t page_size = 4096;
+
+        /* An anonymous ring of capacity bytes (rounded up to a power of
+         * two), shared with the processes forked after it is made. */
+        explicit ShmRing(size_t capacity);
+
+        /* The ring named name (as for shm_open, "/something"), made with
+         * capacity bytes if it does not exist yet, so processes that do
+         * not share a parent can use it too.  Remove it with unlink(). */
+        ShmRing(const std::string& name, size_t capacity);
+
+        ~ShmRing();
+
+        ShmRing(const ShmRing&) = delete;
+        ShmRing& operator=(const ShmRing&) = delete;
+
+        static void unlink(const std::string& name);
+
+        size_t capacity() const {
+            return mask + 1;
+        }
+
+        /* Copies one record in.  False if it does not fit right now, or
+         * is over a quarter of the capacity; the record is counted as
+         * dropped.  Safe from any thread of any process sharing the ring. */
+        bool push(const char * record, size_t length);
+
+        /* Calls consume(const char *, size_t) on the oldest record and
+         * frees it.  False if there is none ready.  One consumer only. */
+        template<typename F>
+        bool pop(F consume);
+
+        bool empty() const {
+            return header->head.load(std::memory_order_acquire) ==
+                header->tail.load(std::memory_order_relaxed);
+        }
+
+        size_t get_dropped() const {
+            return header->dropped.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct Record {
+            std::atomic<uint32_t> state;
+            uint32_t length;
+        };
+        enum state_t {
+            FREE = 0,
+            READY = 1,
+            PADDING = 2,
+        };
+
+        static size_t record_size(size_t length) {
+            return sizeof(Record) + ((length + 7) & ~static_cast<size_t>(7));
+        }
+        Record * at(uint64_t pos) const {
+            return reinterpret_cast<Record *>(data + (pos & mask));
+        }
+
+        void map(int fd, size_t capacity, bool create);
+        void release(uint64_t tail, size_t size);
+    };
+
+    template<typename F>
+    bool ShmRing::pop(F consume)
+    {
+        uint64_t tail = header->tail.load(std::memory_order_relaxed);
+        for(;;) {
+            Record * record = at(tail);
+            uint32_t state = record->state.load(std::memory_order_acquire);
+            if( state == FREE ) {
+                return false;
+            }
+            size_t size = record_size(record->length);
+            if( state == READY ) {
+                consume(reinterpret_cast<const char *>(record + 1), static_cast<size_t>(record->length));
+            }
+            release(tail, size);
+            tail += size;
+            if( state == READY ) {
+                return true;
+            }
+        }
+    }
+
+    /* Logger sink that writes records into a ShmRing, for the processes
+     * that share it:
+     *
+     *     BasicLogger<RingWriter> logger("app", ring);
+     *
+     * A Collector forwards them. */
+    class RingWriter {
+    private:
+        ShmRing& ring;
+
+    public:
+        explicit RingWriter(ShmRing& r) : ring(r) { }
+
+        bool emit(const ::msgpack::sbuffer& sbuf) {
+            return ring.push(sbuf.data(), sbuf.size());
+        }
+    };
+
+    /* Drains a ShmRing into a Sender, which batches, buffers and sends the
+     * records as if they had been logged through it.  Run it in one
+     * process only: by hand with drain(), or on a thread of its own with
+     * start(). */
+    class Collector {
+    private:
+        ShmRing& ring;
+        Sender& sender;
+        std::string record;
+#ifdef FLUENT_MT
+        pthread_t thread;
+        std::atomic<bool> running;
+#endif
+
+    public:
+        /* How long the thread sleeps when it finds the ring empty. */
+        static const long idle_usec = 1000;
+
+        Collector(ShmRing& r, Sender& s);
+        ~Collector();
+
+        Collector(const Collector&) = delete;
+        Collector& operator=(const Collector&) = delete;
+
+        /* Forwards what is in the ring now; returns the record count. */
+        size_t drain();
+
+#ifdef FLUENT_MT
+        void start();
+        /* Stops the thread after a last drain(). */
+        void stop();
+
+    private:
+        static void * collector_main(void * self);
+#endif
+    };
+}
+
+#endif /* __FLUENT_SHM_RING_H__ */
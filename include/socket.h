@@ -3,9 +3,15 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "resolver.h"
 
 namespace fluent {
     class ErrnoException : public ::std::runtime_error {
@@ -38,6 +44,33 @@ namespace fluent {
     private:
         int fd;
         bool connected;
+        /* kept so the socket can be reopened after close() */
+        int domain;
+        int type;
+        int protocol;
+        float timeout;
+        /* < 0: a blocking connect waits as long as timeout allows */
+        float connect_timeout;
+        bool nonblocking;
+        /* a connect started by start_background_connect() is under way */
+        bool background;
+        /* MSG_ZEROCOPY threshold; 0 disables it */
+        size_t zerocopy;
+        /* zerocopy sends made and reported done, counted over every
+         * descriptor this socket has had; the current one's count
+         * started at zerocopy_base */
+        uint32_t zerocopy_sent;
+        uint32_t zerocopy_done;
+        uint32_t zerocopy_base;
+        /* TCP_NODELAY, TCP_CORK around each sendv(), and SO_SNDBUF if
+         * > 0; reapplied whenever the socket is reopened */
+        bool nodelay;
+        bool cork;
+        int send_buffer;
+
+        /* what the host resolved to, tried in order until one connects */
+        Resolver::AddressList addresses;
+        size_t next_address;
     public:
         enum domain_t {
             LOCAL = PF_LOCAL,
@@ -45,8 +78,12 @@ namespace fluent {
             ROUTE = PF_ROUTE,
             KEY = PF_KEY,
             INET6 = PF_INET6,
+#ifdef PF_SYSTEM
             SYSTEM = PF_SYSTEM,
+#endif
+#ifdef PF_NDRV
             NDRV = PF_NDRV,
+#endif
         };
 
         enum type_t {
@@ -59,10 +96,123 @@ namespace fluent {
         Socket(domain_t domain, type_t type, int protocol = 0);
         ~Socket();
 
+        Socket(const Socket&) = delete;
+        Socket& operator=(const Socket&) = delete;
+
         void settimeout(float timeout);
+
+        /* Bounds each blocking connect attempt separately from the send
+         * timeout, so an unreachable address is given up on quickly.
+         * < 0 (the default) leaves connects to the send timeout. */
+        void set_connect_timeout(float t) {
+            connect_timeout = t;
+        }
+
+        /* Tries every address host resolves to, in order, and throws the
+         * last one's error if none of them takes the connection.  For a
+         * LOCAL socket, host is the path to connect to and port is
+         * ignored. */
         void connect(const std::string& host, int port);
+
+        /* Non-blocking operation, for event loops.  The flag sticks
+         * across reopening the socket. */
+        void set_nonblocking(bool on);
+
+        /* Starts connecting.  Returns true if the connection is already
+         * up; false if a non-blocking connect is in progress, in which case
+         * call finish_connect() once the socket turns writable. */
+        bool start_connect(const std::string& host, int port);
+
+        /* For an event loop: loads host's addresses only if the Resolver
+         * has them, without waiting for it.  False while it is still
+         * looking; otherwise start_connect() goes on to them. */
+        bool try_resolve(const std::string& host, int port);
+        bool start_connect();
+
+        /* True once connected.  False if that address failed and the next
+         * one is being tried; the descriptor may have changed, wait for it
+         * to turn writable again.  Throws once every address failed. */
+        bool finish_connect();
+
+        /* Connects a blocking socket without blocking: like start_connect()
+         * on a non-blocking one, but the socket goes back to blocking once
+         * connected.  Check on it with poll_connect(), which returns true
+         * once connected and false while still in progress, and throws
+         * once every address failed.  poll_connect() waits up to wait
+         * seconds for the socket to turn writable. */
+        bool start_background_connect(const std::string& host, int port);
+        bool poll_connect(float wait = 0);
+        bool connecting() const {
+            return background;
+        }
+
+        /* Both sends loop until every byte is written, so a short write
+         * never drops the tail of a record. */
         void send(const char * data, size_t length);
+
+        /* Gathers count buffers with sendmsg.  iov is used as scratch
+         * space and is modified.  pinned: see set_zerocopy(). */
+        void sendv(struct iovec * iov, size_t count, bool pinned = false);
+
+        /* Pinned sends of at least threshold bytes use MSG_ZEROCOPY
+         * (Linux 4.14+).  A pinned send promises that its buffers stay
+         * as they are until reap_zerocopy() reaches the zerocopy_issued()
+         * count taken after it; neither call waits for the kernel.
+         * close() waits for the sends in flight (a second at most, or
+         * the send timeout) and abort() drops them.  0 turns it off.
+         * Returns false if the platform does not support it. */
+        bool set_zerocopy(size_t threshold);
+
+        uint32_t zerocopy_issued() const {
+            return zerocopy_sent;
+        }
+
+        bool zerocopy_in_flight() const {
+            return zerocopy_done != zerocopy_sent;
+        }
+
+        /* Reads the completions the kernel has posted; returns how many
+         * zerocopy sends are done, on the zerocopy_issued() scale. */
+        uint32_t reap_zerocopy();
+
+        /* TCP_NODELAY: small writes go out at once instead of waiting
+         * for the previous segment's ack.  Sparse records then leave
+         * without Nagle's delay. */
+        bool set_nodelay(bool on);
+
+        /* TCP_CORK for the length of each sendv(), so the writes of one
+         * gathered send leave as full segments and the tail goes when it
+         * returns.  Not for try_sendv(), which an event loop calls
+         * piecemeal. */
+        bool set_cork(bool on);
+
+        /* SO_SNDBUF in bytes; the kernel may round it.  Call before
+         * connecting for it to count towards the window. */
+        bool set_send_buffer(int bytes);
+
+        /* The three return false where the option does not apply (a LOCAL
+         * socket has no Nagle or cork) or the platform lacks it; the
+         * setting is kept and retried on the next socket regardless. */
+
+        /* Non-blocking counterparts: write / read what the socket takes
+         * right now and return the byte count, 0 meaning it would block.
+         * try_sendv advances iov like sendv, and takes pinned the same.
+         * recv_some throws Closed once the peer has shut down. */
+        size_t try_sendv(struct iovec * iov, size_t count, bool pinned = false);
+        size_t try_send(const char * data, size_t length);
+        size_t recv_some(char * data, size_t length);
+
         void close();
+        /* Closes with a reset, dropping whatever is still unsent. */
+        void abort();
+
+        int get_fd() const {
+            return fd;
+        }
+
+        /* Bytes written but not yet acknowledged by the peer's TCP, or -1
+         * where the platform cannot tell. */
+        long outstanding() const;
 
         operator bool() const {
             return connected;
@@ -97,6 +247,10 @@ namespace fluent {
         public:
             NotConnected() : ::std::runtime_error("The socket is not connected.") { }
         };
+        class Closed : public ::std::runtime_error {
+        public:
+            Closed() : ::std::runtime_error("The peer closed the connection.") { }
+        };
 
         class Connected : public ErrnoException {
         public:
@@ -141,6 +295,33 @@ namespace fluent {
             PermissionDenied() : ErrnoException(EACCES, "[EACCES] "
                     "Permission denied.") { }
         };
+
+        /* Connect errors only UNIX domain sockets have, from the path */
+        class NoSuchSocket : public ErrnoException {
+        public:
+            NoSuchSocket() : ErrnoException(ENOENT, "[ENOENT] "
+                    "There is no socket at that path.") { }
+        };
+        class NotADirectory : public ErrnoException {
+        public:
+            NotADirectory() : ErrnoException(ENOTDIR, "[ENOTDIR] "
+                    "A component of the socket's path is not a directory.") { }
+        };
+        class PathTooLong : public ErrnoException {
+        public:
+            PathTooLong() : ErrnoException(ENAMETOOLONG, "[ENAMETOOLONG] "
+                    "The socket's path is too long.") { }
+        };
+        class SymlinkLoop : public ErrnoException {
+        public:
+            SymlinkLoop() : ErrnoException(ELOOP, "[ELOOP] "
+                    "There are too many symbolic links in the socket's path.") { }
+        };
+        class ListenerBusy : public ErrnoException {
+        public:
+            ListenerBusy() : ErrnoException(EAGAIN, "[EAGAIN] "
+                    "The listening socket's backlog is full.") { }
+        };
         
         class AFNotSupported : public ErrnoException {
         public:
@@ -162,7 +343,7 @@ namespace fluent {
         class AddressResolutionError : public ::std::runtime_error {
             int ecode;
         public:
-            inline AddressResolutionError(int e);
+            AddressResolutionError(int e) : ::std::runtime_error(gai_strerror(e)), ecode(e) { }
             int getCode() const {
                 return ecode;
             }
@@ -270,6 +451,15 @@ namespace fluent {
             PreviousWriteError() : ErrnoException(EIO, "[EIO] "
                     "A previously uncommitted write encoutered an I/O error") { }
         };
+
+    private:
+        void open();
+        int zerocopy_flag(bool pinned, size_t length) const;
+        void count_zerocopy(int flags);
+        bool wait_zerocopy();
+        void resolve(const std::string& host, int port);
+        bool connect_next();
+        int connect_address(const Resolver::Address& address);
     };
 }
 
@@ -0,0 +1,98 @@
+#ifndef __FLUENT_SPOOL_H__
+#define __FLUENT_SPOOL_H__
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+namespace fluent {
+
+    /* Append-only overflow for a Sender's backlog, on disk.
+     *
+     * Units (whole forward messages) are appended as length-prefixed
+     * frames to memory-mapped segment files of segment_size bytes in dir,
+     * and read back in order.  A segment is deleted once it has been read
+     * through, so the spool uses at most max_segments * segment_size of
+     * disk and writes and reads it sequentially.  Segments left behind by
+     * an earlier process are picked up and replayed first.
+     *
+     * A segment starts with a magic number and the offset of its first
+     * frame not yet consumed, which consume() keeps up to date, so a
+     * restart replays only what was never delivered. */
+    class Spool {
+    private:
+        struct Segment {
+            uint64_t seq;
+            int fd;
+            char * map;
+            size_t size;
+            size_t pos;
+
+            Segment() : seq(0), fd(-1), map(nullptr), size(0), pos(0) { }
+        };
+
+        std::string dir;
+        size_t segment_size;
+        size_t max_segments;
+        /* every segment on disk, oldest first; the last one may be open
+         * for writing, the first one is being read */
+        std::deque<uint64_t> segments;
+        uint64_t next_seq;
+        Segment writing;
+        Segment reading;
+        size_t units;
+        size_t bytes;
+        size_t dropped;
+
+    public:
+        /* the magic number, then the read position */
+        static const size_t header_size = 16;
+
+        explicit Spool(const std::string& d, size_t seg_size = 16*1024*1024, size_t max_segs = 64);
+        ~Spool();
+
+        Spool(const Spool&) = delete;
+        Spool& operator=(const Spool&) = delete;
+
+        /* Appends count buffers as one unit.  Returns false, and drops
+         * the unit, if the spool is full or the disk refuses it. */
+        bool append(const struct iovec * iov, size_t count);
+        bool append(const char * data, size_t length);
+
+        /* Adds up to max_bytes worth of the oldest units (always at least
+         * one) to out without removing them, one buffer per unit.  The
+         * buffers point into the spool and stay valid until consume().
+         * Returns the number of units added. */
+        size_t peek(std::vector<struct iovec>& out, size_t max_bytes);
+
+        /* Removes the n oldest units, once they have been delivered. */
+        void consume(size_t n);
+
+        bool empty() const {
+            return units == 0;
+        }
+        size_t size() const {
+            return bytes;
+        }
+        /* Units refused because the spool was full. */
+        size_t get_dropped() const {
+            return dropped;
+        }
+
+    private:
+        std::string path(uint64_t seq) const;
+        bool open_writing();
+        void close_writing();
+        void open_reading();
+        void close_reading();
+        void drop_oldest();
+        void recover();
+        static bool next_frame(const Segment& seg, size_t pos, uint32_t& length);
+        static size_t read_position(const Segment& seg);
+    };
+}
+
+#endif /* __FLUENT_SPOOL_H__ */
@@ -0,0 +1,84 @@
+#ifndef __FLUENT_TAG_H__
+#define __FLUENT_TAG_H__
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+namespace fluent {
+
+    class Limiter;
+
+    /* A resolved tag: the label a caller used, the full tag it maps to,
+     * and that tag already msgpack-encoded so logging only copies bytes. */
+    struct TagEntry {
+        std::string label;
+        std::string name;
+        std::string packed;
+        TagEntry * next;
+        /* Set by Logger::limit() while the entry is in use, hence
+         * mutable; owned by the Logger. */
+        mutable std::atomic<Limiter *> limiter;
+
+        TagEntry(const std::string& l, const std::string& n);
+
+        TagEntry(const TagEntry&) = delete;
+        TagEntry& operator=(const TagEntry&) = delete;
+    };
+
+    /* Handle returned by Logger::tag().  Cheap to copy; stays valid as
+     * long as the Logger that made it. */
+    class Tag {
+    private:
+        const TagEntry * entry;
+
+    public:
+        explicit Tag(const TagEntry * e) : entry(e) { }
+
+        const std::string& name() const {
+            return entry->name;
+        }
+        const std::string& packed() const {
+            return entry->packed;
+        }
+        const TagEntry * get() const {
+            return entry;
+        }
+    };
+
+    /* Insert-only, lock-free map from label to TagEntry.
+     *
+     * Open addressing over a fixed array of atomic pointers: readers do a
+     * hash, an acquire load and a string compare; writers publish with a
+     * CAS.  Entries are never removed, so pointers handed out stay valid
+     * until the cache is destroyed.  Once the table is full, new entries
+     * go on a lock-free overflow list, one per label, which lookup()
+     * walks after the table; those labels cost a linear search. */
+    class TagCache {
+    public:
+        static const size_t capacity = 256;
+
+    private:
+        std::atomic<TagEntry *> slots[capacity];
+        std::atomic<TagEntry *> overflow;
+        std::hash<std::string> hasher;
+
+    public:
+        TagCache();
+        ~TagCache();
+
+        TagCache(const TagCache&) = delete;
+        TagCache& operator=(const TagCache&) = delete;
+
+        const TagEntry * lookup(const std::string& label) const;
+
+        /* Takes ownership of entry.  Returns the entry now associated with
+         * its label, which is an older one if another thread won the race
+         * (entry is then freed).  If the table is full and the label is
+         * not on the overflow list, entry is added to it when keep is
+         * true, or freed and nullptr returned otherwise. */
+        const TagEntry * insert(TagEntry * entry, bool keep = true);
+    };
+}
+
+#endif /* __FLUENT_TAG_H__ */
@@ -0,0 +1,176 @@
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <stdexcept>
+
+#include "ack.h"
+
+/* "chunk" as a msgpack key, then the fixstr header of an id */
+static const char CHUNK_KEY[] = "\xa5" "chunk";
+static const size_t CHUNK_SUFFIX = sizeof(CHUNK_KEY) - 1 + 1 + fluent::AckWindow::id_length;
+
+static uint64_t id_seed()
+{
+    uint64_t seed = 0;
+    int fd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if( fd >= 0 ) {
+        if( ::read(fd, &seed, sizeof(seed)) != static_cast<ssize_t>(sizeof(seed)) ) {
+            seed = 0;
+        }
+        ::close(fd);
+    }
+    if( !seed ) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = (static_cast<uint64_t>(ts.tv_sec) << 32) ^ ts.tv_nsec ^ (static_cast<uint64_t>(getpid()) << 48);
+    }
+    return seed;
+}
+
+std::string fluent::AckWindow::make_id()
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    /* random per process, then a counter: unique without a syscall */
+    static const uint64_t seed = id_seed();
+    static std::atomic<uint64_t> counter(0);
+    uint64_t count = counter.fetch_add(1, std::memory_order_relaxed);
+
+    unsigned char raw[18];
+    for( int i = 0; i < 8; ++i ) {
+        raw[i] = static_cast<unsigned char>(seed >> (56 - 8 * i));
+        raw[8 + i] = static_cast<unsigned char>(count >> (56 - 8 * i));
+    }
+    raw[16] = raw[17] = 0;
+
+    std::string id(id_length, '=');
+    for( size_t i = 0, o = 0; i < 16; i += 3, o += 4 ) {
+        uint32_t bits = (raw[i] << 16) | (raw[i + 1] << 8) | raw[i + 2];
+        id[o] = alphabet[(bits >> 18) & 0x3f];
+        id[o + 1] = alphabet[(bits >> 12) & 0x3f];
+        if( i + 1 < 16 ) {
+            id[o + 2] = alphabet[(bits >> 6) & 0x3f];
+        }
+        if( i + 2 < 16 ) {
+            id[o + 3] = alphabet[bits & 0x3f];
+        }
+    }
+    return id;
+}
+
+bool fluent::AckWindow::find_id(const char * data, size_t length, std::string& id)
+{
+    if( length < CHUNK_SUFFIX ) {
+        return false;
+    }
+    const char * p = data + length - CHUNK_SUFFIX;
+    if( memcmp(p, CHUNK_KEY, sizeof(CHUNK_KEY) - 1) != 0 ||
+            static_cast<unsigned char>(p[sizeof(CHUNK_KEY) - 1]) != (0xa0 | id_length) ) {
+        return false;
+    }
+    id.assign(data + length - id_length, id_length);
+    return true;
+}
+
+void fluent::AckWindow::sent(const struct iovec * iov, size_t count, double now)
+{
+    chunks.push_back(Chunk());
+    Chunk& chunk = chunks.back();
+    for( size_t i = 0; i < count; ++i ) {
+        chunk.data.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+    }
+    if( !find_id(chunk.data.data(), chunk.data.size(), chunk.id) ) {
+        chunks.pop_back();
+        return;
+    }
+    chunk.sent_at = now;
+}
+
+void fluent::AckWindow::sent(const char * data, size_t length, double now)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(data);
+    iov.iov_len = length;
+    sent(&iov, 1, now);
+}
+
+/* 1 (and the str's extent) if p starts with a complete str, 0 if it
+ * might once more bytes arrive, -1 if it is something else */
+static int str_at(const unsigned char * p, size_t length, size_t& header, size_t& body)
+{
+    if( !length ) {
+        return 0;
+    }
+    if( (p[0] & 0xe0) == 0xa0 ) {
+        header = 1;
+        body = p[0] & 0x1f;
+    }
+    else if( p[0] == 0xd9 ) {
+        header = 2;
+        if( length < header ) {
+            return 0;
+        }
+        body = p[1];
+    }
+    else if( p[0] == 0xda ) {
+        header = 3;
+        if( length < header ) {
+            return 0;
+        }
+        body = (size_t(p[1]) << 8) | p[2];
+    }
+    else {
+        return -1;
+    }
+    return header + body <= length ? 1 : 0;
+}
+
+void fluent::AckWindow::received(const char * data, size_t length)
+{
+    input.append(data, length);
+    size_t pos = 0;
+    while( pos < input.size() ) {
+        const unsigned char * p = reinterpret_cast<const unsigned char *>(input.data()) + pos;
+        size_t left = input.size() - pos;
+        size_t key_header = 0, key_body = 0, value_header = 0, value_body = 0;
+        if( p[0] != 0x81 ) {
+            throw ::std::runtime_error("The server sent something other than an ack.");
+        }
+        int found = str_at(p + 1, left - 1, key_header, key_body);
+        if( found > 0 ) {
+            size_t key = 1 + key_header + key_body;
+            found = str_at(p + key, left - key, value_header, value_body);
+            if( found > 0 && (key_body != 3 || memcmp(p + 1 + key_header, "ack", 3) != 0) ) {
+                found = -1;
+            }
+            if( found > 0 ) {
+                std::string id(reinterpret_cast<const char *>(p + key + value_header), value_body);
+                for( std::deque<Chunk>::iterator it = chunks.begin(); it != chunks.end(); ++it ) {
+                    if( it->id == id ) {
+                        chunks.erase(it);
+                        break;
+                    }
+                }
+                pos += key + value_header + value_body;
+                continue;
+            }
+        }
+        if( found < 0 ) {
+            throw ::std::runtime_error("The server sent something other than an ack.");
+        }
+        break;
+    }
+    input.erase(0, pos);
+}
+
+void fluent::AckWindow::requeue(ChunkList& out, std::deque<size_t>& ends)
+{
+    for( size_t i = 0; i < chunks.size(); ++i ) {
+        out.write(chunks[i].data.data(), chunks[i].data.size());
+        ends.push_back(out.size());
+    }
+    chunks.clear();
+    input.clear();
+}
@@ -0,0 +1,222 @@
+#include <cmath>
+#include <new>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "ack.h"
+#include "batch.h"
+
+constexpr double fluent::Batcher::RATE_WINDOW;
+
+fluent::Batcher::Batcher(mode_t m, size_t b, double age)
+    : mode(m), max_bytes(b), max_age(age), max_events(0), linger(0), chunk_ids(false),
+        index(), active(), resting(), key(), raw(), bytes(0), count(0), oldest(0),
+        rate(0), window_start(0), window_bytes(0), zstream(nullptr)
+{
+    if( mode == COMPRESSED_PACKED_FORWARD ) {
+        zstream = new z_stream();
+        /* windowBits + 16 asks zlib for a gzip header and trailer */
+        int retval = deflateInit2(zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                15 + 16, 8, Z_DEFAULT_STRATEGY);
+        if( retval != Z_OK ) {
+            delete zstream;
+            if( retval == Z_MEM_ERROR ) {
+                throw ::std::bad_alloc();
+            }
+            throw ::std::runtime_error("Could not initialize gzip compression.");
+        }
+    }
+}
+
+fluent::Batcher::~Batcher()
+{
+    std::unordered_map<std::string, Group *>::iterator it = index.begin();
+    for( ; it != index.end(); ++it ) {
+        delete it->second;
+    }
+    if( zstream ) {
+        deflateEnd(zstream);
+        delete zstream;
+    }
+}
+
+size_t fluent::Batcher::str_length(const char * data, size_t length)
+{
+    if( length < 1 ) {
+        return 0;
+    }
+    const unsigned char * p = reinterpret_cast<const unsigned char *>(data);
+    size_t header = 0;
+    size_t body = 0;
+    if( (p[0] & 0xe0) == 0xa0 ) {
+        header = 1;
+        body = p[0] & 0x1f;
+    }
+    else if( p[0] == 0xd9 && length >= 2 ) {
+        header = 2;
+        body = p[1];
+    }
+    else if( p[0] == 0xda && length >= 3 ) {
+        header = 3;
+        body = (size_t(p[1]) << 8) | p[2];
+    }
+    else if( p[0] == 0xdb && length >= 5 ) {
+        header = 5;
+        body = (size_t(p[1]) << 24) | (size_t(p[2]) << 16) | (size_t(p[3]) << 8) | p[4];
+    }
+    else {
+        return 0;
+    }
+    if( header + body > length ) {
+        return 0;
+    }
+    return header + body;
+}
+
+void fluent::Batcher::add(const char * data, size_t length, double now)
+{
+    if( !bytes ) {
+        oldest = now;
+    }
+    bytes += length;
+    ++count;
+
+    window_bytes += length;
+    double span = now - window_start;
+    if( span >= RATE_WINDOW ) {
+        /* what came before counts half as much per window since, so the
+         * rate falls away quickly once traffic goes quiet */
+        double kept = ::pow(0.5, span / RATE_WINDOW);
+        rate = rate * kept + (window_bytes / span) * (1 - kept);
+        window_start = now;
+        window_bytes = 0;
+    }
+
+    /* Message mode is fixarray(3), tag, time, record.
+     * Anything else goes through untouched. */
+    size_t tag_length = 0;
+    if( length > 1 && static_cast<unsigned char>(data[0]) == 0x93 ) {
+        tag_length = str_length(data + 1, length - 1);
+    }
+    if( !tag_length ) {
+        raw.write(data, length);
+        return;
+    }
+
+    key.assign(data + 1, tag_length);
+    Group *& group = index[key];
+    if( !group ) {
+        group = new Group();
+        group->tag = key;
+    }
+    if( !group->count ) {
+        active.push_back(group);
+    }
+
+    /* [time, record] is the rest of the message under a fixarray(2) */
+    static const char entry_header = static_cast<char>(0x92);
+    group->entries.write(&entry_header, 1);
+    group->entries.write(data + 1 + tag_length, length - 1 - tag_length);
+    ++group->count;
+}
+
+void fluent::Batcher::compress(const char * data, size_t length, std::string& out)
+{
+    deflateReset(zstream);
+    out.resize(deflateBound(zstream, length));
+    zstream->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    zstream->avail_in = length;
+    zstream->next_out = reinterpret_cast<Bytef *>(&out[0]);
+    zstream->avail_out = out.size();
+    /* deflateBound guarantees a single call is enough */
+    int retval = deflate(zstream, Z_FINISH);
+    if( retval != Z_STREAM_END ) {
+        throw ::std::runtime_error("gzip compression of a chunk failed.");
+    }
+    out.resize(zstream->total_out);
+}
+
+static void push(std::vector<struct iovec>& iov, const char * data, size_t length)
+{
+    struct iovec v;
+    v.iov_base = const_cast<char *>(data);
+    v.iov_len = length;
+    iov.push_back(v);
+}
+
+void fluent::Batcher::gather(std::vector<struct iovec>& iov, std::vector<size_t> * ends)
+{
+    /* "compressed": "gzip" */
+    static const char gzip_option[] = "\xaa" "compressed" "\xa4" "gzip";
+    /* the chunk entry goes last, where AckWindow::find_id() looks */
+    static const char chunk_option[] = "\xa5" "chunk";
+    bool compressed = mode == COMPRESSED_PACKED_FORWARD;
+    for( size_t i = 0; i < active.size(); ++i ) {
+        Group& group = *active[i];
+        group.head.clear();
+        ::msgpack::packer< ::msgpack::sbuffer> packer(group.head);
+        packer.pack_array(compressed || chunk_ids ? 3 : 2);
+        group.head.write(group.tag.data(), group.tag.size());
+        switch( mode ) {
+            case FORWARD:
+                packer.pack_array(group.count);
+                push(iov, group.head.data(), group.head.size());
+                push(iov, group.entries.data(), group.entries.size());
+                break;
+            case PACKED_FORWARD:
+                packer.pack_bin(group.entries.size());
+                push(iov, group.head.data(), group.head.size());
+                push(iov, group.entries.data(), group.entries.size());
+                break;
+            case COMPRESSED_PACKED_FORWARD:
+                compress(group.entries.data(), group.entries.size(), group.zbuf);
+                packer.pack_bin(group.zbuf.size());
+                push(iov, group.head.data(), group.head.size());
+                push(iov, group.zbuf.data(), group.zbuf.size());
+                break;
+        }
+        if( compressed || chunk_ids ) {
+            group.option.assign(1, static_cast<char>(0x80 | (compressed + chunk_ids)));
+            if( compressed ) {
+                group.option.append(gzip_option, sizeof(gzip_option) - 1);
+            }
+            if( chunk_ids ) {
+                std::string id = AckWindow::make_id();
+                group.option.append(chunk_option, sizeof(chunk_option) - 1);
+                group.option += static_cast<char>(0xa0 | id.size());
+                group.option += id;
+            }
+            push(iov, group.option.data(), group.option.size());
+        }
+        if( ends ) {
+            ends->push_back(iov.size());
+        }
+    }
+    if( raw.size() ) {
+        push(iov, raw.data(), raw.size());
+        if( ends ) {
+            ends->push_back(iov.size());
+        }
+    }
+}
+
+void fluent::Batcher::clear()
+{
+    /* emptied last time and not used since */
+    for( size_t i = 0; i < resting.size(); ++i ) {
+        if( !resting[i]->count ) {
+            index.erase(resting[i]->tag);
+            delete resting[i];
+        }
+    }
+    for( size_t i = 0; i < active.size(); ++i ) {
+        active[i]->entries.clear();
+        active[i]->count = 0;
+    }
+    resting.swap(active);
+    active.clear();
+    raw.clear();
+    bytes = 0;
+    count = 0;
+}
@@ -0,0 +1,152 @@
+#include <string.h>
+
+#ifdef FLUENT_MT
+#include <pthread.h>
+#endif
+
+#include "chunk_list.h"
+
+#ifdef FLUENT_MT
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Never freed: Senders in other static objects may still be returning
+ * chunks as the process exits. */
+static std::vector<char *>& pool()
+{
+    static std::vector<char *> * chunks = new std::vector<char *>();
+    return *chunks;
+}
+
+char * fluent::ChunkList::take_chunk()
+{
+    char * chunk = nullptr;
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&pool_mutex);
+#endif
+    if( !pool().empty() ) {
+        chunk = pool().back();
+        pool().pop_back();
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&pool_mutex);
+#endif
+    return chunk ? chunk : new char[chunk_size];
+}
+
+void fluent::ChunkList::give_chunk(char * chunk)
+{
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&pool_mutex);
+#endif
+    bool kept = pool().size() < pool_max;
+    if( kept ) {
+        pool().push_back(chunk);
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&pool_mutex);
+#endif
+    if( !kept ) {
+        delete[] chunk;
+    }
+}
+
+fluent::ChunkList::~ChunkList()
+{
+    for( size_t i = 0; i < chunks.size(); ++i ) {
+        give_chunk(chunks[i].data);
+    }
+    release();
+}
+
+void fluent::ChunkList::write(const char * data, size_t length)
+{
+    while( length ) {
+        if( chunks.empty() || chunks.back().end == chunk_size ) {
+            Chunk chunk;
+            chunk.data = take_chunk();
+            chunk.begin = chunk.end = 0;
+            chunks.push_back(chunk);
+        }
+        Chunk& last = chunks.back();
+        size_t n = chunk_size - last.end;
+        if( n > length ) {
+            n = length;
+        }
+        memcpy(last.data + last.end, data, n);
+        last.end += n;
+        bytes += n;
+        data += n;
+        length -= n;
+    }
+}
+
+void fluent::ChunkList::gather(std::vector<struct iovec>& iov, size_t from, size_t to) const
+{
+    size_t offset = 0;
+    for( size_t i = 0; i < chunks.size() && offset < to; ++i ) {
+        const Chunk& chunk = chunks[i];
+        size_t length = chunk.end - chunk.begin;
+        if( offset + length > from ) {
+            size_t skip = from > offset ? from - offset : 0;
+            size_t stop = to - offset < length ? to - offset : length;
+            struct iovec v;
+            v.iov_base = chunk.data + chunk.begin + skip;
+            v.iov_len = stop - skip;
+            iov.push_back(v);
+        }
+        offset += length;
+    }
+}
+
+void fluent::ChunkList::drop(size_t n, bool pin, uint32_t seq)
+{
+    if( n > bytes ) {
+        n = bytes;
+    }
+    bytes -= n;
+    while( n ) {
+        Chunk& first = chunks.front();
+        size_t length = first.end - first.begin;
+        if( n < length ) {
+            first.begin += n;
+            return;
+        }
+        n -= length;
+        if( pin ) {
+            Pin p;
+            p.data = first.data;
+            p.seq = seq;
+            pinned.push_back(p);
+        }
+        else {
+            give_chunk(first.data);
+        }
+        chunks.pop_front();
+    }
+}
+
+void fluent::ChunkList::release(uint32_t done)
+{
+    /* pinned in send order; the counts wrap */
+    while( !pinned.empty() && static_cast<int32_t>(done - pinned.front().seq) >= 0 ) {
+        give_chunk(pinned.front().data);
+        pinned.pop_front();
+    }
+}
+
+void fluent::ChunkList::release()
+{
+    for( size_t i = 0; i < pinned.size(); ++i ) {
+        give_chunk(pinned[i].data);
+    }
+    pinned.clear();
+}
+
+void fluent::ChunkList::splice(ChunkList& other)
+{
+    chunks.insert(chunks.end(), other.chunks.begin(), other.chunks.end());
+    bytes += other.bytes;
+    other.chunks.clear();
+    other.bytes = 0;
+}
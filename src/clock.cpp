@@ -0,0 +1,112 @@
+#include <errno.h>
+
+#ifdef FLUENT_MT
+#include <pthread.h>
+#endif
+
+#include "clock.h"
+#include "socket.h"
+
+#ifdef FLUENT_MT
+std::atomic<uint64_t> fluent::Clock::cached(0);
+
+/* The ticker is shared by every CACHED clock in the process and only
+ * runs while at least one exists. */
+static pthread_mutex_t ticker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t ticker_users = 0;
+static pthread_t ticker;
+static std::atomic<bool> ticker_running(false);
+
+static uint64_t to_bits(const fluent::EventTime& t)
+{
+    return (static_cast<uint64_t>(t.sec) << 32) | t.nsec;
+}
+#endif
+
+fluent::Clock::Clock(source_t s)
+    : source(PRECISE)
+{
+    set_source(s);
+}
+
+fluent::Clock::~Clock()
+{
+#ifdef FLUENT_MT
+    if( source == CACHED ) {
+        release_ticker();
+    }
+#endif
+}
+
+void fluent::Clock::set_source(source_t s)
+{
+    if( s == source ) {
+        return;
+    }
+#ifdef FLUENT_MT
+    if( s == CACHED ) {
+        acquire_ticker();
+    }
+    else if( source == CACHED ) {
+        release_ticker();
+    }
+#endif
+    source = s;
+}
+
+fluent::EventTime fluent::Clock::read(source_t s)
+{
+    clockid_t id = CLOCK_REALTIME;
+#ifdef CLOCK_REALTIME_COARSE
+    if( s != PRECISE ) {
+        id = CLOCK_REALTIME_COARSE;
+    }
+#else
+    (void)s;
+#endif
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return EventTime(static_cast<uint32_t>(ts.tv_sec), static_cast<uint32_t>(ts.tv_nsec));
+}
+
+#ifdef FLUENT_MT
+void * fluent::Clock::ticker_main(void *)
+{
+    struct timespec tick;
+    tick.tv_sec = 0;
+    tick.tv_nsec = tick_usec * 1000;
+    while( ticker_running.load(std::memory_order_relaxed) ) {
+        cached.store(to_bits(read(PRECISE)), std::memory_order_relaxed);
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+void fluent::Clock::acquire_ticker()
+{
+    pthread_mutex_lock(&ticker_mutex);
+    if( ticker_users == 0 ) {
+        /* valid before the first tick */
+        cached.store(to_bits(read(PRECISE)), std::memory_order_relaxed);
+        ticker_running.store(true);
+        int retval = pthread_create(&ticker, NULL, &Clock::ticker_main, NULL);
+        if( retval != 0 ) {
+            ticker_running.store(false);
+            pthread_mutex_unlock(&ticker_mutex);
+            throw NoResources(retval);
+        }
+    }
+    ++ticker_users;
+    pthread_mutex_unlock(&ticker_mutex);
+}
+
+void fluent::Clock::release_ticker()
+{
+    pthread_mutex_lock(&ticker_mutex);
+    if( --ticker_users == 0 ) {
+        ticker_running.store(false);
+        pthread_join(ticker, NULL);
+    }
+    pthread_mutex_unlock(&ticker_mutex);
+}
+#endif
@@ -0,0 +1,251 @@
+#include <string.h>
+#include <time.h>
+
+#include <msgpack.hpp>
+
+#include "dedup.h"
+#include "per_thread.h"
+#include "socket.h"
+
+/* FNV-1a, continued from hash. */
+static uint64_t fnv(uint64_t hash, const char * data, size_t length)
+{
+    for( size_t i = 0; i < length; ++i ) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static size_t round_up(size_t n)
+{
+    size_t r = 1;
+    while( r < n ) {
+        r <<= 1;
+    }
+    return r;
+}
+
+fluent::Dedup::Table::Table(size_t size)
+    : slots(size), cursor(0)
+#ifdef FLUENT_MT
+        , mutex()
+#endif
+{
+#ifdef FLUENT_MT
+    int retval = pthread_mutex_init(&mutex, NULL);
+    if( retval != 0 ) {
+        throw NoResources(retval);
+    }
+#endif
+}
+
+fluent::Dedup::Table::~Table()
+{
+#ifdef FLUENT_MT
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+fluent::Dedup::Dedup()
+    : window(0), table_size(64), id(PerThread<Table>::next_id()), tables()
+#ifdef FLUENT_MT
+        , tables_mutex()
+#endif
+{
+#ifdef FLUENT_MT
+    int retval = pthread_mutex_init(&tables_mutex, NULL);
+    if( retval != 0 ) {
+        throw NoResources(retval);
+    }
+#endif
+}
+
+fluent::Dedup::~Dedup()
+{
+    for( size_t i = 0; i < tables.size(); ++i ) {
+        delete tables[i];
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_destroy(&tables_mutex);
+#endif
+}
+
+void fluent::Dedup::set_window(double seconds, size_t slots)
+{
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&tables_mutex);
+#endif
+    table_size = round_up(slots ? slots : 1);
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&tables_mutex);
+#endif
+    window.store(static_cast<int64_t>(seconds * 1e9), std::memory_order_relaxed);
+}
+
+fluent::Dedup::Table * fluent::Dedup::local()
+{
+    Table * table = PerThread<Table>::find(id);
+    if( table ) {
+        return table;
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&tables_mutex);
+#endif
+    table = new Table(table_size);
+    tables.push_back(table);
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&tables_mutex);
+#endif
+    PerThread<Table>::add(id, table);
+    return table;
+}
+
+bool fluent::Dedup::check(const char * data, size_t size, size_t tag_end, size_t map_start,
+        std::vector<std::string>& summaries)
+{
+    int64_t span = window.load(std::memory_order_relaxed);
+    if( span <= 0 ) {
+        return true;
+    }
+    Table * table = local();
+    int64_t now = clock();
+    /* the tag starts after the one-byte array header */
+    const char * tag = data + 1;
+    size_t tag_size = tag_end - 1;
+    const char * map = data + map_start;
+    size_t map_size = size - map_start;
+    uint64_t hash = fnv(fnv(0xcbf29ce484222325ULL, tag, tag_size), map, map_size);
+
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&table->mutex);
+#endif
+    size_t mask = table->slots.size() - 1;
+    Slot& slot = table->slots[hash & mask];
+    bool repeat = slot.first && slot.hash == hash && now - slot.first < span
+        && slot.map_start == tag_size
+        && slot.record.size() == tag_size + map_size
+        && !memcmp(slot.record.data(), tag, tag_size)
+        && !memcmp(slot.record.data() + tag_size, map, map_size);
+    if( repeat ) {
+        ++slot.repeats;
+        slot.time.assign(data + tag_end, map_start - tag_end);
+    }
+    else {
+        if( slot.repeats ) {
+            summarize(slot, summaries);
+        }
+        slot.hash = hash;
+        slot.first = now;
+        slot.repeats = 0;
+        slot.record.assign(tag, tag_size);
+        slot.record.append(map, map_size);
+        slot.map_start = tag_size;
+        slot.time.clear();
+    }
+
+    /* one slot per call is checked for a run that is over, so the
+     * summary of a storm that stopped still goes out */
+    Slot& other = table->slots[table->cursor];
+    table->cursor = (table->cursor + 1) & mask;
+    if( other.repeats && now - other.first >= span ) {
+        summarize(other, summaries);
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&table->mutex);
+#endif
+    return !repeat;
+}
+
+void fluent::Dedup::flush(std::vector<std::string>& summaries)
+{
+    sweep(summaries, 0);
+}
+
+int64_t fluent::Dedup::expire(std::vector<std::string>& summaries)
+{
+    int64_t span = window.load(std::memory_order_relaxed);
+    if( span <= 0 ) {
+        return 0;
+    }
+    int64_t now = clock();
+    int64_t open = sweep(summaries, now - span);
+    return (open ? open : now) + span;
+}
+
+int64_t fluent::Dedup::sweep(std::vector<std::string>& summaries, int64_t opened_by)
+{
+    int64_t first_open = 0;
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&tables_mutex);
+#endif
+    std::vector<Table *> current(tables);
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&tables_mutex);
+#endif
+    for( size_t i = 0; i < current.size(); ++i ) {
+#ifdef FLUENT_MT
+        pthread_mutex_lock(&current[i]->mutex);
+#endif
+        std::vector<Slot>& slots = current[i]->slots;
+        for( size_t j = 0; j < slots.size(); ++j ) {
+            if( opened_by && slots[j].first > opened_by ) {
+                if( !first_open || slots[j].first < first_open ) {
+                    first_open = slots[j].first;
+                }
+                continue;
+            }
+            if( slots[j].repeats ) {
+                summarize(slots[j], summaries);
+            }
+            slots[j].first = 0;
+        }
+#ifdef FLUENT_MT
+        pthread_mutex_unlock(&current[i]->mutex);
+#endif
+    }
+    return first_open;
+}
+
+void fluent::Dedup::summarize(Slot& slot, std::vector<std::string>& summaries)
+{
+    const unsigned char * map = reinterpret_cast<const unsigned char *>(slot.record.data() + slot.map_start);
+    uint32_t fields;
+    size_t header;
+    if( (map[0] & 0xf0) == 0x80 ) {
+        fields = map[0] & 0x0f;
+        header = 1;
+    }
+    else if( map[0] == 0xde ) {
+        fields = (map[1] << 8) | map[2];
+        header = 3;
+    }
+    else {
+        fields = (static_cast<uint32_t>(map[1]) << 24) | (map[2] << 16) | (map[3] << 8) | map[4];
+        header = 5;
+    }
+
+    ::msgpack::sbuffer sbuf(slot.record.size() + slot.time.size() + 32);
+    ::msgpack::packer< ::msgpack::sbuffer> packer(sbuf);
+    packer.pack_array(3);
+    sbuf.write(slot.record.data(), slot.map_start);
+    sbuf.write(slot.time.data(), slot.time.size());
+    packer.pack_map(fields + 1);
+    sbuf.write(slot.record.data() + slot.map_start + header, slot.record.size() - slot.map_start - header);
+    static const char key[] = "repeat_count";
+    packer.pack_str(sizeof(key) - 1);
+    packer.pack_str_body(key, sizeof(key) - 1);
+    packer.pack(slot.repeats);
+    summaries.push_back(std::string(sbuf.data(), sbuf.size()));
+
+    slot.repeats = 0;
+    /* the next one starts a new run */
+    slot.first = 0;
+}
+
+int64_t fluent::Dedup::clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
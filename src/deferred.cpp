@@ -0,0 +1,213 @@
+#include <time.h>
+
+#include <stdexcept>
+
+#include "deferred.h"
+#include "fluent_cpp.h"
+#include "per_thread.h"
+
+static size_t round_up(size_t n)
+{
+    size_t r = 4096;
+    while( r < n ) {
+        r <<= 1;
+    }
+    return r;
+}
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~static_cast<size_t>(7);
+}
+
+fluent::deferred::Ring::Ring(size_t capacity)
+    : data(nullptr), mask(round_up(capacity) - 1), pad0(), head(0), reserved(0), pad1(), tail(0)
+{
+    data = new char[mask + 1];
+}
+
+fluent::deferred::Ring::~Ring()
+{
+    delete [] data;
+}
+
+fluent::deferred::Ring::Header * fluent::deferred::Ring::reserve(size_t length)
+{
+    size_t capacity = mask + 1;
+    size_t need = align8(sizeof(Header) + length);
+    if( need > capacity / 2 ) {
+        return nullptr;
+    }
+    size_t pos = head.load(std::memory_order_relaxed);
+    /* a record never wraps; the rest of the ring is padded instead */
+    size_t to_end = capacity - (pos & mask);
+    size_t padding = need > to_end ? to_end : 0;
+    if( pos + padding + need - tail.load(std::memory_order_acquire) > capacity ) {
+        return nullptr;
+    }
+    if( padding ) {
+        /* records are 8-byte aligned, so there is room for these two */
+        Header * pad = reinterpret_cast<Header *>(data + (pos & mask));
+        pad->length = padding;
+        pad->flags = PADDING;
+        pos += padding;
+    }
+    reserved = padding + need;
+    Header * record = reinterpret_cast<Header *>(data + (pos & mask));
+    record->length = need;
+    record->flags = 0;
+    return record;
+}
+
+void fluent::deferred::Ring::commit(Header *)
+{
+    head.store(head.load(std::memory_order_relaxed) + reserved, std::memory_order_release);
+}
+
+fluent::DeferredLogger::DeferredLogger(const std::string& t, Sender& s, size_t r)
+    : prefix(t), tags(), clock(), event_time(false), threshold(), sender(s), ring_size(r),
+        id(PerThread<deferred::Ring>::next_id()), rings(), draining(), dropped(0)
+#ifdef FLUENT_MT
+        , rings_mutex(), thread(), running(false)
+#endif
+{
+#ifdef FLUENT_MT
+    int retval = pthread_mutex_init(&rings_mutex, NULL);
+    if( retval != 0 ) {
+        throw NoResources(retval);
+    }
+#endif
+}
+
+fluent::DeferredLogger::~DeferredLogger()
+{
+#ifdef FLUENT_MT
+    stop();
+#endif
+    drain();
+    for( size_t i = 0; i < rings.size(); ++i ) {
+        delete rings[i];
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_destroy(&rings_mutex);
+#endif
+}
+
+fluent::deferred::Ring * fluent::DeferredLogger::local()
+{
+    deferred::Ring * ring = PerThread<deferred::Ring>::find(id);
+    if( ring ) {
+        return ring;
+    }
+    ring = new deferred::Ring(ring_size);
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&rings_mutex);
+#endif
+    rings.push_back(ring);
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&rings_mutex);
+#endif
+    PerThread<deferred::Ring>::add(id, ring);
+    return ring;
+}
+
+size_t fluent::DeferredLogger::drain()
+{
+#ifdef FLUENT_MT
+    if( running.load() ) {
+        throw ::std::logic_error("DeferredLogger::drain() while the flusher runs");
+    }
+#endif
+    return drain_rings();
+}
+
+size_t fluent::DeferredLogger::drain_rings()
+{
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&rings_mutex);
+#endif
+    draining = rings;
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&rings_mutex);
+#endif
+    PackBuffer& scratch = PackBuffer::local();
+    size_t count = 0;
+    for( size_t i = 0; i < draining.size(); ++i ) {
+        count += drain(*draining[i], scratch.get());
+    }
+    scratch.trim();
+    return count;
+}
+
+size_t fluent::DeferredLogger::drain(deferred::Ring& ring, ::msgpack::sbuffer& sbuf)
+{
+    size_t count = 0;
+    size_t pos = ring.tail.load(std::memory_order_relaxed);
+    size_t end = ring.head.load(std::memory_order_acquire);
+    while( pos != end ) {
+        const deferred::Ring::Header * record =
+            reinterpret_cast<const deferred::Ring::Header *>(ring.data + (pos & ring.mask));
+        size_t length = record->length;
+        if( !(record->flags & deferred::Ring::PADDING) ) {
+            sbuf.clear();
+            deferred::Packer packer(sbuf);
+            packer.pack_array(3);
+            sbuf.write(record->tag->packed.data(), record->tag->packed.size());
+            if( event_time ) {
+                record->time.pack(packer);
+            }
+            else {
+                packer.pack(record->time.sec);
+            }
+            record->site->replay(*record->site, reinterpret_cast<const char *>(record + 1), sbuf);
+            ++count;
+            try {
+                sender.emit(sbuf);
+            }
+            catch(::std::runtime_error&) {
+                /* the Sender kept it in its backlog */
+            }
+        }
+        pos += length;
+        ring.tail.store(pos, std::memory_order_release);
+    }
+    return count;
+}
+
+#ifdef FLUENT_MT
+void fluent::DeferredLogger::start()
+{
+    if( running.load() ) {
+        return;
+    }
+    running.store(true);
+    int retval = pthread_create(&thread, NULL, &DeferredLogger::flusher_main, this);
+    if( retval != 0 ) {
+        running.store(false);
+        throw NoResources(retval);
+    }
+}
+
+void fluent::DeferredLogger::stop()
+{
+    if( !running.exchange(false) ) {
+        return;
+    }
+    pthread_join(thread, NULL);
+    drain();
+}
+
+void * fluent::DeferredLogger::flusher_main(void * self)
+{
+    DeferredLogger * logger = static_cast<DeferredLogger *>(self);
+    struct timespec idle;
+    idle.tv_sec = 0;
+    idle.tv_nsec = idle_usec * 1000;
+    while( logger->running.load(std::memory_order_relaxed) ) {
+        if( !logger->drain_rings() ) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+#endif
@@ -0,0 +1,155 @@
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "endpoint.h"
+
+static unsigned jitter_seed()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<unsigned>(ts.tv_nsec ^ (ts.tv_sec << 20) ^ (getpid() << 8));
+}
+
+fluent::EndpointSet::EndpointSet()
+    : endpoints(), policy(ROUND_ROBIN), backoff_initial(0.5), backoff_max(30.0), jitter(jitter_seed()),
+        load()
+{ }
+
+fluent::EndpointSet::~EndpointSet()
+{
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        delete endpoints[i];
+    }
+}
+
+size_t fluent::EndpointSet::add(const std::string& host, int port, int weight)
+{
+    endpoints.push_back(new Endpoint(host, port, weight));
+    return endpoints.size() - 1;
+}
+
+size_t fluent::EndpointSet::candidates(double now, std::vector<size_t>& out)
+{
+    out.clear();
+    int total = 0;
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        if( endpoints[i]->down_until <= now ) {
+            out.push_back(i);
+            endpoints[i]->current_weight += endpoints[i]->weight;
+            total += endpoints[i]->weight;
+        }
+    }
+    size_t healthy = out.size();
+
+    if( healthy ) {
+        /* the least loaded per unit of weight, ties going to the highest
+         * current weight; with equal loads that is plain smooth weighted
+         * round-robin */
+        bool measure = policy == LEAST_OUTSTANDING;
+        load.assign(healthy, std::make_pair(-1L, 1L));
+        std::pair<long, long> busiest(0, 1);
+        for( size_t k = 0; measure && k < healthy; ++k ) {
+            Socket& sock = *endpoints[out[k]]->sock;
+            if( !sock ) {
+                continue;
+            }
+            long outstanding = sock.outstanding();
+            if( outstanding < 0 ) {
+                measure = false;
+                break;
+            }
+            load[k] = std::make_pair(outstanding, static_cast<long>(endpoints[out[k]]->weight));
+            if( outstanding * busiest.second > busiest.first * load[k].second ) {
+                busiest = load[k];
+            }
+        }
+        for( size_t k = 0; measure && k < healthy; ++k ) {
+            if( load[k].first < 0 ) {
+                load[k] = busiest;
+            }
+        }
+        size_t best = 0;
+        for( size_t k = 1; k < healthy; ++k ) {
+            const Endpoint& e = *endpoints[out[k]];
+            const Endpoint& b = *endpoints[out[best]];
+            if( measure ) {
+                long lhs = load[k].first * load[best].second;
+                long rhs = load[best].first * load[k].second;
+                if( lhs != rhs ) {
+                    if( lhs < rhs ) {
+                        best = k;
+                    }
+                    continue;
+                }
+            }
+            if( e.current_weight > b.current_weight ) {
+                best = k;
+            }
+        }
+        endpoints[out[best]]->current_weight -= total;
+        /* the pick, then the rest in order after it */
+        std::rotate(out.begin(), out.begin() + best, out.end());
+    }
+
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        if( endpoints[i]->down_until > now ) {
+            out.push_back(i);
+        }
+    }
+    std::sort(out.begin() + healthy, out.end(), [this](size_t a, size_t b) {
+        return endpoints[a]->down_until < endpoints[b]->down_until;
+    });
+    return healthy;
+}
+
+void fluent::EndpointSet::failed(size_t i, double now)
+{
+    Endpoint& e = *endpoints[i];
+    try {
+        e.sock->close();
+    }
+    catch(::std::runtime_error&) {
+        /* the descriptor is gone either way */
+    }
+    double wait = backoff_initial;
+    for( unsigned n = 0; n < e.failures && wait < backoff_max; ++n ) {
+        wait *= 2;
+    }
+    if( wait > backoff_max ) {
+        wait = backoff_max;
+    }
+    ++e.failures;
+    std::uniform_real_distribution<double> upper_half(wait / 2, wait);
+    e.down_until = now + upper_half(jitter);
+    e.current_weight = 0;
+}
+
+void fluent::EndpointSet::retry_now()
+{
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        endpoints[i]->down_until = 0;
+    }
+}
+
+bool fluent::EndpointSet::available(double now) const
+{
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        if( endpoints[i]->down_until <= now ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double fluent::EndpointSet::next_retry() const
+{
+    double next = 0;
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        if( !i || endpoints[i]->down_until < next ) {
+            next = endpoints[i]->down_until;
+        }
+    }
+    return next;
+}
@@ -0,0 +1,309 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "event_loop.h"
+#include "socket.h"
+
+#ifdef __linux__
+static uint32_t epoll_events(unsigned events)
+{
+    uint32_t ev = 0;
+    if( events & fluent::EventLoop::READABLE ) {
+        ev |= EPOLLIN;
+    }
+    if( events & fluent::EventLoop::WRITABLE ) {
+        ev |= EPOLLOUT;
+    }
+    return ev;
+}
+#endif
+
+fluent::EventLoop::EventLoop()
+    : pollfd(-1), wake_read(-1), wake_write(-1), thread(), mutex(),
+        running(false), sleeping(false), handlers(), watches(), ready()
+{
+#ifdef __linux__
+    pollfd = epoll_create1(EPOLL_CLOEXEC);
+    if( pollfd < 0 ) {
+        throw ErrnoException(errno, "Could not create the epoll instance");
+    }
+    wake_read = wake_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( wake_read < 0 ) {
+        int err = errno;
+        ::close(pollfd);
+        throw ErrnoException(err, "Could not create the wakeup eventfd");
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_read;
+    epoll_ctl(pollfd, EPOLL_CTL_ADD, wake_read, &ev);
+#else
+    int fds[2];
+    if( pipe(fds) < 0 ) {
+        throw ErrnoException(errno, "Could not create the wakeup pipe");
+    }
+    wake_read = fds[0];
+    wake_write = fds[1];
+    fcntl(wake_read, F_SETFL, O_NONBLOCK);
+    fcntl(wake_write, F_SETFL, O_NONBLOCK);
+#endif
+    pthread_mutex_init(&mutex, NULL);
+}
+
+fluent::EventLoop::~EventLoop()
+{
+    stop();
+    pthread_mutex_destroy(&mutex);
+    if( wake_write != wake_read ) {
+        ::close(wake_write);
+    }
+    ::close(wake_read);
+    if( pollfd >= 0 ) {
+        ::close(pollfd);
+    }
+}
+
+double fluent::EventLoop::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fluent::EventLoop::start()
+{
+    if( running.load() ) {
+        return;
+    }
+    running.store(true);
+    int retval = pthread_create(&thread, NULL, &EventLoop::loop_main, this);
+    if( retval != 0 ) {
+        running.store(false);
+        throw NoResources(retval);
+    }
+}
+
+void fluent::EventLoop::stop()
+{
+    if( !running.exchange(false) ) {
+        return;
+    }
+    wake();
+    pthread_join(thread, NULL);
+}
+
+void fluent::EventLoop::add(Handler * handler)
+{
+    pthread_mutex_lock(&mutex);
+    handlers.push_back(handler);
+    pthread_mutex_unlock(&mutex);
+    wake();
+}
+
+void fluent::EventLoop::remove(Handler * handler)
+{
+    pthread_mutex_lock(&mutex);
+    handlers.erase(std::remove(handlers.begin(), handlers.end(), handler), handlers.end());
+    for( size_t i = 0; i < watches.size(); ) {
+        if( watches[i].handler == handler ) {
+            unwatch(watches[i].fd);
+        }
+        else {
+            ++i;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void fluent::EventLoop::watch(Handler * handler, int fd, unsigned events)
+{
+    for( size_t i = 0; i < watches.size(); ++i ) {
+        if( watches[i].fd == fd ) {
+            if( watches[i].handler == handler && watches[i].events == events ) {
+                return;
+            }
+            watches[i].handler = handler;
+            watches[i].events = events;
+#ifdef __linux__
+            struct epoll_event ev;
+            ev.events = epoll_events(events);
+            ev.data.fd = fd;
+            /* a closed and reopened descriptor silently left the set */
+            if( epoll_ctl(pollfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT ) {
+                epoll_ctl(pollfd, EPOLL_CTL_ADD, fd, &ev);
+            }
+#endif
+            return;
+        }
+    }
+    Watch w;
+    w.fd = fd;
+    w.handler = handler;
+    w.events = events;
+    watches.push_back(w);
+#ifdef __linux__
+    struct epoll_event ev;
+    ev.events = epoll_events(events);
+    ev.data.fd = fd;
+    if( epoll_ctl(pollfd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+        if( errno == EEXIST ) {
+            epoll_ctl(pollfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+        else {
+            watches.pop_back();
+            throw ErrnoException(errno, "Could not add a descriptor to the epoll set");
+        }
+    }
+#endif
+}
+
+void fluent::EventLoop::unwatch(int fd)
+{
+    for( size_t i = 0; i < watches.size(); ++i ) {
+        if( watches[i].fd == fd ) {
+            watches.erase(watches.begin() + i);
+#ifdef __linux__
+            /* fails harmlessly if the descriptor is already closed */
+            epoll_ctl(pollfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+            return;
+        }
+    }
+}
+
+void fluent::EventLoop::wake()
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t retval = ::write(wake_write, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t retval = ::write(wake_write, &one, sizeof(one));
+#endif
+    (void)retval; /* a full pipe / counter still wakes the loop */
+}
+
+void * fluent::EventLoop::loop_main(void * self)
+{
+    static_cast<EventLoop *>(self)->run();
+    return NULL;
+}
+
+void fluent::EventLoop::run()
+{
+    while( running.load(std::memory_order_acquire) ) {
+        int timeout_ms = -1;
+        pthread_mutex_lock(&mutex);
+        double now = EventLoop::now();
+        sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for( size_t i = 0; i < handlers.size(); ++i ) {
+            Handler * h = handlers[i];
+            int ms = -1;
+            if( h->busy() ) {
+                ms = 0;
+            }
+            else if( h->deadline > 0 ) {
+                double left = h->deadline - now;
+                ms = left > 0 ? static_cast<int>(left * 1000) + 1 : 0;
+            }
+            if( ms >= 0 && (timeout_ms < 0 || ms < timeout_ms) ) {
+                timeout_ms = ms;
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+
+        wait(timeout_ms);
+        sleeping.store(false);
+
+        pthread_mutex_lock(&mutex);
+        now = EventLoop::now();
+        for( size_t i = 0; i < ready.size(); ++i ) {
+            /* the handler may have unwatched the fd earlier in this pass */
+            for( size_t j = 0; j < watches.size(); ++j ) {
+                if( watches[j].fd == ready[i].fd ) {
+                    try {
+                        watches[j].handler->on_io(ready[i].fd, ready[i].events, now);
+                    }
+                    catch(::std::exception& e) {
+                        ::std::cerr << "fluent::EventLoop: handler failed with " << e.what() << "\n";
+                    }
+                    break;
+                }
+            }
+        }
+        for( size_t i = 0; i < handlers.size(); ++i ) {
+            try {
+                handlers[i]->on_tick(now);
+            }
+            catch(::std::exception& e) {
+                ::std::cerr << "fluent::EventLoop: handler failed with " << e.what() << "\n";
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+void fluent::EventLoop::wait(int timeout_ms)
+{
+    ready.clear();
+#ifdef __linux__
+    struct epoll_event events[64];
+    int n = epoll_wait(pollfd, events, 64, timeout_ms);
+    for( int i = 0; i < n; ++i ) {
+        if( events[i].data.fd == wake_read ) {
+            uint64_t count;
+            ssize_t retval = ::read(wake_read, &count, sizeof(count));
+            (void)retval;
+            continue;
+        }
+        Watch w;
+        w.fd = events[i].data.fd;
+        w.handler = nullptr;
+        w.events = ((events[i].events & EPOLLIN) ? READABLE : 0) |
+            ((events[i].events & EPOLLOUT) ? WRITABLE : 0) |
+            ((events[i].events & (EPOLLERR | EPOLLHUP)) ? ERROR : 0);
+        ready.push_back(w);
+    }
+#else
+    std::vector<struct pollfd> fds(watches.size() + 1);
+    fds[0].fd = wake_read;
+    fds[0].events = POLLIN;
+    for( size_t i = 0; i < watches.size(); ++i ) {
+        fds[i + 1].fd = watches[i].fd;
+        fds[i + 1].events = ((watches[i].events & READABLE) ? POLLIN : 0) |
+            ((watches[i].events & WRITABLE) ? POLLOUT : 0);
+    }
+    int n = poll(&fds[0], fds.size(), timeout_ms);
+    if( n > 0 && (fds[0].revents & POLLIN) ) {
+        char drain[64];
+        while( ::read(wake_read, drain, sizeof(drain)) > 0 ) {
+        }
+    }
+    for( size_t i = 1; n > 0 && i < fds.size(); ++i ) {
+        if( !fds[i].revents ) {
+            continue;
+        }
+        Watch w;
+        w.fd = fds[i].fd;
+        w.handler = nullptr;
+        w.events = ((fds[i].revents & POLLIN) ? READABLE : 0) |
+            ((fds[i].revents & POLLOUT) ? WRITABLE : 0) |
+            ((fds[i].revents & (POLLERR | POLLHUP)) ? ERROR : 0);
+        ready.push_back(w);
+    }
+#endif
+}
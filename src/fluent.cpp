@@ -4,11 +4,45 @@
 
 #include "fluent_cpp.h"
 
+/* Bytes held in backlogs by every Sender, and the cap on them (0: none). */
+#ifdef FLUENT_MT
+static std::atomic<size_t> backlog_total(0);
+static std::atomic<size_t> memory_ceiling(0);
+
+/* only async output checks the ceiling before taking more on */
+static bool under_ceiling()
+{
+    size_t cap = memory_ceiling;
+    return !cap || backlog_total < cap;
+}
+#else
+static size_t backlog_total = 0;
+static size_t memory_ceiling = 0;
+#endif
+
+static size_t total_length(const ::std::vector<struct iovec>& iov)
+{
+    size_t length = 0;
+    for( size_t i = 0; i < iov.size(); ++i ) {
+        length += iov[i].iov_len;
+    }
+    return length;
+}
+
 fluent::Sender::Sender(
                 const std::string& h, int p,
                 size_t b, float _timeout, bool v)
-    :  host(h), port(p), bufmax(b), timeout(_timeout), verbose(v),
-        buf(nullptr), sock(Socket::INET, Socket::STREAM)
+    :  bufmax(b), timeout(_timeout), connect_timeout(-1), verbose(v),
+        buf(), backlog_units(), charged(0), overflow(DROP_BACKLOG), block_timeout(1.0),
+        sample_every(10), sampled(0), on_drop(nullptr), on_drop_arg(nullptr),
+        on_error(nullptr), on_error_arg(nullptr), failures(0),
+        endpoints(), current(0), sock(nullptr), order(), spool(nullptr),
+        batcher(nullptr), flush_events(0), flush_linger(0), chunks(), sending()
+#ifdef FLUENT_MT
+        , mutex(), blocked(false), unblocked(), queue(nullptr), loop(nullptr), own_loop(nullptr), dropped(0),
+        flush_requested(false), state(DISCONNECTED), watched_fd(-1), retry_at(0),
+        connect_deadline(0), out_offset(0), unit_start(0), unit_ends(), replaying(false), acks(nullptr), message(), message_ends()
+#endif
 {
 #ifdef FLUENT_MT
     int retval = pthread_mutex_init(&mutex, NULL);
@@ -29,18 +63,59 @@ fluent::Sender::Sender(
         default:
             throw UnknownError(retval);
     }
-#endif
-    try {
-        reconnect();
-    }
-    catch(...) {
-        close();
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    /* timed waits are against monotonic() */
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    retval = pthread_cond_init(&unblocked, &attr);
+    pthread_condattr_destroy(&attr);
+    if( retval != 0 ) {
+        pthread_mutex_destroy(&mutex);
+        throw NoResources(retval);
     }
+#endif
+    current = endpoints.add(h, p);
+    sock = endpoints[current].sock;
+    /* the first connect blocks, so records logged right away go out */
+    reconnect(true);
 }
 
 fluent::Sender::~Sender()
 {
 #ifdef FLUENT_MT
+    stop_async();
+    if( acks ) {
+        delete acks;
+    }
+#endif
+    if( batcher ) {
+        try {
+            flush();
+        }
+        catch(::std::runtime_error&) {
+            /* nobody left to report this to */
+        }
+        delete batcher;
+    }
+#ifdef FLUENT_MT
+    /* a BLOCK wait below lets go of it */
+    pthread_mutex_lock(&mutex);
+#endif
+    if( !buf.empty() ) {
+        /* last chance for the backlog, backoff or not */
+        endpoints.retry_now();
+        if( reconnect(true) ) {
+            try {
+                send_internal(nullptr, 0);
+            }
+            catch(::std::runtime_error&) {
+                /* kept in buf, and spooled below if there is a spool */
+            }
+        }
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&mutex);
+    pthread_cond_destroy(&unblocked);
     int retval = pthread_mutex_destroy(&mutex);
     switch(retval) {
         case 0:
@@ -64,71 +139,1162 @@ fluent::Sender::~Sender()
             std::cerr << "The fluent::Sender (0x" << std::hex << this << std::dec << ") is being destroyed and got an unrecognized error (" << retval << ") attempting to destroy its mutex.\n";
     }
 #endif
+    if( spool ) {
+        if( !buf.empty() ) {
+            /* can't go back in front of what is already spooled, but
+             * late beats lost */
+            sending.clear();
+            buf.gather(sending);
+            spool_unit(&sending[0], sending.size());
+        }
+        delete spool;
+    }
+#ifdef FLUENT_MT
+    /* zerocopy sends still reading the backlog finish (or are reset)
+     * first */
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        endpoints[i].sock->close();
+    }
+    buf.release();
+#endif
+    buf.clear();
+    account();
 }
 
-void fluent::Sender::send(const ::msgpack::sbuffer& bytes)
+static double monotonic()
 {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fluent::Sender::set_batching(Batcher::mode_t mode, size_t max_bytes, float max_age)
+{
+    if( batcher ) {
+        flush();
+        delete batcher;
+    }
+    batcher = new Batcher(mode, max_bytes, max_age);
+    apply_flush_policy();
+}
+
+void fluent::Sender::set_flush_policy(size_t max_events, float linger)
+{
+    flush_events = max_events;
+    flush_linger = linger;
+    if( !batcher ) {
+        set_batching(Batcher::FORWARD);
+        return;
+    }
 #ifdef FLUENT_MT
-    /* TODO make this exception safe */
     pthread_mutex_lock(&mutex);
 #endif
-    send_internal(bytes);
+    apply_flush_policy();
 #ifdef FLUENT_MT
     pthread_mutex_unlock(&mutex);
 #endif
 }
 
-void fluent::Sender::send_internal(const ::msgpack::sbuffer& bytes)
+void fluent::Sender::apply_flush_policy()
 {
-    const ::msgpack::sbuffer * to_send = nullptr;
-    if( !buf )
-    {
-        to_send = &bytes;
+    batcher->set_max_events(flush_events);
+    batcher->set_linger(flush_linger);
+}
+
+bool fluent::Sender::set_socket_options(bool nodelay, bool cork, int send_buffer)
+{
+    bool applied = true;
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        Socket& s = *endpoints[i].sock;
+        applied = s.set_nodelay(nodelay) && applied;
+        applied = s.set_cork(cork) && applied;
+        if( send_buffer > 0 ) {
+            applied = s.set_send_buffer(send_buffer) && applied;
+        }
     }
-    else {
-        buf->write(bytes.data(), bytes.size());
-        to_send = buf;
+    return applied;
+}
+
+void fluent::Sender::add_endpoint(const std::string& h, int p, int weight)
+{
+    endpoints.add(h, p, weight);
+}
+
+void fluent::Sender::set_connect_timeout(float t)
+{
+    connect_timeout = t;
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        endpoints[i].sock->set_connect_timeout(t);
     }
+}
+
+bool fluent::Sender::set_zerocopy(size_t threshold)
+{
+    bool supported = true;
+    for( size_t i = 0; i < endpoints.size(); ++i ) {
+        supported = endpoints[i].sock->set_zerocopy(threshold) && supported;
+    }
+    return supported;
+}
+
+void fluent::Sender::set_spool(const std::string& dir, size_t segment_size, size_t max_segments)
+{
+    Spool * s = new Spool(dir, segment_size, max_segments);
+    if( spool ) {
+        delete spool;
+    }
+    spool = s;
+}
+
+void fluent::Sender::flush()
+{
+#ifdef FLUENT_MT
+    if( loop ) {
+        flush_requested.store(true);
+        loop->notify();
+        return;
+    }
+    pthread_mutex_lock(&mutex);
     try {
-        reconnect();
-        sock.send(to_send->data(), to_send->size());
-        /* TODO should I use release or clear here?
-         * release frees the memory in the sbuffer,
-         * clear just empties out the buffer. */
-        if( buf ) {
-            delete buf;
-        }
+        wait_unblocked(0);
+        flush_batch();
     }
-    catch(::std::runtime_error& e) {
-        ::std::cerr << "while sending, got exception " << e.what() << "\n";
-        close();
-        if( buf ) {
-            if(  buf->size() > bufmax ) {
-                /* buffer is already full, so drop everything */
-                /* python says put a callback here */
-                delete buf;
+    catch(...) {
+        pthread_mutex_unlock(&mutex);
+        throw;
+    }
+    pthread_mutex_unlock(&mutex);
+#else
+    flush_batch();
+#endif
+}
+
+void fluent::Sender::send(const char * data, size_t length)
+{
+    double deadline = 0;
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&mutex);
+    try {
+        if( acks ) {
+            /* only the loop reads acks: without it nothing would ever be
+             * acknowledged, or resent */
+            throw ::std::logic_error("require_ack() was called, but the Sender is not async: call start_async() or attach().");
+        }
+        if( blocked ) {
+            /* the time spent behind another thread's wait counts */
+            deadline = monotonic() + block_timeout;
+            if( !wait_unblocked(deadline) ) {
+                std::vector<struct iovec> lost(1);
+                lost[0].iov_base = const_cast<char *>(data);
+                lost[0].iov_len = length;
+                drop(lost);
+                pthread_mutex_unlock(&mutex);
+                return;
+            }
+        }
+#endif
+        if( batcher ) {
+            double now = monotonic();
+            batcher->add(data, length, now);
+            if( batcher->ready(now) ) {
+                flush_batch(deadline);
             }
         }
         else {
-            buf = new ::msgpack::sbuffer();
-            buf->write(bytes.data(), bytes.size());
+            send_internal(data, length, deadline);
         }
+#ifdef FLUENT_MT
+    }
+    catch(...) {
+        pthread_mutex_unlock(&mutex);
+        throw;
+    }
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void fluent::Sender::flush_batch(double deadline)
+{
+    if( !batcher || !batcher->size() ) {
+        return;
+    }
+    chunks.clear();
+    try {
+        batcher->gather(chunks);
+        send_internal(chunks, deadline);
+    }
+    catch(...) {
+        batcher->clear();
         throw;
     }
+    batcher->clear();
+}
+
+void fluent::Sender::send_internal(const char * data, size_t length, double deadline)
+{
+    chunks.clear();
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(data);
+    iov.iov_len = length;
+    chunks.push_back(iov);
+    send_internal(chunks, deadline);
+}
+
+void fluent::Sender::send_internal(const ::std::vector<struct iovec>& iov, double deadline)
+{
+    /* The backlog goes first, then anything spooled, then the new chunks.
+     * Without a spool that is one gathered write.  An endpoint that fails
+     * part way through hands all of it to the next one.  deadline is
+     * when BLOCK gives up, 0 for block_timeout from the first wait. */
+    for(;;) {
+        if( !reconnect(false) ) {
+            if( overflow == BLOCK && !fits(total_length(iov)) && wait_for_endpoint(deadline) ) {
+                continue;
+            }
+            /* every endpoint is connecting or backing off: keep it
+             * without waiting on the network */
+            keep_backlog(iov);
+            return;
+        }
+        try {
+            bool spooled = spool && !spool->empty();
+            sending.clear();
+            buf.gather(sending);
+            if( !spooled ) {
+                sending.insert(sending.end(), iov.begin(), iov.end());
+            }
+            if( !sending.empty() ) {
+                sock->sendv(&sending[0], sending.size());
+            }
+            if( !buf.empty() ) {
+                buf.clear();
+                backlog_units.clear();
+                account();
+            }
+            if( spooled ) {
+                replay_spool();
+                sending.assign(iov.begin(), iov.end());
+                if( !sending.empty() ) {
+                    sock->sendv(&sending[0], sending.size());
+                }
+            }
+            endpoints.succeeded(current);
+            return;
+        }
+        catch(::std::runtime_error& e) {
+            double now = monotonic();
+            endpoint_failed(current, e, now);
+            if( !endpoints.available(now) ) {
+                if( overflow == BLOCK && !fits(total_length(iov)) && wait_for_endpoint(deadline) ) {
+                    continue;
+                }
+                keep_backlog(iov);
+                throw;
+            }
+        }
+    }
+}
+
+void fluent::Sender::keep_backlog(const ::std::vector<struct iovec>& iov)
+{
+    size_t length = total_length(iov);
+    size_t backlog = buf.size();
+    if( spool && (!spool->empty() || backlog + length > bufmax) ) {
+        /* past bufmax: overflow to disk, behind what is already there */
+        if( backlog && spool->empty() ) {
+            sending.clear();
+            buf.gather(sending);
+            spool_unit(&sending[0], sending.size());
+            buf.clear();
+            backlog_units.clear();
+            account();
+        }
+        if( !iov.empty() ) {
+            spool_unit(&iov[0], iov.size());
+        }
+        return;
+    }
+    if( !length ) {
+        return;
+    }
+    if( backlog && backlog_units.empty() ) {
+        /* left over from async mode, as one unit */
+        backlog_units.push_back(backlog);
+    }
+    if( overflow == SAMPLE && backlog + length > bufmax / 2 && sampled++ % sample_every ) {
+        drop(iov);
+        return;
+    }
+    while( !admit(length) ) {
+        if( !buf.empty() && overflow == DROP_OLDEST ) {
+            size_t unit = backlog_units.front();
+            backlog_units.pop_front();
+            drop_backlog(unit);
+        }
+        else if( !buf.empty() && overflow == DROP_BACKLOG ) {
+            drop_backlog(buf.size());
+        }
+        else {
+            drop(iov);
+            return;
+        }
+    }
+    /* only a failed send pays for copying into the backlog */
+    buf.write(iov.data(), iov.size());
+    backlog_units.push_back(length);
+}
+
+bool fluent::Sender::fits(size_t length) const
+{
+    size_t backlog = buf.size();
+    size_t cap = memory_ceiling;
+    return backlog + length <= bufmax && (!cap || backlog_total + length <= cap);
+}
+
+/* Charges length more bytes of backlog to the ceiling, if they fit. */
+bool fluent::Sender::admit(size_t length)
+{
+    size_t backlog = buf.size();
+    if( backlog + length > bufmax ) {
+        return false;
+    }
+    size_t total = (backlog_total += length);
+    size_t cap = memory_ceiling;
+    if( cap && total > cap ) {
+        backlog_total -= length;
+        return false;
+    }
+    charged += length;
+    return true;
+}
+
+/* Brings the ceiling's count in line with what buf holds now. */
+void fluent::Sender::account()
+{
+    size_t held = buf.size();
+    if( held != charged ) {
+        backlog_total += held;
+        backlog_total -= charged;
+        charged = held;
+    }
+}
+
+void fluent::Sender::drop(const ::std::vector<struct iovec>& iov)
+{
+    if( on_drop && !iov.empty() ) {
+        on_drop(&iov[0], iov.size(), on_drop_arg);
+    }
+}
+
+/* Reports a failed send or connect and backs off from the endpoint. */
+void fluent::Sender::endpoint_failed(size_t i, const ::std::exception& e, double now)
+{
+    Endpoint& endpoint = endpoints[i];
+    ++failures;
+    if( on_error ) {
+        on_error(endpoint.name().c_str(), e.what(), on_error_arg);
+    }
+    else if( verbose || !endpoint.failures ) {
+        ::std::cerr << "while talking to " << endpoint.name() << ", got exception " << e.what() << "\n";
+    }
+    endpoints.failed(i, now);
+}
+
+/* Overflows count buffers to disk as one unit.  A unit the spool
+ * refuses (full, or the disk failed) is lost the way a record the full
+ * queue refuses is. */
+void fluent::Sender::spool_unit(const struct iovec * iov, size_t count)
+{
+    if( spool->append(iov, count) ) {
+        return;
+    }
+#ifdef FLUENT_MT
+    dropped.fetch_add(1, std::memory_order_relaxed);
+#endif
+    if( on_drop && count ) {
+        on_drop(iov, count, on_drop_arg);
+    }
+}
+
+/* Drops the first length bytes of the backlog. */
+void fluent::Sender::drop_backlog(size_t length)
+{
+    if( on_drop ) {
+        sending.clear();
+        buf.gather(sending, 0, length);
+        on_drop(&sending[0], sending.size(), on_drop_arg);
+    }
+    buf.consume(length);
+    if( buf.empty() ) {
+        backlog_units.clear();
+    }
+    account();
+}
+
+/* For BLOCK: sleeps a little towards an endpoint coming back and returns
+ * true, or returns false once deadline (set on the first call) passed. */
+bool fluent::Sender::wait_for_endpoint(double& deadline)
+{
+    double now = monotonic();
+    if( !deadline ) {
+        deadline = now + block_timeout;
+    }
+    if( now >= deadline ) {
+        return false;
+    }
+    /* background connects are checked on often; a backoff is waited out */
+    double wake = now + 0.01;
+    if( !endpoints.available(now) && endpoints.next_retry() > wake ) {
+        wake = endpoints.next_retry();
+    }
+    if( wake > deadline ) {
+        wake = deadline;
+    }
+    struct timespec pause;
+    pause.tv_sec = static_cast<time_t>(wake - now);
+    pause.tv_nsec = static_cast<long>((wake - now - pause.tv_sec) * 1e9);
+#ifdef FLUENT_MT
+    /* not holding everyone else up; sends that would touch what this one
+     * is using wait for it in wait_unblocked() instead */
+    blocked = true;
+    pthread_mutex_unlock(&mutex);
+#endif
+    nanosleep(&pause, NULL);
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&mutex);
+    blocked = false;
+    pthread_cond_broadcast(&unblocked);
+#endif
+    return true;
+}
+
+#ifdef FLUENT_MT
+/* Called holding mutex.  Waits until no send is waiting out BLOCK with
+ * the mutex let go; false if deadline came first.  A deadline of 0 waits
+ * as long as it takes. */
+bool fluent::Sender::wait_unblocked(double deadline)
+{
+    while( blocked ) {
+        if( !deadline ) {
+            pthread_cond_wait(&unblocked, &mutex);
+            continue;
+        }
+        struct timespec until;
+        until.tv_sec = static_cast<time_t>(deadline);
+        until.tv_nsec = static_cast<long>((deadline - until.tv_sec) * 1e9);
+        if( pthread_cond_timedwait(&unblocked, &mutex, &until) == ETIMEDOUT && blocked ) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+void fluent::Sender::set_overflow(overflow_t policy, float t, size_t n)
+{
+    overflow = policy;
+    block_timeout = t;
+    sample_every = n ? n : 1;
+}
+
+void fluent::Sender::set_memory_ceiling(size_t bytes)
+{
+    memory_ceiling = bytes;
+}
+
+/* Upper bound on how much of the spool is read back at once. */
+static const size_t SPOOL_READ_AHEAD = 256 * 1024;
+
+void fluent::Sender::replay_spool()
+{
+    while( !spool->empty() ) {
+        sending.clear();
+        size_t n = spool->peek(sending, SPOOL_READ_AHEAD);
+        if( !n ) {
+            break;
+        }
+        sock->sendv(&sending[0], sending.size());
+        spool->consume(n);
+    }
 }
 
-void fluent::Sender::reconnect()
+/* Makes sock a connection to the endpoint to send to next and returns
+ * true, or returns false if none is connected yet.  Unless wait is set,
+ * connects go on in the background and are checked on by later calls, so
+ * a send never waits for one. */
+bool fluent::Sender::reconnect(bool wait)
 {
-    if( !sock ) {
-        sock.settimeout(timeout);
-        sock.connect(host, port);
+    double now = monotonic();
+    size_t healthy = endpoints.candidates(now, order);
+    for( size_t k = 0; k < healthy; ++k ) {
+        Endpoint& endpoint = endpoints[order[k]];
+        try {
+            if( !*endpoint.sock ) {
+                if( wait && endpoint.sock->connecting() ) {
+                    /* see the connect under way through rather than drop
+                     * it for a new one; the peer has likely accepted it */
+                    while( !endpoint.sock->poll_connect(endpoint.connect_deadline - now) ) {
+                        now = monotonic();
+                        if( now >= endpoint.connect_deadline ) {
+                            endpoint.sock->close();
+                            throw Socket::TimedOut();
+                        }
+                    }
+                }
+                else if( wait ) {
+                    endpoint.sock->settimeout(timeout);
+                    endpoint.sock->connect(endpoint.host, endpoint.port);
+                }
+                else if( !endpoint.sock->connecting() ) {
+                    endpoint.sock->settimeout(timeout);
+                    if( !endpoint.sock->start_background_connect(endpoint.host, endpoint.port) ) {
+                        endpoint.connect_deadline = now + (connect_timeout >= 0 ? connect_timeout : timeout);
+                        continue;
+                    }
+                }
+                else if( !endpoint.sock->poll_connect() ) {
+                    if( now >= endpoint.connect_deadline ) {
+                        /* the next try starts a fresh connect */
+                        endpoint.sock->close();
+                        throw Socket::TimedOut();
+                    }
+                    continue;
+                }
+            }
+            current = order[k];
+            sock = endpoint.sock;
+            return true;
+        }
+        catch(::std::runtime_error& e) {
+            endpoint_failed(order[k], e, now);
+        }
     }
+    return false;
 }
 
 void fluent::Sender::close()
 {
-    if( sock ) {
-        sock.close();
+    if( *sock ) {
+        sock->close();
+    }
+}
+
+
+#ifdef FLUENT_MT
+/* Upper bound on how much one loop iteration drains from the queue. */
+static const size_t FLUSH_BATCH_MAX = 256 * 1024;
+
+void fluent::Sender::start_async(size_t capacity)
+{
+    if( queue ) {
+        return;
+    }
+    own_loop = new EventLoop();
+    try {
+        own_loop->start();
+        attach(*own_loop, capacity);
+    }
+    catch(...) {
+        delete own_loop;
+        own_loop = nullptr;
+        throw;
+    }
+}
+
+void fluent::Sender::attach(EventLoop& l, size_t capacity)
+{
+    if( queue ) {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    try {
+        wait_unblocked(0);
+        for( size_t i = 0; i < endpoints.size(); ++i ) {
+            if( endpoints[i].sock->connecting() ) {
+                /* the loop starts its own */
+                endpoints[i].sock->close();
+            }
+            endpoints[i].sock->set_nonblocking(true);
+        }
+    }
+    catch(...) {
+        pthread_mutex_unlock(&mutex);
+        throw;
+    }
+    if( acks ) {
+        if( !batcher ) {
+            batcher = new Batcher(Batcher::FORWARD, 64*1024, 1.0);
+            apply_flush_policy();
+        }
+        batcher->set_chunk_ids(true);
+    }
+    queue = new MPSCQueue<std::string>(capacity);
+    state = *sock ? CONNECTED : DISCONNECTED;
+    double now = monotonic();
+    retry_at = endpoints.available(now) ? 0 : endpoints.next_retry();
+    out_offset = unit_start = 0;
+    unit_ends.clear();
+    backlog_units.clear();
+    if( !buf.empty() ) {
+        /* the blocking backlog becomes the first unit */
+        unit_ends.push_back(buf.size());
+    }
+    loop = &l;
+    pthread_mutex_unlock(&mutex);
+    loop->add(this);
+}
+
+void fluent::Sender::require_ack(size_t window, float ack_timeout)
+{
+    AckWindow * a = new AckWindow(window, ack_timeout);
+    pthread_mutex_lock(&mutex);
+    if( queue ) {
+        /* the loop is reading the current one */
+        pthread_mutex_unlock(&mutex);
+        delete a;
+        throw ::std::logic_error("require_ack() must come before start_async() or attach().");
+    }
+    if( acks ) {
+        delete acks;
+    }
+    acks = a;
+    pthread_mutex_unlock(&mutex);
+}
+
+void fluent::Sender::stop_async()
+{
+    if( !queue ) {
+        return;
+    }
+    /* after this returns the loop never calls us again */
+    loop->remove(this);
+    if( own_loop ) {
+        delete own_loop;
+        own_loop = nullptr;
+    }
+    loop = nullptr;
+
+    /* Finish in blocking mode.  A connection that is still usable goes on
+     * from where it stopped; otherwise a new one starts at a unit boundary,
+     * sending whatever was not acknowledged first. */
+    pthread_mutex_lock(&mutex);
+    try {
+        for( size_t i = 0; i < endpoints.size(); ++i ) {
+            endpoints[i].sock->set_nonblocking(false);
+        }
+        if( state == CONNECTED && acks && !acks->empty() ) {
+            wait_for_acks(monotonic() + timeout);
+        }
+        bool resume = state == CONNECTED && !replaying && (!acks || acks->empty());
+        if( !resume ) {
+            sock->close();
+        }
+        reap();
+        if( replaying ) {
+            /* all of it is still in the spool */
+            discard(buf.size());
+            replaying = false;
+        }
+        compact(resume ? out_offset : unit_start);
+        out_offset = unit_start = 0;
+        requeue_unacked();
+        unit_ends.clear();
+        if( batcher ) {
+            /* nobody reads acks from here on */
+            batcher->set_chunk_ids(false);
+        }
+        double now = monotonic();
+        ::msgpack::sbuffer rest;
+        while( queue->try_pop([&](std::string& record) {
+                    if( batcher ) {
+                        batcher->add(record.data(), record.size(), now);
+                    }
+                    else {
+                        rest.write(record.data(), record.size());
+                    }
+                }) ) {
+        }
+        if( !buf.empty() || rest.size() || (spool && !spool->empty()) ) {
+            send_internal(rest.data(), rest.size());
+        }
+    }
+    catch(::std::runtime_error&) {
+        /* send_internal already kept what it could in buf */
+    }
+    account();
+    pthread_mutex_unlock(&mutex);
+    state = DISCONNECTED;
+    delete queue;
+    queue = nullptr;
+}
+
+bool fluent::Sender::enqueue(const char * data, size_t length)
+{
+    auto fill = [=](std::string& slot) {
+        slot.assign(data, length);
+    };
+    bool pushed = queue->try_push(fill);
+    if( !pushed && overflow == BLOCK ) {
+        /* wait for the loop to make room */
+        double deadline = monotonic() + block_timeout;
+        struct timespec pause;
+        pause.tv_sec = 0;
+        pause.tv_nsec = 1000 * 1000;
+        while( !pushed && monotonic() < deadline ) {
+            loop->notify();
+            nanosleep(&pause, NULL);
+            pushed = queue->try_push(fill);
+        }
+    }
+    if( !pushed ) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        if( on_drop ) {
+            struct iovec lost;
+            lost.iov_base = const_cast<char *>(data);
+            lost.iov_len = length;
+            on_drop(&lost, 1, on_drop_arg);
+        }
+        return false;
+    }
+    /* Pairs with the fence in EventLoop::run(): either the loop sees our
+     * record when it checks busy(), or we see that it sleeps and wake it. */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    loop->notify();
+    return true;
+}
+
+bool fluent::Sender::busy() const
+{
+    if( flush_requested.load(std::memory_order_relaxed) ) {
+        return true;
+    }
+    /* with bufmax bytes waiting and no spool, new records stay queued
+     * until the connection catches up, so there is nothing to do now */
+    return !queue->empty() && (spool || (pending() < bufmax && under_ceiling()));
+}
+
+void fluent::Sender::on_tick(double now)
+{
+    pthread_mutex_lock(&mutex);
+    try {
+        reap();
+        if( state == DISCONNECTED && now >= retry_at ) {
+            start_connect(now);
+        }
+        if( state == CONNECTING && now >= connect_deadline ) {
+            throw Socket::TimedOut();
+        }
+        if( state == CONNECTED && acks && acks->deadline() && now >= acks->deadline() ) {
+            throw Socket::TimedOut();
+        }
+        drain_queue(now);
+        if( state == CONNECTED ) {
+            write_pending(now);
+        }
+    }
+    catch(::std::runtime_error& e) {
+        connection_failed(e, now);
+    }
+    account();
+    update_interest(now);
+    pthread_mutex_unlock(&mutex);
+}
+
+void fluent::Sender::on_io(int, unsigned events, double now)
+{
+    pthread_mutex_lock(&mutex);
+    try {
+        if( state == CONNECTING ) {
+            /* if this address failed, the next one may get the same
+             * descriptor number; it has to be watched afresh */
+            loop->unwatch(watched_fd);
+            watched_fd = -1;
+            if( sock->finish_connect() ) {
+                state = CONNECTED;
+                write_pending(now);
+            }
+            else {
+                connect_deadline = now + (connect_timeout >= 0 ? connect_timeout : timeout);
+            }
+        }
+        else if( state == CONNECTED ) {
+            if( events & EventLoop::ERROR ) {
+                /* zerocopy completions raise it until they are read */
+                reap();
+            }
+            if( events & (EventLoop::READABLE | EventLoop::ERROR) ) {
+                /* acks, if we asked for them; either way this notices the
+                 * server going away (or reports the socket's error) */
+                char scratch[1024];
+                size_t n;
+                while( (n = sock->recv_some(scratch, sizeof(scratch))) ) {
+                    if( acks ) {
+                        acks->received(scratch, n);
+                    }
+                }
+            }
+            /* acks may have opened the window */
+            if( (events & EventLoop::WRITABLE) || acks ) {
+                write_pending(now);
+            }
+        }
+    }
+    catch(::std::runtime_error& e) {
+        connection_failed(e, now);
+    }
+    account();
+    update_interest(now);
+    pthread_mutex_unlock(&mutex);
+}
+
+/* How often a sender waiting on the resolver thread looks for its
+ * answer. */
+static const double RESOLVE_POLL = 0.01;
+
+void fluent::Sender::start_connect(double now)
+{
+    /* the best endpoint, or the soonest back if all of them failed */
+    endpoints.candidates(now, order);
+    current = order[0];
+    Endpoint& endpoint = endpoints[current];
+    sock = endpoint.sock;
+    if( !sock->try_resolve(endpoint.host, endpoint.port) ) {
+        /* the resolver thread has it; look again shortly */
+        retry_at = now + RESOLVE_POLL;
+        return;
+    }
+    if( sock->start_connect() ) {
+        state = CONNECTED;
+    }
+    else {
+        state = CONNECTING;
+        connect_deadline = now + (connect_timeout >= 0 ? connect_timeout : timeout);
+    }
+}
+
+void fluent::Sender::connection_failed(const ::std::exception& e, double now)
+{
+    /* unwatch before closing, the descriptor number may be reused at once */
+    if( watched_fd >= 0 ) {
+        loop->unwatch(watched_fd);
+        watched_fd = -1;
+    }
+    endpoint_failed(current, e, now);
+    state = DISCONNECTED;
+    /* straight on to the next endpoint, if there is one to go to */
+    retry_at = endpoints.available(now) ? now : endpoints.next_retry();
+    if( sock->zerocopy_in_flight() ) {
+        /* the next connection may resend what they still read */
+        sock->abort();
+    }
+    buf.release();
+    if( replaying ) {
+        /* all of it is still in the spool */
+        buf.clear();
+        out_offset = unit_start = 0;
+        unit_ends.clear();
+        replaying = false;
+    }
+    compact(unit_start);
+    out_offset = 0;
+    requeue_unacked();
+}
+
+void fluent::Sender::requeue_unacked()
+{
+    if( !acks || acks->empty() ) {
+        return;
+    }
+    /* buf starts at a unit boundary; the unacknowledged messages go
+     * out again ahead of it */
+    ChunkList out;
+    std::deque<size_t> ends;
+    acks->requeue(out, ends);
+    size_t base = out.size();
+    for( size_t i = 0; i < unit_ends.size(); ++i ) {
+        ends.push_back(base + unit_ends[i]);
+    }
+    out.splice(buf);
+    buf.splice(out);
+    unit_ends.swap(ends);
+    out_offset = unit_start = 0;
+}
+
+void fluent::Sender::wait_for_acks(double until)
+{
+    char scratch[1024];
+    try {
+        /* recv_some() blocks for up to the socket timeout */
+        while( !acks->empty() && monotonic() < until ) {
+            size_t n = sock->recv_some(scratch, sizeof(scratch));
+            acks->received(scratch, n);
+        }
+    }
+    catch(::std::runtime_error&) {
+        state = DISCONNECTED;
+    }
+}
+
+void fluent::Sender::drain_queue(double now)
+{
+    if( batcher ) {
+        while( batcher->size() < FLUSH_BATCH_MAX && (spool || (pending() < bufmax && under_ceiling())) &&
+                queue->try_pop([&](std::string& record) {
+                    batcher->add(record.data(), record.size(), now);
+                }) ) {
+        }
+        if( flush_requested.exchange(false) || batcher->ready(now) ) {
+            if( batcher->size() ) {
+                chunks.clear();
+                message_ends.clear();
+                batcher->gather(chunks, acks ? &message_ends : nullptr);
+                try {
+                    if( acks ) {
+                        stage_messages(now);
+                    }
+                    else {
+                        stage(chunks, now);
+                    }
+                }
+                catch(...) {
+                    batcher->clear();
+                    throw;
+                }
+                batcher->clear();
+            }
+        }
+        return;
+    }
+
+    flush_requested.store(false);
+    if( spool && (!spool->empty() || pending() >= bufmax || !under_ceiling()) ) {
+        ::msgpack::sbuffer unit;
+        while( unit.size() < FLUSH_BATCH_MAX &&
+                queue->try_pop([&](std::string& record) {
+                    unit.write(record.data(), record.size());
+                }) ) {
+        }
+        struct iovec whole;
+        whole.iov_base = unit.data();
+        whole.iov_len = unit.size();
+        spool_unit(&whole, 1);
+        return;
+    }
+    if( pending() >= bufmax || !under_ceiling() ) {
+        return;
+    }
+    /* records go straight into the output, as one unit */
+    size_t start = buf.size();
+    while( buf.size() - start < FLUSH_BATCH_MAX &&
+            queue->try_pop([&](std::string& record) {
+                buf.write(record.data(), record.size());
+            }) ) {
+    }
+    if( buf.size() != start ) {
+        unit_ends.push_back(buf.size());
     }
 }
 
+void fluent::Sender::stage_messages(double now)
+{
+    /* one unit per message, so each is acknowledged and resent alone */
+    ::std::exception_ptr error;
+    size_t begin = 0;
+    for( size_t i = 0; i < message_ends.size(); ++i ) {
+        message.assign(chunks.begin() + begin, chunks.begin() + message_ends[i]);
+        begin = message_ends[i];
+        try {
+            stage(message, now);
+        }
+        catch(::std::runtime_error&) {
+            /* the rest still has to be kept */
+            if( !error ) {
+                error = ::std::current_exception();
+            }
+        }
+    }
+    if( error ) {
+        ::std::rethrow_exception(error);
+    }
+}
+
+void fluent::Sender::stage(const ::std::vector<struct iovec>& iov, double now)
+{
+    size_t total = 0;
+    for( size_t i = 0; i < iov.size(); ++i ) {
+        total += iov[i].iov_len;
+    }
+    if( spool && (!spool->empty() || pending() >= bufmax || !under_ceiling()) ) {
+        if( !iov.empty() ) {
+            spool_unit(&iov[0], iov.size());
+        }
+        return;
+    }
+    size_t written = 0;
+    if( state == CONNECTED && !pending() && !(acks && acks->full()) ) {
+        /* nothing queued ahead of this, try to skip the copy */
+        sending.assign(iov.begin(), iov.end());
+        try {
+            written = sock->try_sendv(&sending[0], sending.size());
+            if( written ) {
+                endpoints.succeeded(current);
+            }
+        }
+        catch(...) {
+            written = 0;
+            buf.write(iov.data(), iov.size());
+            unit_ends.push_back(buf.size());
+            throw;
+        }
+        if( written == total ) {
+            if( acks ) {
+                acks->sent(&iov[0], iov.size(), now);
+            }
+            return;
+        }
+    }
+    if( written ) {
+        /* pending() was 0, so the unit starts a fresh output */
+        discard(buf.size());
+        out_offset = unit_start = 0;
+        unit_ends.clear();
+    }
+    buf.write(iov.data(), iov.size());
+    out_offset += written;
+    unit_ends.push_back(buf.size());
+}
+
+void fluent::Sender::write_pending(double now)
+{
+    reap();
+    for(;;) {
+        while( pending() && !window_full() ) {
+            /* with acks, one message at a time so each is tracked */
+            size_t end = acks && !unit_ends.empty() ? unit_ends.front() : buf.size();
+            sending.clear();
+            buf.gather(sending, out_offset, end);
+            size_t n = sock->try_sendv(&sending[0], sending.size(), true);
+            if( !n ) {
+                break;
+            }
+            out_offset += n;
+            endpoints.succeeded(current);
+            while( !unit_ends.empty() && unit_ends.front() <= out_offset ) {
+                if( acks ) {
+                    sending.clear();
+                    buf.gather(sending, unit_start, unit_ends.front());
+                    acks->sent(&sending[0], sending.size(), now);
+                }
+                unit_start = unit_ends.front();
+                unit_ends.pop_front();
+                if( replaying ) {
+                    spool->consume(1);
+                }
+            }
+        }
+        if( pending() ) {
+            /* written units go back to the pool straight away */
+            compact(unit_start);
+            return;
+        }
+        discard(buf.size());
+        out_offset = unit_start = 0;
+        unit_ends.clear();
+        replaying = false;
+        if( !spool || spool->empty() ) {
+            return;
+        }
+        /* The socket keeps up again: bring the next stretch back from
+         * disk.  It stays spooled until written, so a failure just drops
+         * the copy. */
+        sending.clear();
+        size_t n = spool->peek(sending, SPOOL_READ_AHEAD);
+        if( !n ) {
+            return;
+        }
+        for( size_t i = 0; i < sending.size(); ++i ) {
+            buf.write(&sending[i], 1);
+            unit_ends.push_back(buf.size());
+        }
+        replaying = true;
+    }
+}
+
+void fluent::Sender::compact(size_t from)
+{
+    if( !from ) {
+        return;
+    }
+    discard(from);
+    out_offset = out_offset > from ? out_offset - from : 0;
+    unit_start = unit_start > from ? unit_start - from : 0;
+    while( !unit_ends.empty() && unit_ends.front() <= from ) {
+        unit_ends.pop_front();
+    }
+    for( size_t i = 0; i < unit_ends.size(); ++i ) {
+        unit_ends[i] -= from;
+    }
+}
+
+/* Drops written bytes from the front of buf; a zerocopy send may still
+ * be reading them. */
+void fluent::Sender::discard(size_t length)
+{
+    if( sock->zerocopy_in_flight() ) {
+        buf.consume(length, sock->zerocopy_issued());
+    }
+    else {
+        buf.consume(length);
+    }
+}
+
+void fluent::Sender::reap()
+{
+    uint32_t done = sock->reap_zerocopy();
+    if( !buf.has_pinned() ) {
+        return;
+    }
+    if( sock->zerocopy_in_flight() ) {
+        buf.release(done);
+    }
+    else {
+        /* including chunks pinned for a connection closed since */
+        buf.release();
+    }
+}
+
+void fluent::Sender::update_interest(double now)
+{
+    int fd = sock->get_fd();
+    if( watched_fd >= 0 && watched_fd != fd ) {
+        loop->unwatch(watched_fd);
+        watched_fd = -1;
+    }
+    if( fd >= 0 && state != DISCONNECTED ) {
+        unsigned events = EventLoop::READABLE;
+        if( state == CONNECTING || (pending() && !window_full()) ) {
+            events |= EventLoop::WRITABLE;
+        }
+        loop->watch(this, fd, events);
+        watched_fd = fd;
+    }
+
+    double deadline = 0;
+    if( state == DISCONNECTED ) {
+        deadline = retry_at;
+    }
+    else if( state == CONNECTING ) {
+        deadline = connect_deadline;
+    }
+    else if( acks && acks->deadline() ) {
+        deadline = acks->deadline();
+    }
+    if( batcher && batcher->size() ) {
+        double flush_at = now + batcher->time_left(now);
+        if( !deadline || flush_at < deadline ) {
+            deadline = flush_at;
+        }
+    }
+    loop->set_deadline(this, deadline);
+}
+#endif
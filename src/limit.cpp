@@ -0,0 +1,67 @@
+#include <time.h>
+
+#include "limit.h"
+
+fluent::Limiter::Limiter(const Limit& l, const TagEntry * e)
+    : pad0(), seen(0), tat(0), suppressed(0), pad1(), limit(l), entry(e), next(nullptr)
+{ }
+
+bool fluent::Limiter::admit(int64_t now)
+{
+    if( sample() && take_token(now) ) {
+        return true;
+    }
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+bool fluent::Limiter::sample()
+{
+    if( limit.sample_every > 1
+            && seen.fetch_add(1, std::memory_order_relaxed) % limit.sample_every ) {
+        return false;
+    }
+    if( limit.probability < 1.0 ) {
+        /* xorshift64*, one per thread so sampling shares nothing */
+        static thread_local uint64_t state = 0;
+        if( !state ) {
+            state = static_cast<uint64_t>(clock()) ^ reinterpret_cast<uintptr_t>(&state);
+            state |= 1;
+        }
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        uint64_t r = state * 0x2545F4914F6CDD1DULL;
+        if( (r >> 11) * (1.0 / 9007199254740992.0) >= limit.probability ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool fluent::Limiter::take_token(int64_t now)
+{
+    if( limit.rate <= 0.0 ) {
+        return true;
+    }
+    int64_t interval = static_cast<int64_t>(1e9 / limit.rate);
+    double burst = limit.burst < 1.0 ? 1.0 : limit.burst;
+    int64_t tolerance = static_cast<int64_t>(burst * 1e9 / limit.rate);
+    int64_t current = tat.load(std::memory_order_relaxed);
+    for( ;; ) {
+        int64_t next = (current > now ? current : now) + interval;
+        if( next - now > tolerance ) {
+            return false;
+        }
+        if( tat.compare_exchange_weak(current, next, std::memory_order_relaxed) ) {
+            return true;
+        }
+    }
+}
+
+int64_t fluent::Limiter::clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,453 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include <limits>
+#include <stdexcept>
+
+#include "fluent_cpp.h"
+#include "metrics.h"
+#include "per_thread.h"
+
+static int64_t monotonic()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void pack_key(::msgpack::packer< ::msgpack::sbuffer>& packer, const char * key)
+{
+    size_t length = ::strlen(key);
+    packer.pack_str(length);
+    packer.pack_str_body(key, length);
+}
+
+static const int lowest = std::numeric_limits<int>::min();
+
+int fluent::metrics::Histogram::bucket(double value)
+{
+    if( !(value > 0.0) ) {
+        return lowest;
+    }
+    int exponent;
+    /* value = mantissa * 2^exponent, mantissa in [0.5, 1) */
+    double mantissa = frexp(value, &exponent);
+    int sub = static_cast<int>((mantissa - 0.5) * 2 * sub_buckets);
+    if( sub >= sub_buckets ) {
+        sub = sub_buckets - 1;
+    }
+    return exponent * sub_buckets + sub;
+}
+
+double fluent::metrics::Histogram::midpoint(int bucket)
+{
+    if( bucket == lowest ) {
+        return 0.0;
+    }
+    int exponent = bucket >= 0 ? bucket / sub_buckets : -((sub_buckets - 1 - bucket) / sub_buckets);
+    int sub = bucket - exponent * sub_buckets;
+    double width = ldexp(1.0, exponent) / (2 * sub_buckets);
+    return ldexp(0.5, exponent) + width * (sub + 0.5);
+}
+
+void fluent::metrics::Histogram::add(double value)
+{
+    ++buckets[bucket(value)];
+}
+
+void fluent::metrics::Histogram::merge(const Histogram& other)
+{
+    std::map<int, uint64_t>::const_iterator it = other.buckets.begin();
+    for( ; it != other.buckets.end(); ++it ) {
+        buckets[it->first] += it->second;
+    }
+}
+
+void fluent::metrics::Histogram::reset()
+{
+    std::map<int, uint64_t>::iterator it = buckets.begin();
+    for( ; it != buckets.end(); ++it ) {
+        it->second = 0;
+    }
+}
+
+double fluent::metrics::Histogram::quantile(double q, uint64_t count) const
+{
+    uint64_t rank = static_cast<uint64_t>(ceil(q * count));
+    if( rank < 1 ) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    std::map<int, uint64_t>::const_iterator it = buckets.begin();
+    for( ; it != buckets.end(); ++it ) {
+        seen += it->second;
+        if( seen >= rank ) {
+            return midpoint(it->first);
+        }
+    }
+    return buckets.empty() ? 0.0 : midpoint(buckets.rbegin()->first);
+}
+
+fluent::metrics::Cell::Cell(kind_t k, const std::string& l, const std::string& d)
+    : kind(k), touched(false), label(l), dimension(d), count(0), sum(0.0),
+        min(std::numeric_limits<double>::infinity()),
+        max(-std::numeric_limits<double>::infinity()),
+        last(0.0), set_at(0), histogram()
+{ }
+
+void fluent::metrics::Cell::merge(const Cell& other)
+{
+    touched = touched || other.touched;
+    count += other.count;
+    sum += other.sum;
+    min = other.min < min ? other.min : min;
+    max = other.max > max ? other.max : max;
+    if( other.set_at >= set_at ) {
+        last = other.last;
+        set_at = other.set_at;
+    }
+    histogram.merge(other.histogram);
+}
+
+void fluent::metrics::Cell::reset()
+{
+    touched = false;
+    count = 0;
+    sum = 0.0;
+    min = std::numeric_limits<double>::infinity();
+    max = -std::numeric_limits<double>::infinity();
+    last = 0.0;
+    set_at = 0;
+    histogram.reset();
+}
+
+fluent::metrics::Shard::Shard()
+    : cells()
+#ifdef FLUENT_MT
+        , mutex()
+#endif
+{
+#ifdef FLUENT_MT
+    int retval = pthread_mutex_init(&mutex, NULL);
+    if( retval != 0 ) {
+        throw NoResources(retval);
+    }
+#endif
+}
+
+fluent::metrics::Shard::~Shard()
+{
+#ifdef FLUENT_MT
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+fluent::Metrics::Metrics(const std::string& t, Sender& s)
+    : prefix(t), sender(s), id(PerThread<metrics::Shard>::next_id()), shards(), merged()
+#ifdef FLUENT_MT
+        , shards_mutex(), interval(0.0), thread(), running(false), flusher_mutex(), wake()
+#endif
+{
+#ifdef FLUENT_MT
+    int retval = pthread_mutex_init(&shards_mutex, NULL);
+    if( retval != 0 ) {
+        throw NoResources(retval);
+    }
+    retval = pthread_mutex_init(&flusher_mutex, NULL);
+    if( retval != 0 ) {
+        pthread_mutex_destroy(&shards_mutex);
+        throw NoResources(retval);
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    /* timed waits are against monotonic() */
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    retval = pthread_cond_init(&wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if( retval != 0 ) {
+        pthread_mutex_destroy(&flusher_mutex);
+        pthread_mutex_destroy(&shards_mutex);
+        throw NoResources(retval);
+    }
+#endif
+}
+
+fluent::Metrics::~Metrics()
+{
+#ifdef FLUENT_MT
+    stop();
+#endif
+    flush();
+    for( size_t i = 0; i < shards.size(); ++i ) {
+        delete shards[i];
+    }
+#ifdef FLUENT_MT
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&flusher_mutex);
+    pthread_mutex_destroy(&shards_mutex);
+#endif
+}
+
+fluent::metrics::Shard * fluent::Metrics::local()
+{
+    metrics::Shard * shard = PerThread<metrics::Shard>::find(id);
+    if( shard ) {
+        return shard;
+    }
+    shard = new metrics::Shard();
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&shards_mutex);
+#endif
+    shards.push_back(shard);
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&shards_mutex);
+#endif
+    PerThread<metrics::Shard>::add(id, shard);
+    return shard;
+}
+
+fluent::metrics::Cell& fluent::Metrics::cell(metrics::Shard& shard, metrics::kind_t kind,
+        const std::string& label, const std::string& dimension)
+{
+    /* reused, so a hit does not allocate */
+    static thread_local std::string key;
+    key.assign(1, static_cast<char>(kind));
+    key += label;
+    key += '\0';
+    key += dimension;
+    metrics::Cells::iterator it = shard.cells.find(key);
+    if( it == shard.cells.end() ) {
+        it = shard.cells.insert(std::make_pair(key, metrics::Cell(kind, label, dimension))).first;
+    }
+    return it->second;
+}
+
+void fluent::Metrics::count(const std::string& label, const std::string& dimension, int64_t n)
+{
+    metrics::Shard * shard = local();
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&shard->mutex);
+#endif
+    metrics::Cell& c = cell(*shard, metrics::COUNTER, label, dimension);
+    c.touched = true;
+    c.count += n;
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&shard->mutex);
+#endif
+}
+
+void fluent::Metrics::gauge(const std::string& label, const std::string& dimension, double value)
+{
+    metrics::Shard * shard = local();
+    int64_t now = monotonic();
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&shard->mutex);
+#endif
+    metrics::Cell& c = cell(*shard, metrics::GAUGE, label, dimension);
+    c.touched = true;
+    c.last = value;
+    c.set_at = now;
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&shard->mutex);
+#endif
+}
+
+void fluent::Metrics::observe(const std::string& label, const std::string& dimension, double value)
+{
+    metrics::Shard * shard = local();
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&shard->mutex);
+#endif
+    metrics::Cell& c = cell(*shard, metrics::HISTOGRAM, label, dimension);
+    c.touched = true;
+    ++c.count;
+    c.sum += value;
+    c.min = value < c.min ? value : c.min;
+    c.max = value > c.max ? value : c.max;
+    c.histogram.add(value);
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&shard->mutex);
+#endif
+}
+
+size_t fluent::Metrics::flush()
+{
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&flusher_mutex);
+    /* a thread adding its shard waits; recording does not */
+    pthread_mutex_lock(&shards_mutex);
+#endif
+    for( size_t i = 0; i < shards.size(); ++i ) {
+        metrics::Shard * shard = shards[i];
+#ifdef FLUENT_MT
+        pthread_mutex_lock(&shard->mutex);
+#endif
+        metrics::Cells::iterator it = shard->cells.begin();
+        for( ; it != shard->cells.end(); ++it ) {
+            if( !it->second.touched ) {
+                continue;
+            }
+            metrics::Cells::iterator total = merged.find(it->first);
+            if( total == merged.end() ) {
+                merged.insert(*it);
+            }
+            else {
+                total->second.merge(it->second);
+            }
+            it->second.reset();
+        }
+#ifdef FLUENT_MT
+        pthread_mutex_unlock(&shard->mutex);
+#endif
+    }
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&shards_mutex);
+#endif
+
+    size_t sent = 0;
+    PackBuffer& scratch = PackBuffer::local();
+    time_t now = ::time(NULL);
+    metrics::Cells::iterator it = merged.begin();
+    for( ; it != merged.end(); ++it ) {
+        if( it->second.touched ) {
+            emit(it->second, now, scratch.get());
+            it->second.reset();
+            ++sent;
+        }
+    }
+    scratch.trim();
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&flusher_mutex);
+#endif
+    return sent;
+}
+
+void fluent::Metrics::emit(const metrics::Cell& cell, time_t now, ::msgpack::sbuffer& sbuf)
+{
+    sbuf.clear();
+    ::msgpack::packer< ::msgpack::sbuffer> packer(sbuf);
+    packer.pack_array(3);
+    packer.pack(full_tag(cell.label));
+    packer.pack(now);
+
+    size_t fields = cell.dimension.empty() ? 0 : 1;
+    switch( cell.kind ) {
+    case metrics::COUNTER:
+    case metrics::GAUGE:
+        fields += 1;
+        break;
+    case metrics::HISTOGRAM:
+        fields += 7;
+        break;
+    }
+    packer.pack_map(fields);
+    if( !cell.dimension.empty() ) {
+        pack_key(packer, "dimension");
+        packer.pack(cell.dimension);
+    }
+    switch( cell.kind ) {
+    case metrics::COUNTER:
+        pack_key(packer, "count");
+        packer.pack(cell.count);
+        break;
+    case metrics::GAUGE:
+        pack_key(packer, "gauge");
+        packer.pack(cell.last);
+        break;
+    case metrics::HISTOGRAM: {
+        static const char * const names[] = { "p50", "p90", "p99" };
+        static const double quantiles[] = { 0.5, 0.9, 0.99 };
+        pack_key(packer, "count");
+        packer.pack(cell.count);
+        pack_key(packer, "sum");
+        packer.pack(cell.sum);
+        pack_key(packer, "min");
+        packer.pack(cell.min);
+        pack_key(packer, "max");
+        packer.pack(cell.max);
+        for( int i = 0; i < 3; ++i ) {
+            /* a bucket's midpoint can lie outside what was seen */
+            double value = cell.histogram.quantile(quantiles[i], cell.count);
+            value = value < cell.min ? cell.min : value > cell.max ? cell.max : value;
+            pack_key(packer, names[i]);
+            packer.pack(value);
+        }
+        break;
+    }
+    }
+
+    try {
+        sender.emit(sbuf);
+    }
+    catch(::std::runtime_error&) {
+        /* the Sender kept it in its backlog */
+    }
+}
+
+std::string fluent::Metrics::full_tag(const std::string& label) const
+{
+    if( prefix.size() ) {
+        if( label.size() ) {
+            return prefix + "." + label;
+        }
+        return prefix;
+    }
+    return label;
+}
+
+#ifdef FLUENT_MT
+void fluent::Metrics::start(double i)
+{
+    if( running.load() ) {
+        return;
+    }
+    interval = i;
+    running.store(true);
+    int retval = pthread_create(&thread, NULL, &Metrics::flusher_main, this);
+    if( retval != 0 ) {
+        running.store(false);
+        throw NoResources(retval);
+    }
+}
+
+void fluent::Metrics::stop()
+{
+    pthread_mutex_lock(&flusher_mutex);
+    bool was_running = running.exchange(false);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&flusher_mutex);
+    if( !was_running ) {
+        return;
+    }
+    pthread_join(thread, NULL);
+    flush();
+}
+
+void * fluent::Metrics::flusher_main(void * self)
+{
+    Metrics * metrics = static_cast<Metrics *>(self);
+    int64_t period = static_cast<int64_t>(metrics->interval * 1e9);
+    int64_t due = monotonic() + period;
+    pthread_mutex_lock(&metrics->flusher_mutex);
+    while( metrics->running.load(std::memory_order_relaxed) ) {
+        int64_t now = monotonic();
+        if( now >= due ) {
+            pthread_mutex_unlock(&metrics->flusher_mutex);
+            metrics->flush();
+            pthread_mutex_lock(&metrics->flusher_mutex);
+            due += period;
+            if( due < now ) {
+                due = now + period;
+            }
+            continue;
+        }
+        struct timespec until;
+        until.tv_sec = static_cast<time_t>(due / 1000000000);
+        until.tv_nsec = static_cast<long>(due % 1000000000);
+        pthread_cond_timedwait(&metrics->wake, &metrics->flusher_mutex, &until);
+    }
+    pthread_mutex_unlock(&metrics->flusher_mutex);
+    return NULL;
+}
+#endif
@@ -0,0 +1,277 @@
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unordered_map>
+
+#ifdef FLUENT_MT
+#include <atomic>
+#include <deque>
+#include <pthread.h>
+#endif
+
+#include "resolver.h"
+#include "socket.h"
+
+namespace {
+    struct Entry {
+        std::string host;
+        char port[8];
+        int family;
+        int socktype;
+        fluent::Resolver::AddressList addresses;
+        double expires;
+        /* getaddrinfo()'s last error, 0 if it worked */
+        int error;
+        /* queued for the resolver thread, or being looked up there */
+        bool pending;
+
+        Entry() : host(), port(), family(0), socktype(0), addresses(), expires(0), error(0),
+                pending(false) { }
+    };
+}
+
+/* Wait before asking again after the resolver failed. */
+static const double FAILURE_RETRY = 5.0;
+
+#ifdef FLUENT_MT
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* the resolver thread waits on work, callers with nothing cached on done */
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static std::atomic<double> ttl(30.0);
+#else
+static double ttl = 30.0;
+#endif
+
+/* Never freed: a lookup may still be running as the process exits.
+ * Entries are never removed either, there is one per configured host. */
+static std::unordered_map<std::string, Entry *>& cache()
+{
+    static std::unordered_map<std::string, Entry *> * entries = new std::unordered_map<std::string, Entry *>();
+    return *entries;
+}
+
+static void lock()
+{
+#ifdef FLUENT_MT
+    pthread_mutex_lock(&cache_mutex);
+#endif
+}
+
+static void unlock()
+{
+#ifdef FLUENT_MT
+    pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+static double monotonic()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 0, or getaddrinfo()'s error */
+static int lookup(const Entry& entry, fluent::Resolver::AddressList& out)
+{
+    struct addrinfo * result = nullptr;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = entry.family;
+    hints.ai_socktype = entry.socktype;
+
+    int retval = getaddrinfo(entry.host.c_str(), entry.port, &hints, &result);
+    if( retval != 0 ) {
+        return retval;
+    }
+
+    out.clear();
+    for( struct addrinfo * ai = result; ai; ai = ai->ai_next ) {
+        fluent::Resolver::Address address;
+        memset(&address, 0, sizeof(address));
+        memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+        address.length = ai->ai_addrlen;
+        out.push_back(address);
+    }
+    if( result ) {
+        freeaddrinfo(result);
+    }
+    return out.empty() ? EAI_NONAME : 0;
+}
+
+/* Files a lookup's outcome; call with the cache locked. */
+static void update(Entry& entry, int err, const fluent::Resolver::AddressList& fresh, double now)
+{
+    entry.error = err;
+    if( !err ) {
+        entry.addresses = fresh;
+        entry.expires = now + ttl;
+    }
+    else {
+        /* keep the last addresses that worked */
+        entry.expires = now + FAILURE_RETRY;
+    }
+}
+
+#ifdef FLUENT_MT
+/* Entries waiting for the resolver thread, under the cache lock. */
+static std::deque<Entry *>& queue()
+{
+    static std::deque<Entry *> * entries = new std::deque<Entry *>();
+    return *entries;
+}
+
+/* Every lookup happens here, one at a time, so neither an event loop
+ * nor a burst of stale entries ever waits on the resolver or starts a
+ * thread per host.  Runs for the rest of the process. */
+static void * resolver_main(void *)
+{
+    lock();
+    for( ;; ) {
+        while( queue().empty() ) {
+            pthread_cond_wait(&work, &cache_mutex);
+        }
+        Entry * entry = queue().front();
+        queue().pop_front();
+        unlock();
+
+        fluent::Resolver::AddressList fresh;
+        /* host and the rest never change once the entry is filed */
+        int err = lookup(*entry, fresh);
+
+        lock();
+        update(*entry, err, fresh, monotonic());
+        entry->pending = false;
+        pthread_cond_broadcast(&done);
+    }
+    return NULL;
+}
+
+/* Hands entry to the resolver thread, starting it the first time.
+ * Call with the cache locked.  False if there is no thread to take
+ * it. */
+static bool enqueue(Entry * entry)
+{
+    static bool started = false;
+    if( entry->pending ) {
+        return true;
+    }
+    if( !started ) {
+        pthread_attr_t attr;
+        if( pthread_attr_init(&attr) != 0 ) {
+            return false;
+        }
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        int retval = pthread_create(&thread, &attr, &resolver_main, NULL);
+        pthread_attr_destroy(&attr);
+        if( retval != 0 ) {
+            return false;
+        }
+        started = true;
+    }
+    queue().push_back(entry);
+    entry->pending = true;
+    pthread_cond_signal(&work);
+    return true;
+}
+#endif
+
+/* The entry for host:port, filed on first use; call with the cache
+ * locked. */
+static Entry * find(const std::string& h, int p, int family, int socktype)
+{
+    char port[8];
+    snprintf(port, sizeof(port), "%d", p);
+    char kind[32];
+    snprintf(kind, sizeof(kind), "/%s/%d/%d", port, family, socktype);
+
+    Entry *& slot = cache()[h + kind];
+    if( !slot ) {
+        slot = new Entry();
+        slot->host = h;
+        memcpy(slot->port, port, sizeof(port));
+        slot->family = family;
+        slot->socktype = socktype;
+    }
+    return slot;
+}
+
+/* Looks entry up on the calling thread; call with the cache locked. */
+static void lookup_here(Entry * entry, double now)
+{
+    unlock();
+    fluent::Resolver::AddressList fresh;
+    int err = lookup(*entry, fresh);
+    lock();
+    update(*entry, err, fresh, now);
+}
+
+void fluent::Resolver::set_ttl(double seconds)
+{
+    ttl = seconds;
+}
+
+void fluent::Resolver::resolve(const std::string& h, int p, int family, int socktype,
+        AddressList& out)
+{
+    double now = monotonic();
+    lock();
+    Entry * entry = find(h, p, family, socktype);
+    if( entry->addresses.empty() || now >= entry->expires ) {
+#ifdef FLUENT_MT
+        if( enqueue(entry) ) {
+            /* the old addresses while the resolver thread asks again;
+             * with none, or a ttl of 0, wait for its answer */
+            while( entry->pending && (entry->addresses.empty() || ttl <= 0) ) {
+                pthread_cond_wait(&done, &cache_mutex);
+            }
+        }
+        else {
+            lookup_here(entry, now);
+        }
+#else
+        lookup_here(entry, now);
+#endif
+    }
+    out = entry->addresses;
+    int err = entry->error;
+    unlock();
+    if( out.empty() ) {
+        throw Socket::AddressResolutionError(err);
+    }
+}
+
+bool fluent::Resolver::try_resolve(const std::string& h, int p, int family, int socktype,
+        AddressList& out)
+{
+    double now = monotonic();
+    lock();
+    Entry * entry = find(h, p, family, socktype);
+    /* a host that failed lately is left alone until FAILURE_RETRY is up */
+    if( now >= entry->expires ) {
+#ifdef FLUENT_MT
+        if( !enqueue(entry) ) {
+            lookup_here(entry, now);
+        }
+#else
+        lookup_here(entry, now);
+#endif
+    }
+    if( entry->addresses.empty() ) {
+        /* pending, or failed and not to be asked again yet */
+        bool failed = !entry->pending && now < entry->expires;
+        int err = entry->error;
+        unlock();
+        if( failed ) {
+            throw Socket::AddressResolutionError(err);
+        }
+        return false;
+    }
+    out = entry->addresses;
+    unlock();
+    return true;
+}
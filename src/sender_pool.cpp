@@ -0,0 +1,84 @@
+#include <sched.h>
+#include <unistd.h>
+
+#include "fluent_cpp.h"
+#include "per_thread.h"
+
+/* BY_CPU asks sched_getcpu() again after this many lookups. */
+static const unsigned CPU_REFRESH = 64;
+
+fluent::SenderPool::SenderPool(size_t n,
+                const std::string& h, int p,
+                size_t b, float _timeout, bool v)
+    : shards(), sharding(BY_THREAD), id(PerThread<Sender>::next_id()), next_ticket(0)
+{
+    if( n == 0 ) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? cpus : 1;
+    }
+    try {
+        for( size_t i = 0; i < n; ++i ) {
+            shards.push_back(new Sender(h, p, b, _timeout, v));
+        }
+    }
+    catch(...) {
+        for( size_t i = 0; i < shards.size(); ++i ) {
+            delete shards[i];
+        }
+        throw;
+    }
+}
+
+fluent::SenderPool::~SenderPool()
+{
+    for( size_t i = 0; i < shards.size(); ++i ) {
+        delete shards[i];
+    }
+}
+
+/* The CPU the calling thread was last seen on, or -1.  A thread only
+ * moves now and then, so it keeps the answer for CPU_REFRESH calls. */
+static int current_cpu()
+{
+    static thread_local int cpu = -1;
+    static thread_local unsigned calls = 0;
+    if( calls++ % CPU_REFRESH == 0 ) {
+        cpu = sched_getcpu();
+    }
+    return cpu;
+}
+
+fluent::Sender& fluent::SenderPool::local()
+{
+    if( sharding == BY_CPU ) {
+        int cpu = current_cpu();
+        if( cpu >= 0 ) {
+            return *shards[cpu % shards.size()];
+        }
+    }
+    Sender * mine = PerThread<Sender>::find(id);
+    if( !mine ) {
+        /* this thread's first record through this pool */
+        mine = shards[next_ticket++ % shards.size()];
+        PerThread<Sender>::add(id, mine);
+    }
+    return *mine;
+}
+
+void fluent::SenderPool::flush()
+{
+    for( size_t i = 0; i < shards.size(); ++i ) {
+        shards[i]->flush();
+    }
+}
+
+#ifdef FLUENT_MT
+size_t fluent::SenderPool::get_dropped() const
+{
+    size_t total = 0;
+    for( size_t i = 0; i < shards.size(); ++i ) {
+        total += shards[i]->get_dropped();
+    }
+    return total;
+}
+#endif
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <new>
+#include <stdexcept>
+
+#include "fluent_cpp.h"
+#include "shm_ring.h"
+
+static const char RING_MAGIC[8] = { 'F', 'L', 'S', 'H', 'R', 'I', 'N', 'G' };
+
+static size_t round_up(size_t n)
+{
+    if( n < 4096 ) {
+        n = 4096;
+    }
+    size_t r = 1;
+    while( r < n ) {
+        r <<= 1;
+    }
+    return r;
+}
+
+fluent::ShmRing::ShmRing(size_t capacity)
+    : map_size(0), header(nullptr), data(nullptr), mask(0)
+{
+    map(-1, round_up(capacity), true);
+}
+
+fluent::ShmRing::ShmRing(const std::string& name, size_t capacity)
+    : map_size(0), header(nullptr), data(nullptr), mask(0)
+{
+    bool create = true;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if( fd < 0 && errno == EEXIST ) {
+        create = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if( fd < 0 ) {
+        throw ErrnoException(errno, "Could not open the shared memory ring");
+    }
+    try {
+        map(fd, round_up(capacity), create);
+    }
+    catch(...) {
+        ::close(fd);
+        if( create ) {
+            shm_unlink(name.c_str());
+        }
+        throw;
+    }
+    /* the mapping keeps it */
+    ::close(fd);
+}
+
+fluent::ShmRing::~ShmRing()
+{
+    munmap(header, map_size);
+}
+
+void fluent::ShmRing::unlink(const std::string& name)
+{
+    shm_unlink(name.c_str());
+}
+
+void fluent::ShmRing::map(int fd, size_t capacity, bool create)
+{
+    if( create && fd >= 0 && ftruncate(fd, page_size + capacity) < 0 ) {
+        throw ErrnoException(errno, "Could not size the shared memory ring");
+    }
+    if( !create ) {
+        /* whoever made it may not be done setting it up yet */
+        struct stat st;
+        for( int tries = 0; ; ++tries ) {
+            if( fstat(fd, &st) < 0 ) {
+                throw ErrnoException(errno, "Could not size the shared memory ring");
+            }
+            if( static_cast<size_t>(st.st_size) > page_size || tries == 1000 ) {
+                break;
+            }
+            usleep(1000);
+        }
+        if( static_cast<size_t>(st.st_size) <= page_size ) {
+            throw ::std::runtime_error("The shared memory ring was never set up.");
+        }
+        capacity = st.st_size - page_size;
+    }
+
+    map_size = page_size + capacity;
+    int flags = fd >= 0 ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS;
+    void * m = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if( m == MAP_FAILED ) {
+        throw ErrnoException(errno, "Could not map the shared memory ring");
+    }
+    header = static_cast<Header *>(m);
+    data = static_cast<char *>(m) + page_size;
+    mask = capacity - 1;
+
+    if( !header->head.is_lock_free() ) {
+        munmap(m, map_size);
+        throw ::std::runtime_error("Shared memory rings need lock-free 64-bit atomics.");
+    }
+    if( create ) {
+        /* fresh mappings are zeroed, and so every record is FREE */
+        new (&header->head) std::atomic<uint64_t>(0);
+        new (&header->tail) std::atomic<uint64_t>(0);
+        new (&header->dropped) std::atomic<uint64_t>(0);
+        header->capacity = capacity;
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+        return;
+    }
+    for( int tries = 0; memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0; ++tries ) {
+        if( tries == 1000 ) {
+            munmap(m, map_size);
+            throw ::std::runtime_error("This is not a shared memory ring.");
+        }
+        usleep(1000);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+bool fluent::ShmRing::push(const char * record, size_t length)
+{
+    size_t size = record_size(length);
+    uint64_t capacity = mask + 1;
+    if( size > capacity / 4 ) {
+        header->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint64_t pos = header->head.load(std::memory_order_relaxed);
+    size_t padding;
+    for(;;) {
+        /* a record never wraps; the rest of the ring is padded instead */
+        size_t to_end = capacity - (pos & mask);
+        padding = size > to_end ? to_end : 0;
+        uint64_t tail = header->tail.load(std::memory_order_acquire);
+        if( pos + padding + size - tail > capacity ) {
+            header->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if( header->head.compare_exchange_weak(pos, pos + padding + size, std::memory_order_relaxed) ) {
+            break;
+        }
+    }
+
+    if( padding ) {
+        Record * pad = at(pos);
+        pad->length = padding - sizeof(Record);
+        pad->state.store(PADDING, std::memory_order_release);
+        pos += padding;
+    }
+    Record * r = at(pos);
+    r->length = length;
+    memcpy(reinterpret_cast<char *>(r + 1), record, length);
+    r->state.store(READY, std::memory_order_release);
+    return true;
+}
+
+void fluent::ShmRing::release(uint64_t tail, size_t size)
+{
+    /* Any 8-byte boundary in here may start a record later on, which
+     * must read as FREE until it is published. */
+    memset(data + (tail & mask), 0, size);
+    header->tail.store(tail + size, std::memory_order_release);
+}
+
+fluent::Collector::Collector(ShmRing& r, Sender& s)
+    : ring(r), sender(s), record()
+#ifdef FLUENT_MT
+        , thread(), running(false)
+#endif
+{ }
+
+fluent::Collector::~Collector()
+{
+#ifdef FLUENT_MT
+    stop();
+#endif
+}
+
+size_t fluent::Collector::drain()
+{
+    size_t count = 0;
+    while( ring.pop([this](const char * data, size_t length) {
+                record.assign(data, length);
+            }) ) {
+        ++count;
+        try {
+            sender.emit(record.data(), record.size());
+        }
+        catch(::std::runtime_error&) {
+            /* the Sender kept it in its backlog */
+        }
+    }
+    return count;
+}
+
+#ifdef FLUENT_MT
+void fluent::Collector::start()
+{
+    if( running.load() ) {
+        return;
+    }
+    running.store(true);
+    int retval = pthread_create(&thread, NULL, &Collector::collector_main, this);
+    if( retval != 0 ) {
+        running.store(false);
+        throw NoResources(retval);
+    }
+}
+
+void fluent::Collector::stop()
+{
+    if( !running.exchange(false) ) {
+        return;
+    }
+    pthread_join(thread, NULL);
+    drain();
+}
+
+void * fluent::Collector::collector_main(void * self)
+{
+    Collector * c = static_cast<Collector *>(self);
+    struct timespec idle;
+    idle.tv_sec = 0;
+    idle.tv_nsec = idle_usec * 1000;
+    while( c->running.load(std::memory_order_relaxed) ) {
+        if( !c->drain() ) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+#endif
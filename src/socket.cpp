@@ -1,10 +1,71 @@
 #include <cmath>
-#include <sstream>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
 #include <netdb.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#endif
+#include <netinet/tcp.h>
 #include "socket.h"
 
-fluent::Socket::Socket(domain_t domain, type_t type, int protocol)
-    : fd(-1), connected(false)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define FLUENT_HAVE_ZEROCOPY 1
+#endif
+
+/* Moves iov / count past the first written bytes. */
+static void advance(struct iovec *& iov, size_t& count, size_t written)
+{
+    while( count && written >= iov->iov_len ) {
+        written -= iov->iov_len;
+        ++iov;
+        --count;
+    }
+    if( count ) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+        iov->iov_len -= written;
+    }
+}
+
+/* Turns a file status flag on or off. */
+static void set_flag(int fd, int flag, bool on)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if( flags < 0 ) {
+        throw ::fluent::Socket::BadFileDescriptor(fd);
+    }
+    flags = on ? (flags | flag) : (flags & ~flag);
+    if( fcntl(fd, F_SETFL, flags) < 0 ) {
+        throw ::fluent::ErrnoException(errno, "Could not change the socket's file status flags");
+    }
+}
+
+fluent::Socket::Socket(domain_t d, type_t t, int p)
+    : fd(-1), connected(false), domain(d), type(t), protocol(p),
+        timeout(-1), connect_timeout(-1), nonblocking(false), background(false), zerocopy(0), zerocopy_sent(0), zerocopy_done(0), zerocopy_base(0),
+        nodelay(false), cork(false), send_buffer(0), addresses(), next_address(0)
+{
+    open();
+}
+
+void fluent::Socket::open()
 {
     fd = socket(domain, type, protocol);
     if( fd < 0 ) {
@@ -39,6 +100,31 @@ fluent::Socket::Socket(domain_t domain, type_t type, int protocol)
                 throw ErrnoException(errno, "Unknown error occured");
         }
     }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    if( timeout >= 0 ) {
+        settimeout(timeout);
+    }
+    if( nonblocking || background ) {
+        set_flag(fd, O_NONBLOCK, true);
+    }
+    if( zerocopy ) {
+        set_zerocopy(zerocopy);
+    }
+    if( nodelay ) {
+        set_nodelay(true);
+    }
+    if( send_buffer > 0 ) {
+        set_send_buffer(send_buffer);
+    }
+}
+
+/* False if the option was refused. */
+static bool set_int_option(int fd, int level, int name, int value)
+{
+    return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
 }
 
 fluent::Socket::~Socket()
@@ -84,10 +170,12 @@ static inline void set_one_timeout(int fd, int which, const struct timeval& s_ti
     }
 }
 
-void fluent::Socket::settimeout(float timeout)
+void fluent::Socket::settimeout(float t)
 {
+    timeout = t;
     if( fd < 0 ) {
-        throw BadFileDescriptor(fd);
+        /* applied when the socket is reopened */
+        return;
     }
 
     struct timeval s_timeout;
@@ -97,181 +185,674 @@ void fluent::Socket::settimeout(float timeout)
     set_one_timeout(fd, SO_RCVTIMEO, s_timeout);
 }
 
-static inline ::std::string itoa(int arg) {
-    ::std::ostringstream strm;
-    strm << arg;
-    return strm.str();
+static void throw_connect_error(int err, int fd, bool local)
+{
+    if( local ) {
+        /* errors from the path, and ones that mean something else there */
+        switch( err ) {
+            case EACCES:
+                throw ::fluent::Socket::PermissionDenied();
+                break;
+            case EAGAIN:
+                throw ::fluent::Socket::ListenerBusy();
+                break;
+            case ELOOP:
+                throw ::fluent::Socket::SymlinkLoop();
+                break;
+            case ENAMETOOLONG:
+                throw ::fluent::Socket::PathTooLong();
+                break;
+            case ENOENT:
+                throw ::fluent::Socket::NoSuchSocket();
+                break;
+            case ENOTDIR:
+                throw ::fluent::Socket::NotADirectory();
+                break;
+        }
+    }
+    switch( err ) {
+        case EACCES:
+            throw ::fluent::Socket::NoBroadcastOption();
+            break;
+        case EADDRINUSE:
+            throw ::fluent::Socket::AddressInUse();
+            break;
+        case EADDRNOTAVAIL:
+            throw ::fluent::Socket::AddressNotAvailable();
+            break;
+        case EAFNOSUPPORT:
+            throw ::fluent::Socket::AFNotSupported();
+            break;
+        case EALREADY:
+            throw ::fluent::Socket::AlreadyConnecting();
+            break;
+        case EBADF:
+            throw ::fluent::Socket::BadFileDescriptor(fd);
+            break;
+        case ECONNREFUSED:
+            throw ::fluent::Socket::ConnectionRefused();
+            break;
+        case EFAULT:
+            throw ::fluent::Socket::InvalidPointer();
+            break;
+        case EHOSTUNREACH:
+            throw ::fluent::Socket::HostUnreachable();
+            break;
+        case EINPROGRESS:
+            throw ::fluent::Socket::NotCompletedYet();
+            break;
+        case EINTR:
+            throw ::fluent::InterruptedOperation();
+            break;
+        case EINVAL:
+            throw ::fluent::Socket::InvalidArgs();
+            break;
+        case EISCONN:
+            throw ::fluent::Socket::Connected();
+            break;
+        case ENETDOWN:
+            throw ::fluent::Socket::NetworkDown();
+            break;
+        case ENETUNREACH:
+            throw ::fluent::Socket::NetworkUnreachable();
+            break;
+        case ENOBUFS:
+            throw ::fluent::Socket::NoBuffers();
+            break;
+        case ENOTSOCK:
+            throw ::fluent::Socket::NotASocket(fd);
+            break;
+        case EOPNOTSUPP:
+            throw ::fluent::Socket::ListeningSocket();
+            break;
+        case EPROTOTYPE:
+            throw ::fluent::Socket::WrongAddressType();
+            break;
+        case ETIMEDOUT:
+            throw ::fluent::Socket::TimedOut();
+            break;
+        case ECONNRESET:
+            throw ::fluent::Socket::ConnectionReset();
+            break;
+        default:
+            throw ::fluent::ErrnoException(err, "Unknown error occured");
+    }
+}
+
+void fluent::Socket::connect(const ::std::string& host, int port)
+{
+    if( !start_connect(host, port) ) {
+        throw NotCompletedYet();
+    }
 }
 
-inline fluent::Socket::AddressResolutionError::AddressResolutionError(int e)
-    : ::std::runtime_error(gai_strerror(e)), ecode(e)
-{ }
+void fluent::Socket::resolve(const ::std::string& host, int port)
+{
+    if( domain != LOCAL ) {
+        Resolver::resolve(host, port, domain, type, addresses);
+        return;
+    }
+    /* a path, nothing to look up */
+    Resolver::Address address;
+    memset(&address, 0, sizeof(address));
+    struct sockaddr_un * addr = reinterpret_cast<struct sockaddr_un *>(&address.addr);
+    if( host.size() >= sizeof(addr->sun_path) ) {
+        throw PathTooLong();
+    }
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, host.c_str(), host.size() + 1);
+    address.length = offsetof(struct sockaddr_un, sun_path) + host.size() + 1;
+    addresses.assign(1, address);
+}
 
-void fluent::Socket::connect(const ::std::string& host, int port)
+bool fluent::Socket::start_connect(const ::std::string& host, int port)
 {
-    struct addrinfo * result = nullptr;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = STREAM;
+    resolve(host, port);
+    return start_connect();
+}
+
+bool fluent::Socket::try_resolve(const ::std::string& host, int port)
+{
+    if( domain != LOCAL ) {
+        return Resolver::try_resolve(host, port, domain, type, addresses);
+    }
+    resolve(host, port);
+    return true;
+}
+
+bool fluent::Socket::start_connect()
+{
+    next_address = 0;
+    return connect_next();
+}
 
-    int retval = getaddrinfo(host.c_str(), itoa(port).c_str(), &hints, &result);
+/* 0 once connected, otherwise the errno of the attempt */
+int fluent::Socket::connect_address(const Resolver::Address& address)
+{
+    const struct sockaddr * addr = reinterpret_cast<const struct sockaddr *>(&address.addr);
+    if( nonblocking || background || connect_timeout < 0 ) {
+        if( ::connect(fd, addr, address.length) < 0 ) {
+            return errno;
+        }
+        return 0;
+    }
 
-    if( retval != 0 ) {
-        throw AddressResolutionError(retval);
+    /* blocking, but bounded by connect_timeout */
+    int flags = fcntl(fd, F_GETFL, 0);
+    if( flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ) {
+        return errno;
+    }
+    int err = 0;
+    if( ::connect(fd, addr, address.length) < 0 ) {
+        err = errno;
+    }
+    if( err == EINPROGRESS ) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        int ready;
+        do {
+            ready = poll(&pfd, 1, static_cast<int>(connect_timeout * 1000));
+        } while( ready < 0 && errno == EINTR );
+        if( ready < 0 ) {
+            err = errno;
+        }
+        else if( ready == 0 ) {
+            err = ETIMEDOUT;
+        }
+        else {
+            socklen_t length = sizeof(err);
+            if( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &length) < 0 ) {
+                err = errno;
+            }
+        }
     }
-    
-    if( !result ) {
-        /* TODO throw some kind of exception */
-        throw ::std::runtime_error("(Internal socket error) "
-                "getaddrinfo(...) didn't return an error, but the result is NULL");
+    if( fcntl(fd, F_SETFL, flags) < 0 && !err ) {
+        err = errno;
     }
-    
-    retval = ::connect(fd, result->ai_addr, result->ai_addrlen);
-    
-    if( result ) {
-        freeaddrinfo(result);
+    return err;
+}
+
+bool fluent::Socket::connect_next()
+{
+    int err = 0;
+    int closing = fd;
+    while( next_address < addresses.size() ) {
+        if( fd < 0 ) {
+            open();
+        }
+        err = connect_address(addresses[next_address++]);
+        if( !err ) {
+            connected = true;
+            return true;
+        }
+        if( err == EINPROGRESS && (nonblocking || background) ) {
+            /* finish_connect() once the socket turns writable */
+            return false;
+        }
+        if( err == EINPROGRESS ) {
+            /* SO_SNDTIMEO ran out on a blocking connect */
+            err = ETIMEDOUT;
+        }
+        /* a socket whose connect failed is in an unspecified state;
+         * start from a fresh one for the next address */
+        closing = fd;
+        ::close(fd);
+        fd = -1;
     }
+    background = false;
+    throw_connect_error(err, closing, domain == LOCAL);
+    return false;
+}
 
-    if( retval < 0 ) {
-        /* TODO these are different for UNIX domain sockets */
-        switch( errno ) {
-            case EACCES:
-                throw NoBroadcastOption();
-                break;
-            case EADDRINUSE:
-                throw AddressInUse();
-                break;
-            case EADDRNOTAVAIL:
-                throw AddressNotAvailable();
-                break;
-            case EAFNOSUPPORT:
-                throw AFNotSupported();
-                break;
-            case EALREADY:
-                throw AlreadyConnecting();
-                break;
-            case EBADF:
-                throw BadFileDescriptor(fd);
-                break;
-            case ECONNREFUSED:
-                throw ConnectionRefused();
-                break;
-            case EFAULT:
-                throw InvalidPointer();
-                break;
-            case EHOSTUNREACH:
-                throw HostUnreachable();
-                break;
-            case EINPROGRESS:
-                throw NotCompletedYet();
-                break;
-            case EINTR:
-                throw InterruptedOperation();
-                break;
-            case EINVAL:
-                throw InvalidArgs();
-                break;
-            case EISCONN:
-                throw Connected();
-                break;
-            case ENETDOWN:
-                throw NetworkDown();
-                break;
-            case ENETUNREACH:
-                throw NetworkUnreachable();
-                break;
-            case ENOBUFS:
-                throw NoBuffers();
-                break;
-            case ENOTSOCK:
-                throw NotASocket(fd);
-                break;
-            case EOPNOTSUPP:
-                throw ListeningSocket();
-                break;
-            case EPROTOTYPE:
-                throw WrongAddressType();
-                break;
-            case ETIMEDOUT:
-                throw TimedOut();
-                break;
-            case ECONNRESET:
-                throw ConnectionReset();
-                break;
-            default:
-                throw ErrnoException(errno, "Unknown error occured.  "
-                        "This may be because this is a UNIX domain socket "
-                        "that returns extra error codes.");
+bool fluent::Socket::finish_connect()
+{
+    int err = 0;
+    socklen_t length = sizeof(err);
+    if( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &length) < 0 ) {
+        err = errno;
+    }
+    if( err ) {
+        int closing = fd;
+        ::close(fd);
+        fd = -1;
+        if( next_address < addresses.size() ) {
+            return connect_next();
         }
+        background = false;
+        throw_connect_error(err, closing, domain == LOCAL);
     }
     connected = true;
+    if( background ) {
+        background = false;
+        if( !nonblocking ) {
+            set_flag(fd, O_NONBLOCK, false);
+        }
+    }
+    return true;
+}
+
+bool fluent::Socket::start_background_connect(const ::std::string& host, int port)
+{
+    resolve(host, port);
+    next_address = 0;
+    background = true;
+    if( !connect_next() ) {
+        return false;
+    }
+    /* connected at once */
+    background = false;
+    if( !nonblocking ) {
+        set_flag(fd, O_NONBLOCK, false);
+    }
+    return true;
+}
+
+bool fluent::Socket::poll_connect(float wait)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if( poll(&pfd, 1, wait > 0 ? static_cast<int>(wait * 1000) : 0) <= 0 ) {
+        return false;
+    }
+    return finish_connect();
+}
+
+static void throw_send_error(int err, int fd)
+{
+    switch( err ) {
+        case EACCES:
+            throw ::fluent::Socket::NoBroadcastOption();
+            break;
+        case EAGAIN:
+            throw ::fluent::Socket::WouldBlock();
+            break;
+        case EBADF:
+            throw ::fluent::Socket::BadFileDescriptor(fd);
+            break;
+        case ECONNRESET:
+            throw ::fluent::Socket::ConnectionReset();
+            break;
+        case EFAULT:
+            throw ::fluent::Socket::InvalidPointer();
+            break;
+        case EHOSTUNREACH:
+            throw ::fluent::Socket::HostUnreachable();
+            break;
+        case EINTR:
+            throw ::fluent::InterruptedOperation();
+            break;
+        case EMSGSIZE:
+            throw ::fluent::Socket::BadMessageSize();
+            break;
+        case ENETDOWN:
+            throw ::fluent::Socket::NetworkDown();
+            break;
+        case ENETUNREACH:
+            throw ::fluent::Socket::NetworkUnreachable();
+            break;
+        case ENOBUFS:
+            throw ::fluent::Socket::NoBuffers();
+            break;
+        case ENOTSOCK:
+            throw ::fluent::Socket::NotASocket(fd);
+            break;
+        case EOPNOTSUPP:
+            throw ::fluent::Socket::BadOptions();
+            break;
+        case EPIPE:
+            throw ::fluent::Socket::NotWritable();
+            break;
+        default:
+            throw ::fluent::ErrnoException(err, "Unknown error occured");
+    }
 }
 
 void fluent::Socket::send(const char * data, size_t length)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(data);
+    iov.iov_len = length;
+    sendv(&iov, 1);
+}
+
+void fluent::Socket::sendv(struct iovec * iov, size_t count, bool pinned)
 {
     if( !connected ) {
         throw NotConnected();
         return;
     }
-    ssize_t retval = ::send(fd, data, length, 0);
-    if( retval < 0 ) {
-        switch( errno ) {
-            case EACCES:
-                throw NoBroadcastOption();
+
+    size_t total = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        total += iov[i].iov_len;
+    }
+    int flags = SEND_FLAGS | zerocopy_flag(pinned, total);
+
+#ifdef TCP_CORK
+    bool corked = cork && domain != LOCAL && set_int_option(fd, IPPROTO_TCP, TCP_CORK, 1);
+#endif
+
+    while( count ) {
+        /* skip buffers that are already written (or were empty) */
+        if( !iov->iov_len ) {
+            ++iov;
+            --count;
+            continue;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count < IOV_MAX ? count : IOV_MAX;
+
+        ssize_t retval = ::sendmsg(fd, &msg, flags);
+        if( retval < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+#ifdef FLUENT_HAVE_ZEROCOPY
+            if( errno == ENOBUFS && (flags & MSG_ZEROCOPY) ) {
+                /* out of optmem for pinned pages; copy this one instead */
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+#endif
+            throw_send_error(errno, fd);
+        }
+        count_zerocopy(flags);
+
+        advance(iov, count, retval);
+    }
+
+#ifdef TCP_CORK
+    if( corked ) {
+        /* uncorking pushes out the partial last segment */
+        set_int_option(fd, IPPROTO_TCP, TCP_CORK, 0);
+    }
+#endif
+}
+
+size_t fluent::Socket::try_sendv(struct iovec * iov, size_t count, bool pinned)
+{
+    if( !connected ) {
+        throw NotConnected();
+    }
+
+    size_t length = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        length += iov[i].iov_len;
+    }
+    int flags = SEND_FLAGS | zerocopy_flag(pinned, length);
+
+    size_t total = 0;
+    while( count ) {
+        if( !iov->iov_len ) {
+            ++iov;
+            --count;
+            continue;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count < IOV_MAX ? count : IOV_MAX;
+
+        ssize_t retval = ::sendmsg(fd, &msg, flags);
+        if( retval < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
                 break;
+            }
+#ifdef FLUENT_HAVE_ZEROCOPY
+            if( errno == ENOBUFS && (flags & MSG_ZEROCOPY) ) {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+#endif
+            throw_send_error(errno, fd);
+        }
+        count_zerocopy(flags);
+        total += retval;
+        advance(iov, count, retval);
+    }
+    return total;
+}
+
+size_t fluent::Socket::try_send(const char * data, size_t length)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(data);
+    iov.iov_len = length;
+    return try_sendv(&iov, 1);
+}
+
+size_t fluent::Socket::recv_some(char * data, size_t length)
+{
+    if( !connected ) {
+        throw NotConnected();
+    }
+    for(;;) {
+        ssize_t retval = ::recv(fd, data, length, 0);
+        if( retval > 0 ) {
+            return retval;
+        }
+        if( retval == 0 ) {
+            throw Closed();
+        }
+        switch( errno ) {
+            case EINTR:
+                continue;
             case EAGAIN:
-                throw WouldBlock();
-                break;
-            case EBADF:
-                throw BadFileDescriptor(fd);
-                break;
+#if EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+                return 0;
             case ECONNRESET:
                 throw ConnectionReset();
                 break;
-            case EFAULT:
-                throw InvalidPointer();
-                break;
-            case EHOSTUNREACH:
-                throw HostUnreachable();
-                break;
-            case EINTR:
-                throw InterruptedOperation();
-                break;
-            case EMSGSIZE:
-                throw BadMessageSize();
-                break;
-            case ENETDOWN:
-                throw NetworkDown();
-                break;
-            case ENETUNREACH:
-                throw NetworkUnreachable();
-                break;
-            case ENOBUFS:
-                throw NoBuffers();
-                break;
-            case ENOTSOCK:
-                throw NotASocket(fd);
+            case ETIMEDOUT:
+                throw TimedOut();
                 break;
-            case EOPNOTSUPP:
-                throw BadOptions();
+            case EBADF:
+                throw BadFileDescriptor(fd);
                 break;
-            case EPIPE:
-                throw NotWritable();
+            case ENOTCONN:
+                throw NotConnected();
                 break;
             default:
-                break;
+                throw ErrnoException(errno, "Unknown error occured");
+        }
+    }
+}
+
+void fluent::Socket::set_nonblocking(bool on)
+{
+    nonblocking = on;
+    if( fd < 0 || background ) {
+        /* applied when the socket is reopened, or connected */
+        return;
+    }
+    set_flag(fd, O_NONBLOCK, on);
+}
+
+long fluent::Socket::outstanding() const
+{
+#ifdef SIOCOUTQ
+    int bytes = 0;
+    if( fd >= 0 && ioctl(fd, SIOCOUTQ, &bytes) == 0 ) {
+        return bytes;
+    }
+#endif
+    return -1;
+}
+
+bool fluent::Socket::set_zerocopy(size_t threshold)
+{
+#ifdef FLUENT_HAVE_ZEROCOPY
+    zerocopy = threshold;
+    if( fd >= 0 && threshold ) {
+        int on = 1;
+        if( setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0 ) {
+            zerocopy = 0;
+            return false;
+        }
+    }
+    return true;
+#else
+    (void)threshold;
+    return false;
+#endif
+}
+
+bool fluent::Socket::set_nodelay(bool on)
+{
+    nodelay = on;
+    if( domain == LOCAL ) {
+        return !on;
+    }
+    return fd < 0 || set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, on);
+}
+
+bool fluent::Socket::set_cork(bool on)
+{
+#ifdef TCP_CORK
+    cork = on;
+    return !on || domain != LOCAL;
+#else
+    return !on;
+#endif
+}
+
+bool fluent::Socket::set_send_buffer(int bytes)
+{
+    send_buffer = bytes;
+    return fd < 0 || bytes <= 0 || set_int_option(fd, SOL_SOCKET, SO_SNDBUF, bytes);
+}
+
+int fluent::Socket::zerocopy_flag(bool pinned, size_t length) const
+{
+#ifdef FLUENT_HAVE_ZEROCOPY
+    if( pinned && zerocopy && length >= zerocopy ) {
+        return MSG_ZEROCOPY;
+    }
+#else
+    (void)pinned;
+    (void)length;
+#endif
+    return 0;
+}
+
+void fluent::Socket::count_zerocopy(int flags)
+{
+#ifdef FLUENT_HAVE_ZEROCOPY
+    /* the kernel numbers each sendmsg that sent something */
+    if( flags & MSG_ZEROCOPY ) {
+        ++zerocopy_sent;
+    }
+#else
+    (void)flags;
+#endif
+}
+
+/* MSG_ZEROCOPY sends keep referencing the caller's pages until the kernel
+ * reports them done on the socket's error queue.  Reads what is there
+ * without waiting for more. */
+uint32_t fluent::Socket::reap_zerocopy()
+{
+#ifdef FLUENT_HAVE_ZEROCOPY
+    while( fd >= 0 && zerocopy_done != zerocopy_sent ) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if( ::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            /* EAGAIN: nothing more yet */
+            break;
+        }
+        for( struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ) {
+            bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if( !recverr ) {
+                continue;
+            }
+            struct sock_extended_err * serr =
+                reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cm));
+            if( serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+                continue;
+            }
+            /* [ee_info, ee_data] is the range of completed sends, counted
+             * from 0 on this descriptor */
+            zerocopy_done = zerocopy_base + serr->ee_data + 1;
+        }
+    }
+#endif
+    return zerocopy_done;
+}
+
+/* Waits, up to the send timeout or a second, for the sends still
+ * referencing pinned pages; true once there are none. */
+bool fluent::Socket::wait_zerocopy()
+{
+#ifdef FLUENT_HAVE_ZEROCOPY
+    int wait_ms = timeout > 0 ? static_cast<int>(timeout * 1000) : 1000;
+    while( reap_zerocopy() != zerocopy_sent ) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = 0;
+        int ready = poll(&pfd, 1, wait_ms);
+        if( ready < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( ready <= 0 ) {
+            return false;
         }
     }
+#endif
+    return true;
+}
+
+void fluent::Socket::abort()
+{
+    if( fd >= 0 && zerocopy_done != zerocopy_sent ) {
+        /* reset rather than let the kernel go on sending from pages the
+         * caller is about to reuse */
+        struct linger reset;
+        reset.l_onoff = 1;
+        reset.l_linger = 0;
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        /* so close() does not wait for them */
+        zerocopy_done = zerocopy_sent;
+    }
+    close();
 }
 
 void fluent::Socket::close()
 {
-    if( connected ) {
+    if( fd >= 0 ) {
+        if( zerocopy_done != zerocopy_sent && !wait_zerocopy() ) {
+            /* the peer stopped reading; what it has not had is dropped */
+            struct linger reset;
+            reset.l_onoff = 1;
+            reset.l_linger = 0;
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        }
+        int closing = fd;
         int retval = ::close(fd);
+        fd = -1;
+        connected = false;
+        background = false;
+        /* the pages are free now, and the next descriptor counts from 0 */
+        zerocopy_done = zerocopy_base = zerocopy_sent;
         if( retval < 0 ) {
             switch( errno ) {
                 case EBADF:
-                    throw BadFileDescriptor(fd);
+                    throw BadFileDescriptor(closing);
                     break;
                 case EINTR:
                     throw InterruptedOperation();
@@ -283,6 +864,5 @@ void fluent::Socket::close()
                     throw ErrnoException(errno, "Unknown error occured");
             }
         }
-        connected = false;
     }
 }
@@ -0,0 +1,328 @@
+#include <algorithm>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "socket.h"
+#include "spool.h"
+
+static const char SPOOL_MAGIC[8] = { 'F', 'L', 'S', 'P', 'O', 'O', 'L', '2' };
+/* where the read position is kept in a segment's header */
+static const size_t POSITION_OFFSET = sizeof(SPOOL_MAGIC);
+
+fluent::Spool::Spool(const std::string& d, size_t seg_size, size_t max_segs)
+    : dir(d), segment_size(seg_size), max_segments(max_segs), segments(),
+        next_seq(0), writing(), reading(), units(0), bytes(0), dropped(0)
+{
+    if( segment_size < header_size + 64 || max_segments < 1 ) {
+        throw ::std::invalid_argument("Spool segments are too small.");
+    }
+    recover();
+}
+
+fluent::Spool::~Spool()
+{
+    /* whatever is left stays on disk for the next Spool on this dir */
+    close_reading();
+    close_writing();
+}
+
+std::string fluent::Spool::path(uint64_t seq) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "fluent-%016llx.spool", static_cast<unsigned long long>(seq));
+    return dir + "/" + name;
+}
+
+bool fluent::Spool::next_frame(const Segment& seg, size_t pos, uint32_t& length)
+{
+    if( pos + sizeof(length) > seg.size ) {
+        return false;
+    }
+    memcpy(&length, seg.map + pos, sizeof(length));
+    /* segments start out zeroed, so a 0 length is the end of the data */
+    return length && pos + sizeof(length) + length <= seg.size;
+}
+
+/* The offset of the first frame not yet consumed.  Only an offset that
+ * is a frame boundary is believed; anything else reads from the start. */
+size_t fluent::Spool::read_position(const Segment& seg)
+{
+    uint64_t stored;
+    memcpy(&stored, seg.map + POSITION_OFFSET, sizeof(stored));
+    size_t pos = header_size;
+    uint32_t length;
+    while( pos < stored && next_frame(seg, pos, length) ) {
+        pos += sizeof(length) + length;
+    }
+    return pos == stored ? pos : header_size;
+}
+
+void fluent::Spool::recover()
+{
+    DIR * d = opendir(dir.c_str());
+    if( !d ) {
+        throw ErrnoException(errno, "Could not open the spool directory");
+    }
+    std::vector<uint64_t> found;
+    struct dirent * entry;
+    while( (entry = readdir(d)) != NULL ) {
+        unsigned long long seq;
+        char tail[8];
+        if( strlen(entry->d_name) == 29 &&
+                sscanf(entry->d_name, "fluent-%16llx%7s", &seq, tail) == 2 &&
+                strcmp(tail, ".spool") == 0 ) {
+            found.push_back(seq);
+        }
+    }
+    closedir(d);
+    std::sort(found.begin(), found.end());
+    if( !found.empty() ) {
+        /* past every name on disk, even one that cannot be read below,
+         * so open_writing() never truncates a segment it did not make */
+        next_seq = found.back() + 1;
+    }
+
+    for( size_t i = 0; i < found.size(); ++i ) {
+        Segment seg;
+        seg.seq = found[i];
+        seg.fd = ::open(path(seg.seq).c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if( seg.fd < 0 || fstat(seg.fd, &st) < 0 || static_cast<size_t>(st.st_size) < header_size ) {
+            if( seg.fd >= 0 ) {
+                ::close(seg.fd);
+            }
+            continue;
+        }
+        seg.size = st.st_size;
+        void * map = mmap(NULL, seg.size, PROT_READ, MAP_SHARED, seg.fd, 0);
+        ::close(seg.fd);
+        if( map == MAP_FAILED ) {
+            continue;
+        }
+        seg.map = static_cast<char *>(map);
+        size_t found_units = 0;
+        if( memcmp(seg.map, SPOOL_MAGIC, sizeof(SPOOL_MAGIC)) == 0 ) {
+            size_t pos = read_position(seg);
+            uint32_t length;
+            while( next_frame(seg, pos, length) ) {
+                pos += sizeof(length) + length;
+                ++found_units;
+                bytes += length;
+            }
+        }
+        munmap(seg.map, seg.size);
+        if( found_units ) {
+            units += found_units;
+            segments.push_back(seg.seq);
+        }
+        else {
+            /* delivered already, or not a segment we can read */
+            unlink(path(seg.seq).c_str());
+        }
+    }
+}
+
+bool fluent::Spool::open_writing()
+{
+    if( segments.size() >= max_segments ) {
+        return false;
+    }
+    uint64_t seq = next_seq;
+    std::string name = path(seq);
+    int fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if( fd < 0 ) {
+        return false;
+    }
+#ifdef __linux__
+    /* reserve the blocks now: running out of disk under a mapping would
+     * be a SIGBUS instead of an error */
+    bool sized = posix_fallocate(fd, 0, segment_size) == 0;
+#else
+    bool sized = ftruncate(fd, segment_size) == 0;
+#endif
+    void * map = sized ? mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if( map == MAP_FAILED ) {
+        ::close(fd);
+        unlink(name.c_str());
+        return false;
+    }
+    madvise(map, segment_size, MADV_SEQUENTIAL);
+    /* the read position is left 0, which means the first frame */
+    memcpy(map, SPOOL_MAGIC, sizeof(SPOOL_MAGIC));
+
+    ++next_seq;
+    writing.seq = seq;
+    writing.fd = fd;
+    writing.map = static_cast<char *>(map);
+    writing.size = segment_size;
+    writing.pos = header_size;
+    segments.push_back(seq);
+    return true;
+}
+
+void fluent::Spool::close_writing()
+{
+    if( writing.map ) {
+        munmap(writing.map, writing.size);
+        ::close(writing.fd);
+        writing = Segment();
+    }
+}
+
+void fluent::Spool::open_reading()
+{
+    if( reading.map ) {
+        return;
+    }
+    uint64_t seq = segments.front();
+    /* writable, to keep the read position up to date */
+    int fd = ::open(path(seq).c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if( fd < 0 || fstat(fd, &st) < 0 ) {
+        int err = errno;
+        if( fd >= 0 ) {
+            ::close(fd);
+        }
+        throw ErrnoException(err, "Could not open a spool segment");
+    }
+    void * map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if( map == MAP_FAILED ) {
+        int err = errno;
+        ::close(fd);
+        throw ErrnoException(err, "Could not map a spool segment");
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    reading.seq = seq;
+    reading.fd = fd;
+    reading.map = static_cast<char *>(map);
+    reading.size = st.st_size;
+    reading.pos = read_position(reading);
+}
+
+void fluent::Spool::close_reading()
+{
+    if( reading.map ) {
+        munmap(reading.map, reading.size);
+        ::close(reading.fd);
+        reading = Segment();
+    }
+}
+
+void fluent::Spool::drop_oldest()
+{
+    close_reading();
+    if( writing.map && writing.seq == segments.front() ) {
+        close_writing();
+    }
+    unlink(path(segments.front()).c_str());
+    segments.pop_front();
+}
+
+bool fluent::Spool::append(const struct iovec * iov, size_t count)
+{
+    size_t total = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        total += iov[i].iov_len;
+    }
+    if( !total ) {
+        return true;
+    }
+    if( sizeof(uint32_t) + total > segment_size - header_size ) {
+        ++dropped;
+        return false;
+    }
+    if( !writing.map || writing.pos + sizeof(uint32_t) + total > writing.size ) {
+        close_writing();
+        if( !open_writing() ) {
+            ++dropped;
+            return false;
+        }
+    }
+    /* the body first, then the length that makes the frame visible */
+    char * p = writing.map + writing.pos + sizeof(uint32_t);
+    for( size_t i = 0; i < count; ++i ) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    uint32_t length = total;
+    memcpy(writing.map + writing.pos, &length, sizeof(length));
+    writing.pos += sizeof(length) + total;
+    ++units;
+    bytes += total;
+    return true;
+}
+
+bool fluent::Spool::append(const char * data, size_t length)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(data);
+    iov.iov_len = length;
+    return append(&iov, 1);
+}
+
+size_t fluent::Spool::peek(std::vector<struct iovec>& out, size_t max_bytes)
+{
+    size_t n = 0;
+    size_t total = 0;
+    while( n < units ) {
+        open_reading();
+        size_t pos = reading.pos;
+        uint32_t length;
+        while( n < units && next_frame(reading, pos, length) ) {
+            if( n && total + length > max_bytes ) {
+                return n;
+            }
+            struct iovec iov;
+            iov.iov_base = reading.map + pos + sizeof(length);
+            iov.iov_len = length;
+            out.push_back(iov);
+            pos += sizeof(length) + length;
+            total += length;
+            ++n;
+        }
+        /* buffers already handed out point into this segment, so only a
+         * segment that is read through and yielded nothing can go */
+        if( n || (writing.map && writing.seq == reading.seq) ) {
+            break;
+        }
+        drop_oldest();
+    }
+    return n;
+}
+
+void fluent::Spool::consume(size_t n)
+{
+    while( n && units ) {
+        open_reading();
+        uint32_t length;
+        if( !next_frame(reading, reading.pos, length) ) {
+            if( writing.map && writing.seq == reading.seq ) {
+                break;
+            }
+            drop_oldest();
+            continue;
+        }
+        reading.pos += sizeof(length) + length;
+        --units;
+        bytes -= length;
+        --n;
+    }
+    if( reading.map ) {
+        /* in the page cache at once, so it survives the process */
+        uint64_t pos = reading.pos;
+        memcpy(reading.map + POSITION_OFFSET, &pos, sizeof(pos));
+    }
+    if( !units ) {
+        /* caught up: give all the disk back */
+        while( !segments.empty() ) {
+            drop_oldest();
+        }
+    }
+}
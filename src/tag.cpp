@@ -0,0 +1,103 @@
+#include <msgpack.hpp>
+
+#include "tag.h"
+
+fluent::TagEntry::TagEntry(const std::string& l, const std::string& n)
+    : label(l), name(n), packed(), next(nullptr), limiter(nullptr)
+{
+    ::msgpack::sbuffer sbuf(name.size() + 5);
+    ::msgpack::packer< ::msgpack::sbuffer> packer(sbuf);
+    packer.pack_str(name.size());
+    packer.pack_str_body(name.data(), name.size());
+    packed.assign(sbuf.data(), sbuf.size());
+}
+
+fluent::TagCache::TagCache()
+    : overflow(nullptr), hasher()
+{
+    for( size_t i = 0; i < capacity; ++i ) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+fluent::TagCache::~TagCache()
+{
+    for( size_t i = 0; i < capacity; ++i ) {
+        delete slots[i].load(std::memory_order_relaxed);
+    }
+    TagEntry * entry = overflow.load(std::memory_order_relaxed);
+    while( entry ) {
+        TagEntry * next = entry->next;
+        delete entry;
+        entry = next;
+    }
+}
+
+/* Looks for label in the overflow list from entry down to stop. */
+static const fluent::TagEntry * find(const fluent::TagEntry * entry, const fluent::TagEntry * stop,
+        const std::string& label)
+{
+    for( ; entry != stop; entry = entry->next ) {
+        if( entry->label == label ) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+const fluent::TagEntry * fluent::TagCache::lookup(const std::string& label) const
+{
+    size_t start = hasher(label) % capacity;
+    for( size_t i = 0; i < capacity; ++i ) {
+        const TagEntry * entry = slots[(start + i) % capacity].load(std::memory_order_acquire);
+        if( !entry ) {
+            return nullptr;
+        }
+        if( entry->label == label ) {
+            return entry;
+        }
+    }
+    return find(overflow.load(std::memory_order_acquire), nullptr, label);
+}
+
+const fluent::TagEntry * fluent::TagCache::insert(TagEntry * entry, bool keep)
+{
+    size_t start = hasher(entry->label) % capacity;
+    for( size_t i = 0; i < capacity; ++i ) {
+        std::atomic<TagEntry *>& slot = slots[(start + i) % capacity];
+        TagEntry * current = slot.load(std::memory_order_acquire);
+        if( !current ) {
+            if( slot.compare_exchange_strong(current, entry,
+                        std::memory_order_release, std::memory_order_acquire) ) {
+                return entry;
+            }
+            /* lost the slot; current is whoever won it */
+        }
+        if( current->label == entry->label ) {
+            delete entry;
+            return current;
+        }
+    }
+
+    TagEntry * head = overflow.load(std::memory_order_acquire);
+    const TagEntry * found = find(head, nullptr, entry->label);
+    if( found || !keep ) {
+        delete entry;
+        return found;
+    }
+    /* at most one entry per label, so the list only grows with new labels:
+     * whatever was pushed since the last look is checked before retrying */
+    for(;;) {
+        entry->next = head;
+        TagEntry * seen = head;
+        if( overflow.compare_exchange_weak(head, entry,
+                    std::memory_order_release, std::memory_order_acquire) ) {
+            return entry;
+        }
+        found = find(head, seen, entry->label);
+        if( found ) {
+            delete entry;
+            return found;
+        }
+    }
+}
@@ -1,7 +1,33 @@
 #include "fluent_cpp.h"
+#include <iostream>
 #include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
 using namespace fluent;
 
+typedef Schema<FLUENT_KEY("from"), FLUENT_KEY("to"), FLUENT_KEY("size")> Transfer;
+
+#ifdef FLUENT_MT
+static void * log_from_thread(void * arg)
+{
+    static_cast<BasicLogger<SenderPool> *>(arg)->log("", "from", "userC", "to", "userD");
+    return NULL;
+}
+#endif
+
+static size_t drops = 0;
+
+static void count_drop(const struct iovec *, size_t, void *)
+{
+    ++drops;
+}
+
+static bool has(const ::std::string& mode, const char * flag)
+{
+    return mode.find(flag) != ::std::string::npos;
+}
+
 int main(int argc, const char * argv[])
 {
     int port = 24224;
@@ -10,8 +36,276 @@ int main(int argc, const char * argv[])
         strm << argv[1];
         strm >> port;
     }
+    ::std::string mode;
+    if( argc > 2 ) {
+        mode = argv[2];
+    }
 
-    Logger logger("fluent.test", "0.0.0.0", port);
+#ifdef FLUENT_MT
+    /* declared first so it outlives the loggers attached to it */
+    EventLoop loop;
+#endif
+    ::std::string host("0.0.0.0");
+    if( has(mode, "unix") && argc > 3 ) {
+        host = ::std::string("unix://") + argv[3];
+    }
+    Logger logger("fluent.test", host, port);
+    if( has(mode, "failover") && argc > 3 ) {
+        /* port refuses connections; argv[3] takes the records */
+        int live = 0;
+        ::std::stringstream strm;
+        strm << argv[3];
+        strm >> live;
+        logger.get_sender().add_endpoint("0.0.0.0", live);
+    }
+    bool batching = false;
+    if( has(mode, "gzip") ) {
+        logger.get_sender().set_batching(Batcher::COMPRESSED_PACKED_FORWARD);
+        batching = true;
+    }
+    else if( has(mode, "packed") ) {
+        logger.get_sender().set_batching(Batcher::PACKED_FORWARD);
+        batching = true;
+    }
+    else if( has(mode, "forward") ) {
+        logger.get_sender().set_batching(Batcher::FORWARD);
+        batching = true;
+    }
+    if( has(mode, "adaptive") ) {
+        /* three records in a quiet stream: each goes out on its own */
+        logger.get_sender().set_flush_policy(0, 0.05);
+        logger.get_sender().set_socket_options(true, true);
+        batching = true;
+    }
+    if( has(mode, "cached") ) {
+        logger.use_event_time(Clock::CACHED);
+    }
+    else if( has(mode, "eventtime") ) {
+        logger.use_event_time();
+    }
+#ifdef FLUENT_MT
+    if( has(mode, "require_ack") ) {
+        logger.get_sender().require_ack();
+        batching = true;
+    }
+    if( has(mode, "async") ) {
+        logger.get_sender().start_async();
+    }
+    if( has(mode, "shards") ) {
+        /* two threads, so one record on each shard */
+        BasicLogger<SenderPool> pooled("fluent.pool", 2, "0.0.0.0", port);
+        pthread_t other;
+        pthread_create(&other, NULL, &log_from_thread, &pooled);
+        pthread_join(other, NULL);
+        pooled.log("", "from", "userA", "to", "userB");
+        return 0;
+    }
+    if( has(mode, "shared") ) {
+        Logger second("fluent.second", "0.0.0.0", port);
+        loop.start();
+        logger.get_sender().attach(loop);
+        second.get_sender().attach(loop);
+        logger.log("", "from", "userA", "to", "userB");
+        second.log("", "from", "userC", "to", "userD");
+        return 0;
+    }
+#endif
+    if( has(mode, "storm") ) {
+        /* the aggregator stays down: sends keep retrying it, once the
+         * constructor's failure has backed off, and only the first
+         * failure is written out */
+        logger.get_sender().set_reconnect_backoff(0.001, 0.001);
+        for( int i = 0; i < 2000 && logger.get_sender().get_failures() < 50; ++i ) {
+            logger.log("", "i", i);
+            usleep(1000);
+        }
+        ::std::cout << logger.get_sender().get_failures() << ::std::endl;
+        return 0;
+    }
+    if( has(mode, "spool,full") && argc > 3 ) {
+        {
+            /* one small segment: what does not fit is dropped, and says so */
+            Logger full("fluent.test", host, port, 1024);
+            full.get_sender().set_spool(argv[3], 4096, 1);
+            full.get_sender().set_drop_callback(&count_drop);
+            for( int i = 0; i < 200; ++i ) {
+                try {
+                    full.log("", "i", i);
+                }
+                catch(::std::runtime_error&) {
+                }
+            }
+            /* the backlog still in memory is spooled on the way out */
+        }
+        ::std::cout << drops << ::std::endl;
+        return 0;
+    }
+    if( has(mode, "spool") && argc > 3 ) {
+        logger.get_sender().set_spool(argv[3]);
+        try {
+            logger.log("", "from", "userA", "to", "userB");
+        }
+        catch(::std::runtime_error&) {
+            /* spooled; the next run against argv[3] sends it */
+        }
+        return 0;
+    }
+    if( has(mode, "ring") ) {
+        /* a forked worker logs into the ring; this process sends */
+        ShmRing ring(64 * 1024);
+        pid_t child = fork();
+        if( child == 0 ) {
+            BasicLogger<RingWriter> worker("fluent.test", ring);
+            worker.log("", "from", "userA", "to", "userB");
+            worker.log("", "from", "userC", "to", "userD");
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+        Collector(ring, logger.get_sender()).drain();
+        return 0;
+    }
+    if( has(mode, "levels") ) {
+        /* a disabled level does not even evaluate its arguments */
+        int evaluated = 0;
+        logger.set_level(LEVEL_INFO);
+        FLUENT_DEBUG(logger, "", "from", "debug", "count", ++evaluated);
+        logger.log_at<LEVEL_DEBUG>("", "from", "debug");
+        FLUENT_WARN(logger, "", "from", "userA", "evaluated", evaluated);
+        return 0;
+    }
+    if( has(mode, "limit") ) {
+        Limit one_in_three;
+        one_in_three.sample_every = 3;
+        logger.limit("", one_in_three);
+#ifdef FLUENT_MT
+        if( has(mode, "quiet") ) {
+            logger.set_limit_report("suppressed", 0.2);
+        }
+#endif
+        for( int i = 0; i < 10; ++i ) {
+            logger.log("", "i", i);
+        }
+#ifdef FLUENT_MT
+        if( has(mode, "quiet") ) {
+            /* reported on a timer, though the tag logs nothing more */
+            usleep(500 * 1000);
+            logger.log("other", "i", 10);
+            return 0;
+        }
+        if( has(mode, "exit") ) {
+            /* reported by the destructor, without waiting for the timer */
+            return 0;
+        }
+#endif
+        logger.report_suppressed();
+        return 0;
+    }
+    if( has(mode, "metrics") ) {
+        Metrics metrics("fluent.metric", logger.get_sender());
+#ifdef FLUENT_MT
+        if( has(mode, "interval") ) {
+            /* one record from the flusher, one from the destructor */
+            metrics.start(0.1);
+            metrics.count("requests");
+            usleep(250 * 1000);
+            metrics.count("requests");
+            return 0;
+        }
+#endif
+        for( int i = 1; i <= 100; ++i ) {
+            metrics.count("requests", "GET");
+            metrics.observe("latency", i);
+        }
+        metrics.count("requests", "POST", 5);
+        metrics.gauge("queue", 7);
+        metrics.flush();
+        return 0;
+    }
+    if( has(mode, "dedup") ) {
+#ifdef FLUENT_MT
+        bool quiet = has(mode, "quiet");
+#else
+        bool quiet = false;
+#endif
+        logger.set_dedup(quiet ? 0.2 : 60);
+        for( int i = 0; i < 5; ++i ) {
+            logger.log("", "from", "userA", "to", "userB");
+        }
+        logger.log("", "from", "userC", "to", "userD");
+        if( quiet ) {
+            /* the run ends on a timer, though nothing more is logged */
+            usleep(500 * 1000);
+            logger.log("other", "from", "userE");
+            return 0;
+        }
+#ifdef FLUENT_MT
+        if( has(mode, "exit") ) {
+            /* sent by the destructor, without waiting out the window */
+            return 0;
+        }
+#endif
+        logger.flush_repeats();
+        return 0;
+    }
+    if( has(mode, "deferred,wrap") ) {
+        /* the smallest ring, drained by hand, so records of all sizes
+         * wrap around it many times */
+        DeferredLogger deferred("fluent.test", logger.get_sender(), 4096);
+        for( int i = 0; i < 500; ++i ) {
+            FLUENT_DEFER(deferred, "", "i", i, "pad", ::std::string(i % 97, 'x'));
+            if( i % 5 == 4 ) {
+                deferred.drain();
+            }
+        }
+        deferred.drain();
+        /* then the ring fills up: what does not fit is counted */
+        int sent = 0;
+        for( int i = 0; i < 200; ++i ) {
+            if( deferred.log("full", "i", i) ) {
+                ++sent;
+            }
+        }
+        deferred.drain();
+        bool rejected = false;
+#ifdef FLUENT_MT
+        /* the flusher is the rings' only reader while it runs */
+        deferred.start();
+        try {
+            deferred.drain();
+        }
+        catch(::std::logic_error&) {
+            rejected = true;
+        }
+        deferred.stop();
+#endif
+        logger.log("summary", "sent", sent, "dropped", deferred.get_dropped(), "rejected", rejected);
+        return 0;
+    }
+    if( has(mode, "deferred") ) {
+        /* packed and sent by the flusher, after log() returns */
+        DeferredLogger deferred("fluent.test", logger.get_sender());
+#ifdef FLUENT_MT
+        deferred.start();
+#endif
+        deferred.log("", "from", "userA", "to", ::std::string("userB"), "size", 1024);
+        return 0;
+    }
+    if( has(mode, "schema") ) {
+        logger.log_record<Transfer>(logger.tag(""), "userA", ::std::string("userB"), 1024);
+        return 0;
+    }
     logger.log("", "from", "userA", "to", "userB");
+    if( batching ) {
+        logger.log("", "from", "userC", "to", "userD");
+        Tag other = logger.tag("other");
+        logger.log(other, "from", "userE", "to", "userF");
+    }
+#ifdef FLUENT_MT
+    if( has(mode, "require_ack") ) {
+        /* let the loop send and collect the acks before shutting down */
+        logger.get_sender().flush();
+        usleep(200 * 1000);
+    }
+#endif
     return 0;
 }
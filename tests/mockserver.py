@@ -1,6 +1,7 @@
+import gzip
+import msgpack
 import socket
 import threading
-import time
 from msgpack import Unpacker
 
 try:
@@ -8,37 +9,149 @@ try:
 except ImportError:
     from io import BytesIO
 
+# Seconds a server waits for a connection, or for the rest of the data.
+TIMEOUT = 30
+
+
+def make_unpacker(file_like=None):
+    """An Unpacker decoding strings as UTF-8, whatever the msgpack version."""
+    try:
+        return Unpacker(file_like, raw=False)
+    except TypeError:
+        return Unpacker(file_like, encoding='utf-8')
+
+
 class MockRecvServer(threading.Thread):
     """
-    Single threaded server accepts one connection and recv until EOF.
+    Single threaded server accepts `connections` connections one after
+    another and recv from each until EOF.
     """
-    def __init__(self, port):
-        self._sock = socket.socket()
-        self._sock.bind(('localhost', port))
+    def __init__(self, port, connections=1):
+        self._connections = connections
+        self._sock = self.make_socket(port)
+        self._sock.settimeout(TIMEOUT)
+        # listening before the client starts, so its connect is not refused
+        self._sock.listen(connections)
         self._buf = BytesIO()
+        self._error = None
 
         threading.Thread.__init__(self)
+        self.daemon = True
         self.start()
 
+    def make_socket(self, port):
+        sock = socket.socket()
+        sock.bind(('localhost', port))
+        return sock
+
     def run(self):
-        s = self._sock
-        s.listen(1)
-        con, _ = s.accept()
+        # a client that never comes (or never finishes) ends the wait
+        # with an error instead of holding up the suite
+        try:
+            s = self._sock
+            for _ in range(self._connections):
+                con, _ = s.accept()
+                con.settimeout(TIMEOUT)
+                try:
+                    self.serve(con)
+                finally:
+                    con.close()
+        except Exception as e:
+            self._error = e
+        finally:
+            self._sock.close()
+
+    def serve(self, con):
         while True:
             d = con.recv(4096)
             if not d:
                 break
             self._buf.write(d)
-        con.close()
-        s.close()
-        self._sock = None
 
     def wait(self):
-        while self._sock:
-            time.sleep(0.1)
+        self.join(TIMEOUT + 1)
+        if self.is_alive():
+            raise AssertionError('the server is still waiting for data')
+        if self._error is not None:
+            raise AssertionError('the server failed: %r' % (self._error,))
 
     def get_recieved(self):
         self.wait()
         self._buf.seek(0)
         # TODO: have to process string encoding properly. currently we assume that all encoding is utf-8.
-        return list(Unpacker(self._buf, encoding='utf-8'))
+        return list(make_unpacker(self._buf))
+
+    def get_events(self):
+        """
+        Received data as a flat list of [tag, time, record] events,
+        expanding Forward and PackedForward mode arrays.
+        """
+        events = []
+        for msg in self.get_recieved():
+            tag, rest = msg[0], msg[1:]
+            if isinstance(rest[0], list):
+                entries = rest[0]
+            elif isinstance(rest[0], (bytes, str)):
+                data = rest[0]
+                if not isinstance(data, bytes):
+                    data = data.encode('utf-8')
+                entries = list(make_unpacker(BytesIO(data)))
+            else:
+                entries = [rest[:2]]
+            for time, record in entries:
+                events.append([tag, time, record])
+        return events
+
+
+class MockUnixRecvServer(MockRecvServer):
+    """
+    MockRecvServer listening on a UNIX domain socket at path.
+    """
+    def make_socket(self, path):
+        sock = socket.socket(socket.AF_UNIX)
+        sock.bind(path)
+        return sock
+
+
+class MockGzipRecvServer(MockRecvServer):
+    """
+    MockRecvServer that inflates CompressedPackedForward entries, so the
+    received messages look like plain PackedForward ones.
+    """
+    def __init__(self, port, connections=1):
+        self.compressed = 0
+        MockRecvServer.__init__(self, port, connections)
+
+    def get_recieved(self):
+        received = []
+        for msg in MockRecvServer.get_recieved(self):
+            if len(msg) == 3 and isinstance(msg[2], dict) and \
+                    msg[2].get('compressed') == 'gzip':
+                self.compressed += 1
+                msg = [msg[0], gzip.GzipFile(fileobj=BytesIO(msg[1])).read()]
+            received.append(msg)
+        return received
+
+
+class MockAckRecvServer(MockRecvServer):
+    """
+    MockRecvServer that answers every message carrying a chunk option
+    with an ack, like fluentd's require_ack_response.
+    """
+    def __init__(self, port, connections=1):
+        self.acked = 0
+        MockRecvServer.__init__(self, port, connections)
+
+    def serve(self, con):
+        unpacker = make_unpacker()
+        while True:
+            d = con.recv(4096)
+            if not d:
+                break
+            self._buf.write(d)
+            unpacker.feed(d)
+            for msg in unpacker:
+                option = msg[-1]
+                if isinstance(option, dict) and 'chunk' in option:
+                    con.sendall(msgpack.packb({'ack': option['chunk']}))
+                    self.acked += 1
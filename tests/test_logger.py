@@ -2,14 +2,27 @@ import unittest
 from tests import mockserver
 import logging
 import msgpack
+import os
+import shutil
+import socket
+import struct
 import subprocess
+import tempfile
+import time
+
+def fluent_test(args):
+    """Runs the test client; one that hangs is killed and fails the test."""
+    return subprocess.call(['./fluent_test'] + args, timeout=mockserver.TIMEOUT)
+
+class ServerTestCase(unittest.TestCase):
+    server_class = mockserver.MockRecvServer
+    connections = 1
 
-class TestLogger(unittest.TestCase):
     def setUp(self):
-        super(TestLogger, self).setUp()
+        super(ServerTestCase, self).setUp()
         for port in range(10000, 20000):
             try:
-                self._server = mockserver.MockRecvServer(port)
+                self._server = self.server_class(port, self.connections)
                 self._port = port
                 break
             except IOError as e:
@@ -18,11 +31,25 @@ class TestLogger(unittest.TestCase):
     def get_data(self):
         return self._server.get_recieved()
 
+class TestLogger(ServerTestCase):
     def test_simple(self):
         print('directory:')
         subprocess.call(['pwd'])
         print('results')
-        subprocess.call(['./fluent_test', str(self._port)])
+        fluent_test([str(self._port)])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(1, len(data))
+        eq(3, len(data[0]))
+        eq('fluent.test', data[0][0])
+        eq('userA', data[0][2]['from'])
+        eq('userB', data[0][2]['to'])
+        self.assertTrue(data[0][1])
+        self.assertTrue(isinstance(data[0][1], int))
+
+    def test_async(self):
+        fluent_test([str(self._port), 'async'])
 
         data = self.get_data()
         eq = self.assertEqual
@@ -31,6 +58,354 @@ class TestLogger(unittest.TestCase):
         eq('fluent.test', data[0][0])
         eq('userA', data[0][2]['from'])
         eq('userB', data[0][2]['to'])
-        self.assert_(data[0][1])
-        self.assert_(isinstance(data[0][1], int))
 
+    def test_schema(self):
+        fluent_test([str(self._port), 'schema'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(1, len(data))
+        eq('fluent.test', data[0][0])
+        eq({'from': 'userA', 'to': 'userB', 'size': 1024}, data[0][2])
+
+    def test_levels(self):
+        fluent_test([str(self._port), 'levels'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(1, len(data))
+        eq({'from': 'userA', 'evaluated': 0}, data[0][2])
+
+    def test_limit(self):
+        fluent_test([str(self._port), 'limit'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(5, len(data))
+        eq([0, 3, 6, 9], [d[2]['i'] for d in data[:4]])
+        eq('fluent.test.suppressed', data[4][0])
+        eq({'tag': 'fluent.test', 'suppressed': 6}, data[4][2])
+
+    def test_limit_report_timer(self):
+        fluent_test([str(self._port), 'limit,quiet'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(6, len(data))
+        eq('fluent.test.suppressed', data[4][0])
+        eq({'tag': 'fluent.test', 'suppressed': 6}, data[4][2])
+        eq('fluent.test.other', data[5][0])
+
+    def test_limit_report_on_exit(self):
+        start = time.time()
+        fluent_test([str(self._port), 'limit,exit'])
+        # the report interval is 10s; the destructor does not wait it out
+        self.assertTrue(time.time() - start < 5)
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(5, len(data))
+        eq('fluent.test.suppressed', data[4][0])
+        eq({'tag': 'fluent.test', 'suppressed': 6}, data[4][2])
+
+    def test_metrics(self):
+        fluent_test([str(self._port), 'metrics'])
+
+        # one record per metric, not per call
+        data = sorted(self.get_data(), key=lambda d: (d[0], d[2].get('dimension', '')))
+        eq = self.assertEqual
+        eq(['fluent.metric.latency', 'fluent.metric.queue',
+            'fluent.metric.requests', 'fluent.metric.requests'], [d[0] for d in data])
+        latency = data[0][2]
+        eq(100, latency['count'])
+        eq(5050, latency['sum'])
+        eq((1, 100), (latency['min'], latency['max']))
+        self.assertTrue(abs(latency['p50'] - 50) <= 2)
+        self.assertTrue(abs(latency['p99'] - 99) <= 3)
+        eq({'gauge': 7}, data[1][2])
+        eq({'dimension': 'GET', 'count': 100}, data[2][2])
+        eq({'dimension': 'POST', 'count': 5}, data[3][2])
+
+    def test_metrics_interval(self):
+        fluent_test([str(self._port), 'metrics,interval'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(['fluent.metric.requests'] * 2, [d[0] for d in data])
+        eq([{'count': 1}] * 2, [d[2] for d in data])
+
+    def test_dedup(self):
+        fluent_test([str(self._port), 'dedup'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(3, len(data))
+        eq({'from': 'userA', 'to': 'userB'}, data[0][2])
+        eq({'from': 'userC', 'to': 'userD'}, data[1][2])
+        eq('fluent.test', data[2][0])
+        eq({'from': 'userA', 'to': 'userB', 'repeat_count': 4}, data[2][2])
+
+    def test_dedup_timer(self):
+        fluent_test([str(self._port), 'dedup,quiet'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(4, len(data))
+        eq({'from': 'userA', 'to': 'userB', 'repeat_count': 4}, data[2][2])
+        eq('fluent.test.other', data[3][0])
+
+    def test_dedup_on_exit(self):
+        start = time.time()
+        fluent_test([str(self._port), 'dedup,exit'])
+        # the window is 60s; the destructor does not wait it out
+        self.assertTrue(time.time() - start < 5)
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(3, len(data))
+        eq({'from': 'userA', 'to': 'userB', 'repeat_count': 4}, data[2][2])
+
+    def test_deferred(self):
+        fluent_test([str(self._port), 'deferred'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(1, len(data))
+        eq('fluent.test', data[0][0])
+        eq({'from': 'userA', 'to': 'userB', 'size': 1024}, data[0][2])
+        self.assertTrue(isinstance(data[0][1], int))
+
+    def test_deferred_wrap(self):
+        fluent_test([str(self._port), 'deferred,wrap'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        wrapped = data[:500]
+        eq([{'i': i, 'pad': 'x' * (i % 97)} for i in range(500)], [d[2] for d in wrapped])
+        summary = data[-1][2]
+        full = data[500:-1]
+        eq(summary['sent'], len(full))
+        eq(200, summary['sent'] + summary['dropped'])
+        self.assertTrue(summary['dropped'] > 0)
+        eq(list(range(summary['sent'])), [d[2]['i'] for d in full])
+        self.assertTrue(summary['rejected'])
+
+    def check_event_time(self, mode):
+        fluent_test([str(self._port), mode])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(1, len(data))
+        eq('userA', data[0][2]['from'])
+        eq(0, data[0][1].code)
+        eq(8, len(data[0][1].data))
+        sec, nsec = struct.unpack('>II', data[0][1].data)
+        self.assertTrue(abs(sec - time.time()) < 60)
+        self.assertTrue(nsec < 1000000000)
+
+    def test_event_time(self):
+        self.check_event_time('eventtime')
+
+    def test_cached_event_time(self):
+        self.check_event_time('cached')
+
+    def check_batched(self, mode):
+        fluent_test([str(self._port), mode])
+
+        data = self._server.get_recieved()
+        eq = self.assertEqual
+        # one array per tag, not one per event
+        eq(2, len(data))
+        eq('fluent.test', data[0][0])
+        eq('fluent.test.other', data[1][0])
+
+        events = self._server.get_events()
+        eq(3, len(events))
+        eq(['userA', 'userC', 'userE'], [e[2]['from'] for e in events])
+        eq(['userB', 'userD', 'userF'], [e[2]['to'] for e in events])
+
+    def test_forward(self):
+        self.check_batched('forward')
+
+    def test_packed_forward(self):
+        self.check_batched('packed')
+
+    def test_async_packed_forward(self):
+        self.check_batched('async,packed')
+
+    def test_adaptive_flush(self):
+        fluent_test([str(self._port), 'adaptive'])
+
+        # sparse records are not held back for a batch
+        data = self._server.get_recieved()
+        eq = self.assertEqual
+        eq(['fluent.test', 'fluent.test', 'fluent.test.other'], [d[0] for d in data])
+        eq([1, 1, 1], [len(d[1]) for d in data])
+
+class TestCompressedLogger(ServerTestCase):
+    server_class = mockserver.MockGzipRecvServer
+
+    def test_compressed_packed_forward(self):
+        fluent_test([str(self._port), 'async,gzip'])
+
+        events = self._server.get_events()
+        eq = self.assertEqual
+        eq(2, self._server.compressed)
+        eq(3, len(events))
+        eq(['fluent.test', 'fluent.test', 'fluent.test.other'], [e[0] for e in events])
+        eq(['userA', 'userC', 'userE'], [e[2]['from'] for e in events])
+
+class TestAck(ServerTestCase):
+    server_class = mockserver.MockAckRecvServer
+
+    def test_ack(self):
+        start = time.time()
+        fluent_test([str(self._port), 'async,require_ack'])
+        # unacknowledged chunks would hold up shutdown by the send timeout
+        self.assertTrue(time.time() - start < 2)
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(2, len(data))
+        eq(2, self._server.acked)
+        for message in data:
+            eq(3, len(message))
+            eq(24, len(message[2]['chunk']))
+        events = self._server.get_events()
+        eq(['userA', 'userC', 'userE'], [e[2]['from'] for e in events])
+
+class TestSharedLoop(ServerTestCase):
+    connections = 2
+
+    def test_shared_loop(self):
+        fluent_test([str(self._port), 'shared'])
+
+        data = sorted(self.get_data(), key=lambda event: event[0])
+        eq = self.assertEqual
+        eq(2, len(data))
+        eq('fluent.second', data[0][0])
+        eq('userC', data[0][2]['from'])
+        eq('fluent.test', data[1][0])
+        eq('userA', data[1][2]['from'])
+
+class TestShmRing(ServerTestCase):
+    def test_ring(self):
+        fluent_test([str(self._port), 'ring'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(2, len(data))
+        eq(['fluent.test', 'fluent.test'], [d[0] for d in data])
+        eq(['userA', 'userC'], [d[2]['from'] for d in data])
+
+class TestSenderPool(ServerTestCase):
+    connections = 3
+
+    def test_pool(self):
+        fluent_test([str(self._port), 'shards'])
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(2, len(data))
+        eq(['fluent.pool', 'fluent.pool'], [d[0] for d in data])
+        eq(['userA', 'userC'], sorted(d[2]['from'] for d in data))
+
+class TestSpool(ServerTestCase):
+    def test_spool(self):
+        spool = tempfile.mkdtemp()
+        try:
+            # bound but not listening, so connecting is refused
+            dead = socket.socket()
+            dead.bind(('localhost', 0))
+            fluent_test([str(dead.getsockname()[1]), 'spool', spool])
+            dead.close()
+            self.assertEqual(1, len(os.listdir(spool)))
+
+            fluent_test([str(self._port), 'spool', spool])
+            data = self.get_data()
+            eq = self.assertEqual
+            eq(2, len(data))
+            eq(['userA', 'userA'], [d[2]['from'] for d in data])
+            eq([], os.listdir(spool))
+        finally:
+            shutil.rmtree(spool)
+
+    def test_spool_full(self):
+        spool = tempfile.mkdtemp()
+        try:
+            dead = socket.socket()
+            dead.bind(('localhost', 0))
+            try:
+                out = subprocess.check_output(
+                        ['./fluent_test', str(dead.getsockname()[1]), 'spool,full', spool],
+                        timeout=mockserver.TIMEOUT)
+            finally:
+                dead.close()
+            drops = int(out)
+            self.assertTrue(drops > 0)
+            self.assertEqual(1, len(os.listdir(spool)))
+
+            # every record was either spooled or reported dropped
+            fluent_test([str(self._port), 'spool', spool])
+            data = self.get_data()
+            self.assertEqual(200 + 1, len(data) + drops)
+        finally:
+            shutil.rmtree(spool)
+
+class TestFailover(ServerTestCase):
+    def check_failover(self, mode):
+        # bound but not listening, so connecting is refused
+        dead = socket.socket()
+        dead.bind(('localhost', 0))
+        try:
+            fluent_test([str(dead.getsockname()[1]), mode, str(self._port)])
+        finally:
+            dead.close()
+
+        data = self.get_data()
+        eq = self.assertEqual
+        eq(1, len(data))
+        eq('userA', data[0][2]['from'])
+
+    def test_failover(self):
+        self.check_failover('failover')
+
+    def test_async_failover(self):
+        self.check_failover('failover async')
+
+class TestReconnectStorm(unittest.TestCase):
+    def check_storm(self, mode):
+        # bound but not listening, so every connect is refused
+        dead = socket.socket()
+        dead.bind(('localhost', 0))
+        try:
+            run = subprocess.run(['./fluent_test', str(dead.getsockname()[1]), mode],
+                    stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                    timeout=mockserver.TIMEOUT)
+        finally:
+            dead.close()
+        self.assertEqual(50, int(run.stdout))
+        # counted every time, written out once
+        self.assertEqual(1, len(run.stderr.splitlines()))
+
+    def test_storm(self):
+        self.check_storm('storm')
+
+    def test_async_storm(self):
+        self.check_storm('async,storm')
+
+class TestUnixSocket(unittest.TestCase):
+    def test_unix_socket(self):
+        directory = tempfile.mkdtemp()
+        try:
+            path = os.path.join(directory, 'fluent.sock')
+            server = mockserver.MockUnixRecvServer(path)
+            fluent_test(['0', 'unix', path])
+
+            data = server.get_recieved()
+            eq = self.assertEqual
+            eq(1, len(data))
+            eq('fluent.test', data[0][0])
+            eq('userA', data[0][2]['from'])
+        finally:
+            shutil.rmtree(directory)